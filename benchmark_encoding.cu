@@ -0,0 +1,28 @@
+#include <chrono>
+#include <string>
+#include <cuda-ml/cuda-ml.h>
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
+    const int height{ 512 };
+    const int width{ 512 };
+    const int n_points{ height * width };
+    const size_t n_iterations{ 20 };
+    HashEncoding encoding{2};
+    const Tensor coordinates{ CoordinateGrid{height, width}.coordinates() };
+    const Tensor gradients{ Tensor::random_uniform(-1, 1, {n_points, static_cast<int>(encoding.output_dim())}) };
+    encoding(coordinates).backward(gradients);
+    auto start = std::chrono::steady_clock::now();
+    Tensor features{};
+    for (size_t iteration = 0; iteration < n_iterations; ++iteration) features = encoding(coordinates);
+    features[{0, 0}];
+    std::chrono::duration<double> duration{ std::chrono::steady_clock::now() - start };
+    std::cout << "forward encodings/s " << n_points * n_iterations / duration.count() << '\n';
+    start = std::chrono::steady_clock::now();
+    for (size_t iteration = 0; iteration < n_iterations; ++iteration) encoding(coordinates).backward(gradients);
+    encoding.tables.gradients()[{0, 0}];
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "forward and backward encodings/s " << n_points * n_iterations / duration.count() << '\n';
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <chrono>
+#include <string>
+#include <cuda-ml/cuda-ml.h>
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
+    const int height{ 1024 };
+    const int width{ 1024 };
+    const size_t batch_size{ 1 << 16 };
+    const size_t n_batches{ 200 };
+    const CoordinateGrid grid{ height, width };
+    const Tensor targets{ Tensor::random_uniform(0, 1, {height * width, 1}) };
+    DataLoader loader{grid, targets, batch_size, Sampling::shuffled};
+    MultiLayerPerceptron network{2, {64, 64, 1}, true, true};
+    network.flatten_parameters();
+    Adam optimizer{{&network.flat_parameters}, 0.001};
+    Tensor loss{};
+    const auto training_step = [&]() {
+        const Tensor step_loss{ mean_squared_error(network(loader.inputs), loader.targets) };
+        step_loss.backward();
+        loss = step_loss.detach();
+        optimizer.step();
+        optimizer.zero_gradients();
+    };
+    loader.next();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t batch = 0; batch < n_batches; ++batch) loader.next();
+    loader.inputs[{0, 0}];
+    std::chrono::duration<double> duration{ std::chrono::steady_clock::now() - start };
+    std::cout << "loading batches/s " << n_batches / duration.count() << '\n';
+    Graph training_graph{};
+    training_graph.capture(training_step);
+    start = std::chrono::steady_clock::now();
+    for (size_t batch = 0; batch < n_batches; ++batch) training_graph.replay();
+    loss[{0, 0}];
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "training batches/s " << n_batches / duration.count() << '\n';
+    start = std::chrono::steady_clock::now();
+    for (size_t batch = 0; batch < n_batches; ++batch) {
+        loader.next();
+        training_graph.replay();
+    }
+    loss[{0, 0}];
+    duration = std::chrono::steady_clock::now() - start;
+    std::cout << "loading and training batches/s " << n_batches / duration.count() << '\n';
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <chrono>
+#include <string>
+#include <cuda-ml/cuda-ml.h>
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
+    const int n_points{ 1 << 16 };
+    const size_t n_iterations{ 20 };
+    MultiLayerPerceptron network{32, {64, 64, 64, 3}};
+    const Tensor input{ Tensor::random_uniform(0, 1, {n_points, 32}) };
+    const Tensor targets{ Tensor::random_uniform(0, 1, {n_points, 3}) };
+    Adam optimizer{network.parameters(), 0.001};
+    const auto training_step = [&]() {
+        mean_squared_error(network(input), targets).backward();
+        optimizer.step();
+        optimizer.zero_gradients();
+    };
+    double inference_per_second[2]{};
+    double training_per_second[2]{};
+    for (int fused = 0; fused < 2; ++fused) {
+        network.fused = fused;
+        Tensor output{ network(input) };
+        output[{0, 0}];
+        auto start = std::chrono::steady_clock::now();
+        for (size_t iteration = 0; iteration < n_iterations; ++iteration) output = network(input);
+        output[{0, 0}];
+        std::chrono::duration<double> duration{ std::chrono::steady_clock::now() - start };
+        inference_per_second[fused] = n_points * n_iterations / duration.count();
+        training_step();
+        network.linear_layers[0].bias[{0, 0}];
+        start = std::chrono::steady_clock::now();
+        for (size_t iteration = 0; iteration < n_iterations; ++iteration) training_step();
+        network.linear_layers[0].bias[{0, 0}];
+        duration = std::chrono::steady_clock::now() - start;
+        training_per_second[fused] = n_points * n_iterations / duration.count();
+    }
+    std::cout << "layer-by-layer inference queries/s " << inference_per_second[0] << '\n';
+    std::cout << "fused inference queries/s " << inference_per_second[1] << '\n';
+    std::cout << "inference speedup " << inference_per_second[1] / inference_per_second[0] << '\n';
+    std::cout << "layer-by-layer training queries/s " << training_per_second[0] << '\n';
+    std::cout << "fused training queries/s " << training_per_second[1] << '\n';
+    std::cout << "training speedup " << training_per_second[1] / training_per_second[0] << '\n';
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <cuda-ml/cuda-ml.h>
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
+    const int height{ 1024 };
+    const int width{ 1024 };
+    const int n_points{ height * width };
+    const size_t n_iterations{ 20 };
+    PositionalEncoding encoding{2, 8};
+    MultiLayerPerceptron network{encoding.output_dim(), {64, 64, 3}, false, true};
+    const Tensor features{ encoding(CoordinateGrid{height, width}.coordinates()) };
+    network.quantize(encoding(Tensor::random_uniform(0, 1, {4096, 2})));
+    std::vector<float> outputs[2]{};
+    double queries_per_second[2]{};
+    for (int quantized = 0; quantized < 2; ++quantized) {
+        for (Linear& linear_layer : network.linear_layers) linear_layer.quantized = quantized;
+        Tensor output{ network(features) };
+        output[{0, 0}];
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t iteration = 0; iteration < n_iterations; ++iteration) output = network(features);
+        output[{0, 0}];
+        const std::chrono::duration<double> duration{ std::chrono::steady_clock::now() - start };
+        queries_per_second[quantized] = n_points * n_iterations / duration.count();
+        outputs[quantized] = output.to_host();
+    }
+    const auto range = std::minmax_element(outputs[0].begin(), outputs[0].end());
+    double squared_error{ 0 };
+    double max_error{ 0 };
+    for (size_t i = 0; i < outputs[0].size(); ++i) {
+        const double error{ std::abs(outputs[1][i] - outputs[0][i]) };
+        squared_error += error * error;
+        max_error = std::max(max_error, error);
+    }
+    const double rms_error{ std::sqrt(squared_error / outputs[0].size()) };
+    std::cout << "fp32 queries/s " << queries_per_second[0] << '\n';
+    std::cout << "int8 queries/s " << queries_per_second[1] << '\n';
+    std::cout << "speedup " << queries_per_second[1] / queries_per_second[0] << '\n';
+    std::cout << "max error " << max_error << '\n';
+    std::cout << "rms error " << rms_error << '\n';
+    std::cout << "psnr " << 20 * std::log10((*range.second - *range.first) / rms_error) << " dB\n";
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cuda-ml/cuda-ml.h>
+
+static bool close(const Tensor& tensor1, const Tensor& tensor2) {
+    const std::vector<float> values1{ tensor1.to_host() };
+    const std::vector<float> values2{ tensor2.to_host() };
+    if (values1.size() != values2.size()) return false;
+    for (size_t i = 0; i < values1.size(); ++i) {
+        if (std::fabs(values1[i] - values2[i]) > 1e-5f * (1 + std::fabs(values2[i]))) return false;
+    }
+    return true;
+}
+
+static bool fused_matches_unfused(const std::string& name, size_t n_levels, size_t n_inputs) {
+    Tensor a{ Tensor::random_uniform(0, 0.5, {16, 8}) };
+    Tensor b{ Tensor::random_uniform(0, 0.5, {1, 8}) };
+    std::vector<Tensor> extra_inputs{};
+    for (size_t i = 0; i < n_inputs; ++i) extra_inputs.push_back(Tensor::random_uniform(0, 0.5, {16, 1}));
+    Tensor fused_a{ a.detach() };
+    Tensor unfused_a{ a.detach() };
+    fused_a.requires_gradients();
+    unfused_a.requires_gradients();
+    Expression fused{ fused_a };
+    Tensor unfused{ unfused_a };
+    for (size_t level = 0; level < n_levels; ++level) {
+        fused = square(fused) * b + fused_a;
+        unfused = unfused * unfused * b + unfused_a;
+    }
+    for (const Tensor& input : extra_inputs) {
+        fused = fused + input * fused_a;
+        unfused = unfused + input * unfused_a;
+    }
+    const Tensor fused_output{ fused.evaluate() };
+    sum(fused_output).backward();
+    sum(unfused).backward();
+    const bool matches{ close(fused_output, unfused) && close(fused_a.gradients(), unfused_a.gradients()) };
+    std::cout << name << (matches ? " matches" : " differs") << '\n';
+    return matches;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
+    bool matches{ fused_matches_unfused("3 levels", 3, 0) };
+    matches = fused_matches_unfused("8 levels", 8, 0) && matches;
+    matches = fused_matches_unfused("12 inputs", 1, 12) && matches;
+    return matches ? 0 : 1;
+}
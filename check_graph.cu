@@ -0,0 +1,39 @@
+#include <string>
+#include <cuda-ml/cuda-ml.h>
+
+static bool replay_matches_eager(bool fused) {
+    const size_t n_replays{ 50 };
+    const Tensor input{ Tensor::random_uniform(0, 1, {256, 2}) };
+    const Tensor target{ Tensor::random_uniform(0, 1, {256, 1}) };
+    MultiLayerPerceptron captured_network{2, {32, 32, 1}, true, fused};
+    MultiLayerPerceptron eager_network{2, {32, 32, 1}, true, fused};
+    captured_network.flatten_parameters();
+    eager_network.flatten_parameters();
+    eager_network.flat_parameters.fill(0);
+    eager_network.flat_parameters += captured_network.flat_parameters.detach();
+    Adam captured_optimizer{{&captured_network.flat_parameters}, 0.01};
+    Adam eager_optimizer{{&eager_network.flat_parameters}, 0.01};
+    const auto training_step = [&](MultiLayerPerceptron& network, Optimizer& optimizer) {
+        mean_squared_error(network(input), target).backward();
+        optimizer.step();
+        optimizer.zero_gradients();
+    };
+    Graph graph{};
+    graph.capture([&]() { training_step(captured_network, captured_optimizer); });
+    for (size_t replay = 0; replay < n_replays; ++replay) graph.replay();
+    for (size_t step = 0; step < n_replays + 1; ++step) training_step(eager_network, eager_optimizer);
+    const std::vector<float> captured_parameters{ captured_network.flat_parameters.to_host() };
+    const std::vector<float> eager_parameters{ eager_network.flat_parameters.to_host() };
+    size_t n_mismatches{};
+    for (size_t i = 0; i < captured_parameters.size(); ++i) n_mismatches += captured_parameters[i] != eager_parameters[i];
+    std::cout << (fused ? "fused" : "unfused") << " parameters differing after capture and " << n_replays << " replays " << n_mismatches << '\n';
+    return !n_mismatches;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
+    const bool unfused_matches{ replay_matches_eager(false) };
+    const bool fused_matches{ replay_matches_eager(true) };
+    return unfused_matches && fused_matches ? 0 : 1;
+}
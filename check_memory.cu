@@ -0,0 +1,29 @@
+#include <string>
+#include <cuda-ml/cuda-ml.h>
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
+    const size_t n_steps{ 10000 };
+    const size_t warmup_steps{ 100 };
+    Tensor matrix{ Tensor::random_uniform(1, 2, {64, 32}) };
+    const Tensor other{ Tensor::random_uniform(1, 2, {64, 32}) };
+    const Tensor row{ Tensor::random_uniform(1, 2, {1, 32}) };
+    const Tensor column{ Tensor::random_uniform(1, 2, {64, 1}) };
+    matrix.requires_gradients();
+    size_t warm_bytes{};
+    for (size_t step = 0; step < n_steps; ++step) {
+        const Tensor elementwise{ (matrix + other) * other - matrix / other };
+        const Tensor broadcast{ (elementwise + row) * column - row / column };
+        broadcast.backward();
+        matrix.gradients().fill(0);
+        const size_t bytes{ allocator_stats().bytes_in_use };
+        if (step + 1 == warmup_steps) warm_bytes = bytes;
+        else if (step >= warmup_steps && bytes > warm_bytes) {
+            std::cout << "bytes in use grew from " << warm_bytes << " to " << bytes << " at step " << step + 1 << '\n';
+            return 1;
+        }
+    }
+    std::cout << "bytes in use stayed at " << warm_bytes << " for " << n_steps << " steps\n";
+    return 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "backend.h"
+
+struct AllocatorStats {
+    size_t bytes_in_use{};
+    size_t peak_bytes_in_use{};
+    size_t bytes_cached{};
+    size_t cache_hits{};
+    size_t cache_misses{};
+};
+
+struct CapturedBlock {
+    float* data;
+    size_t size;
+    bool freed;
+};
+
+class CachingAllocator {
+public:
+    CachingAllocator(Backend& backend);
+    ~CachingAllocator();
+    float* allocate(size_t size);
+    void deallocate(float* data);
+    void empty_cache();
+    AllocatorStats stats() const;
+    void begin_capture();
+    std::vector<CapturedBlock> end_capture();
+    void release_captured_blocks(const std::vector<float*>& blocks);
+private:
+    Backend& backend;
+    mutable std::mutex mutex{};
+    std::unordered_map<float*, size_t> block_sizes{};
+    std::unordered_map<std::thread::id, std::unordered_map<size_t, std::vector<float*>>> free_blocks{};
+    AllocatorStats allocator_stats{};
+    bool capturing{};
+    std::vector<float*> captured_blocks{};
+    std::unordered_set<float*> pinned_blocks{};
+    std::unordered_set<float*> freed_pinned_blocks{};
+    void cache_block(float* data, std::thread::id stream);
+    void release_cached_blocks();
+};
+
+size_t bucket_size(size_t size);
+CachingAllocator& allocator(Device device);
+void empty_cache(Device device = default_device());
+AllocatorStats allocator_stats(Device device = default_device());
@@ -2,26 +2,31 @@
 
 #include <vector>
 #include <memory>
+#include "expression.h"
 
 class Tensor;
 
 class Backward {
 public:
     std::vector<Tensor> tensors{};
+    std::vector<size_t> versions{};
     const std::vector<std::shared_ptr<Backward>> backwards{};
     Backward();
     Backward(const std::vector<std::shared_ptr<Backward>>& backwards);
     Backward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards);
     virtual void operator() (const Tensor& gradients);
 private:
+    virtual std::vector<Tensor> input_gradients(const Tensor& gradients) const;
     virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+    virtual void accumulate(const Tensor& gradients);
 };
 
 class AccumulateGradients : public Backward {
 public:
     const bool sum{};
     AccumulateGradients(bool sum = false);
-    virtual void operator() (const Tensor& gradients);
+private:
+    virtual void accumulate(const Tensor& gradients);
 };
 
 class AddBackward : public Backward {
@@ -43,6 +48,13 @@ private:
     virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
 };
 
+class DivideBackward : public Backward {
+public:
+    DivideBackward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards);
+private:
+    virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+};
+
 class MatrixMultiplyBackward : public Backward {
 public:
     MatrixMultiplyBackward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards);
@@ -50,6 +62,38 @@ private:
     virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
 };
 
+class LinearBackward : public Backward {
+public:
+    const bool relu{};
+    LinearBackward(const std::vector<Tensor>& tensors, bool relu, const std::vector<std::shared_ptr<Backward>>& backwards);
+private:
+    virtual std::vector<Tensor> input_gradients(const Tensor& gradients) const;
+};
+
+class PerceptronBackward : public Backward {
+public:
+    PerceptronBackward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards);
+private:
+    virtual std::vector<Tensor> input_gradients(const Tensor& gradients) const;
+};
+
+class HashEncodeBackward : public Backward {
+public:
+    const std::vector<int> shape{};
+    const HashGrid grid;
+    HashEncodeBackward(const Tensor& input, const std::vector<int>& shape, const HashGrid& grid, std::shared_ptr<Backward> backward);
+private:
+    virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+};
+
+class PositionalEncodeBackward : public Backward {
+public:
+    const FourierFeatures features;
+    PositionalEncodeBackward(const Tensor& output, const FourierFeatures& features, std::shared_ptr<Backward> backward);
+private:
+    virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+};
+
 class NegateBackward : public Backward {
 public:
     NegateBackward(std::shared_ptr<Backward> backward);
@@ -67,14 +111,60 @@ private:
 class SumBackward : public Backward {
 public:
     const std::vector<int> shape{};
-    SumBackward(const std::vector<int>& shape, std::shared_ptr<Backward> backward);
+    const std::vector<int> reduced_shape{};
+    SumBackward(const std::vector<int>& shape, const std::vector<int>& reduced_shape, std::shared_ptr<Backward> backward);
 private:
     virtual Tensor backward(const Tensor& gradients, size_t input_index) const;    
 };
 
+class SliceBackward : public Backward {
+public:
+    const std::vector<int> shape{};
+    const size_t dim{};
+    const size_t start{};
+    const size_t end{};
+    const size_t step{};
+    SliceBackward(const std::vector<int>& shape, size_t dim, size_t start, size_t end, size_t step, std::shared_ptr<Backward> backward);
+private:
+    virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+};
+
+class ExpandBackward : public Backward {
+public:
+    const std::vector<int> shape{};
+    ExpandBackward(const std::vector<int>& shape, std::shared_ptr<Backward> backward);
+private:
+    virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+};
+
+class ReshapeBackward : public Backward {
+public:
+    const std::vector<int> shape{};
+    ReshapeBackward(const std::vector<int>& shape, std::shared_ptr<Backward> backward);
+private:
+    virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+};
+
+class TransposeBackward : public Backward {
+public:
+    const size_t dim1{};
+    const size_t dim2{};
+    TransposeBackward(size_t dim1, size_t dim2, std::shared_ptr<Backward> backward);
+private:
+    virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
+};
+
 class ReluBackward : public Backward {
 public:
     ReluBackward(const Tensor& tensor, std::shared_ptr<Backward> backward);
 private:
     virtual Tensor backward(const Tensor& gradients, size_t input_index) const;
 };
+
+class ExpressionBackward : public Backward {
+public:
+    const Expression expression;
+    ExpressionBackward(const Expression& expression, const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards);
+private:
+    virtual std::vector<Tensor> input_gradients(const Tensor& gradients) const;
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+enum class Device { CPU, CUDA };
+
+enum class DType : unsigned char { float32, float16, bfloat16, int8 };
+
+const size_t max_rank{ 8 };
+
+struct Broadcast {
+    bool contiguous;
+    size_t rank;
+    size_t shape[max_rank];
+    size_t strides[max_rank];
+    size_t tensor1_strides[max_rank];
+    size_t tensor2_strides[max_rank];
+    size_t output_strides[max_rank];
+};
+
+struct Reduction {
+    size_t n_outputs;
+    size_t n_reduced;
+    size_t kept_rank;
+    size_t kept_shape[max_rank];
+    size_t kept_strides[max_rank];
+    size_t reduced_rank;
+    size_t reduced_shape[max_rank];
+    size_t reduced_strides[max_rank];
+    DType input_type;
+};
+
+enum class ExpressionOperation : unsigned char { load, constant, add, subtract, multiply, divide, negate, square, relu, relu_d };
+
+const size_t max_inputs{ 8 };
+const size_t max_instructions{ 32 };
+const size_t max_stack_size{ 8 };
+
+struct Program {
+    size_t n_instructions;
+    ExpressionOperation operations[max_instructions];
+    unsigned char operands[max_instructions];
+    float constants[max_instructions];
+    size_t n_inputs;
+    float* inputs[max_inputs];
+    bool contiguous[max_inputs];
+    size_t rank;
+    size_t shape[max_rank];
+    size_t strides[max_rank];
+    size_t input_strides[max_inputs][max_rank];
+};
+
+struct QuantizedLinear {
+    size_t input_strides[2];
+    size_t weights_strides[2];
+    DType input_type;
+    DType output_type;
+    float input_scale;
+    float output_scale;
+    bool relu;
+};
+
+const size_t max_layers{ 16 };
+
+struct Perceptron {
+    size_t n_layers;
+    size_t input_dim;
+    size_t width;
+    size_t output_dim;
+    size_t input_strides[2];
+    float* weights[max_layers];
+    float* biases[max_layers];
+    float* activations[max_layers];
+    float* pre_activation_gradients[max_layers];
+    float* bias_gradients[max_layers];
+};
+
+const size_t max_levels{ 32 };
+const size_t max_grid_dim{ 3 };
+
+struct HashGrid {
+    size_t input_dim;
+    size_t n_levels;
+    size_t n_features;
+    size_t table_size;
+    size_t input_strides[2];
+    size_t resolutions[max_levels];
+};
+
+struct FourierFeatures {
+    size_t input_dim;
+    size_t n_frequencies;
+    size_t input_strides[2];
+};
+
+struct PixelGrid {
+    size_t width;
+    size_t first;
+    float scales[2];
+};
+
+const size_t max_tensors{ 64 };
+
+struct AdamUpdate {
+    size_t n_tensors;
+    size_t offsets[max_tensors + 1];
+    float* parameters[max_tensors];
+    float* gradients[max_tensors];
+    float* first_moments[max_tensors];
+    float* second_moments[max_tensors];
+    float learning_rate;
+    float beta1;
+    float beta2;
+    float epsilon;
+    float weight_decay;
+    bool decoupled;
+};
+
+struct GradientScaling {
+    size_t n_tensors;
+    size_t offsets[max_tensors + 1];
+    float* gradients[max_tensors];
+    float max_gradient;
+    float growth_factor;
+    float backoff_factor;
+    size_t growth_interval;
+};
+
+class Backend {
+public:
+    virtual ~Backend() = default;
+    virtual float* allocate(size_t size) = 0;
+    virtual void deallocate(float* data) = 0;
+    virtual void copy_from_host(size_t size, const float* input, float* output) = 0;
+    virtual void copy_to_host(size_t size, const float* input, float* output) = 0;
+    virtual float* allocate_host(size_t size) = 0;
+    virtual void deallocate_host(float* data) = 0;
+    virtual std::function<bool(bool)> copy_to_host_async(size_t size, const float* input, float* output) = 0;
+    virtual std::function<bool(bool)> copy_from_host_async(size_t size, const float* input, float* output) = 0;
+    virtual void copy(size_t size, float* input, float* output) = 0;
+    virtual void convert(size_t n, DType input_type, DType output_type, float* input, float* output) = 0;
+    virtual void fill_scalar(size_t n, float scalar, float* output) = 0;
+    virtual void add(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* sum) = 0;
+    virtual void subtract(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* difference) = 0;
+    virtual void multiply(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* product) = 0;
+    virtual void divide(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* quotient) = 0;
+    virtual void matrix_multiply(size_t batch_size, size_t rank, size_t height, size_t width, size_t shared_dim, const size_t* tensor1_strides, const size_t* tensor2_strides, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product) = 0;
+    virtual void linear(size_t height, size_t width, size_t shared_dim, const size_t* input_strides, const size_t* weights_strides, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output) = 0;
+    virtual void linear_backward(size_t height, size_t width, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* bias_gradients) = 0;
+    virtual void quantized_linear(size_t height, size_t width, size_t shared_dim, const QuantizedLinear& layer, float* input, float* weights, float* scales, float* bias, float* output) = 0;
+    virtual void perceptron(size_t n, const Perceptron& perceptron, float* input, float* output) = 0;
+    virtual void perceptron_backward(size_t n, const Perceptron& perceptron, float* gradients) = 0;
+    virtual void hash_encode(size_t n, const HashGrid& grid, float* input, float* tables, float* output) = 0;
+    virtual void hash_encode_backward(size_t n, const HashGrid& grid, float* input, float* gradients, float* table_gradients) = 0;
+    virtual void positional_encode(size_t n, const FourierFeatures& features, float* input, float* output) = 0;
+    virtual void positional_encode_backward(size_t n, const FourierFeatures& features, float* output, float* gradients, float* input_gradients) = 0;
+    virtual void grid_coordinates(size_t n, const PixelGrid& grid, float* indices, float* output) = 0;
+    virtual void adam(const AdamUpdate& update, float* step, float* finite) = 0;
+    virtual void unscale_gradients(const GradientScaling& scaling, float* scale, float* finite) = 0;
+    virtual void update_scale(const GradientScaling& scaling, float* scale, float* finite, float* growth_tracker) = 0;
+    virtual void negate(size_t n, float* input, float* output) = 0;
+    virtual void square(size_t n, float* input, float* output) = 0;
+    virtual void sum(const Reduction& reduction, float* input, float* output) = 0;
+    virtual void relu(size_t n, float* input, float* output) = 0;
+    virtual void relu_d(size_t n, float* input, float* output) = 0;
+    virtual void evaluate(size_t n, const Program& program, float* output) = 0;
+    virtual std::function<void()> instantiate(const std::vector<std::function<void()>>& instructions) = 0;
+    virtual std::thread::id stream() = 0;
+};
+
+class CPUBackend : public Backend {
+public:
+    virtual float* allocate(size_t size);
+    virtual void deallocate(float* data);
+    virtual void copy_from_host(size_t size, const float* input, float* output);
+    virtual void copy_to_host(size_t size, const float* input, float* output);
+    virtual float* allocate_host(size_t size);
+    virtual void deallocate_host(float* data);
+    virtual std::function<bool(bool)> copy_to_host_async(size_t size, const float* input, float* output);
+    virtual std::function<bool(bool)> copy_from_host_async(size_t size, const float* input, float* output);
+    virtual void copy(size_t size, float* input, float* output);
+    virtual void convert(size_t n, DType input_type, DType output_type, float* input, float* output);
+    virtual void fill_scalar(size_t n, float scalar, float* output);
+    virtual void add(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* sum);
+    virtual void subtract(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* difference);
+    virtual void multiply(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* product);
+    virtual void divide(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* quotient);
+    virtual void matrix_multiply(size_t batch_size, size_t rank, size_t height, size_t width, size_t shared_dim, const size_t* tensor1_strides, const size_t* tensor2_strides, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product);
+    virtual void linear(size_t height, size_t width, size_t shared_dim, const size_t* input_strides, const size_t* weights_strides, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output);
+    virtual void linear_backward(size_t height, size_t width, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* bias_gradients);
+    virtual void quantized_linear(size_t height, size_t width, size_t shared_dim, const QuantizedLinear& layer, float* input, float* weights, float* scales, float* bias, float* output);
+    virtual void perceptron(size_t n, const Perceptron& perceptron, float* input, float* output);
+    virtual void perceptron_backward(size_t n, const Perceptron& perceptron, float* gradients);
+    virtual void hash_encode(size_t n, const HashGrid& grid, float* input, float* tables, float* output);
+    virtual void hash_encode_backward(size_t n, const HashGrid& grid, float* input, float* gradients, float* table_gradients);
+    virtual void positional_encode(size_t n, const FourierFeatures& features, float* input, float* output);
+    virtual void positional_encode_backward(size_t n, const FourierFeatures& features, float* output, float* gradients, float* input_gradients);
+    virtual void grid_coordinates(size_t n, const PixelGrid& grid, float* indices, float* output);
+    virtual void adam(const AdamUpdate& update, float* step, float* finite);
+    virtual void unscale_gradients(const GradientScaling& scaling, float* scale, float* finite);
+    virtual void update_scale(const GradientScaling& scaling, float* scale, float* finite, float* growth_tracker);
+    virtual void negate(size_t n, float* input, float* output);
+    virtual void square(size_t n, float* input, float* output);
+    virtual void sum(const Reduction& reduction, float* input, float* output);
+    virtual void relu(size_t n, float* input, float* output);
+    virtual void relu_d(size_t n, float* input, float* output);
+    virtual void evaluate(size_t n, const Program& program, float* output);
+    virtual std::function<void()> instantiate(const std::vector<std::function<void()>>& instructions);
+    virtual std::thread::id stream();
+};
+
+class CUDABackend : public Backend {
+public:
+    virtual float* allocate(size_t size);
+    virtual void deallocate(float* data);
+    virtual void copy_from_host(size_t size, const float* input, float* output);
+    virtual void copy_to_host(size_t size, const float* input, float* output);
+    virtual float* allocate_host(size_t size);
+    virtual void deallocate_host(float* data);
+    virtual std::function<bool(bool)> copy_to_host_async(size_t size, const float* input, float* output);
+    virtual std::function<bool(bool)> copy_from_host_async(size_t size, const float* input, float* output);
+    virtual void copy(size_t size, float* input, float* output);
+    virtual void convert(size_t n, DType input_type, DType output_type, float* input, float* output);
+    virtual void fill_scalar(size_t n, float scalar, float* output);
+    virtual void add(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* sum);
+    virtual void subtract(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* difference);
+    virtual void multiply(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* product);
+    virtual void divide(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* quotient);
+    virtual void matrix_multiply(size_t batch_size, size_t rank, size_t height, size_t width, size_t shared_dim, const size_t* tensor1_strides, const size_t* tensor2_strides, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product);
+    virtual void linear(size_t height, size_t width, size_t shared_dim, const size_t* input_strides, const size_t* weights_strides, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output);
+    virtual void linear_backward(size_t height, size_t width, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* bias_gradients);
+    virtual void quantized_linear(size_t height, size_t width, size_t shared_dim, const QuantizedLinear& layer, float* input, float* weights, float* scales, float* bias, float* output);
+    virtual void perceptron(size_t n, const Perceptron& perceptron, float* input, float* output);
+    virtual void perceptron_backward(size_t n, const Perceptron& perceptron, float* gradients);
+    virtual void hash_encode(size_t n, const HashGrid& grid, float* input, float* tables, float* output);
+    virtual void hash_encode_backward(size_t n, const HashGrid& grid, float* input, float* gradients, float* table_gradients);
+    virtual void positional_encode(size_t n, const FourierFeatures& features, float* input, float* output);
+    virtual void positional_encode_backward(size_t n, const FourierFeatures& features, float* output, float* gradients, float* input_gradients);
+    virtual void grid_coordinates(size_t n, const PixelGrid& grid, float* indices, float* output);
+    virtual void adam(const AdamUpdate& update, float* step, float* finite);
+    virtual void unscale_gradients(const GradientScaling& scaling, float* scale, float* finite);
+    virtual void update_scale(const GradientScaling& scaling, float* scale, float* finite, float* growth_tracker);
+    virtual void negate(size_t n, float* input, float* output);
+    virtual void square(size_t n, float* input, float* output);
+    virtual void sum(const Reduction& reduction, float* input, float* output);
+    virtual void relu(size_t n, float* input, float* output);
+    virtual void relu_d(size_t n, float* input, float* output);
+    virtual void evaluate(size_t n, const Program& program, float* output);
+    virtual std::function<void()> instantiate(const std::vector<std::function<void()>>& instructions);
+    virtual std::thread::id stream();
+private:
+    std::mutex host_mutex{};
+    std::unordered_map<float*, size_t> host_block_sizes{};
+    std::unordered_map<size_t, std::vector<float*>> free_host_blocks{};
+};
+
+size_t element_size(DType dtype);
+Backend& backend(Device device);
+void set_backend(Device device, Backend* backend);
+Device default_device();
+void set_default_device(Device device);
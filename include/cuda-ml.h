@@ -1,10 +1,17 @@
 #pragma once
 
+#include "allocator.h"
 #include "autodiff.h"
+#include "backend.h"
 #include "data.h"
+#include "expression.h"
+#include "graph.h"
+#ifdef __CUDACC__
 #include "kernels.h"
+#endif
 #include "loss.h"
 #include "network.h"
 #include "optimizer.h"
+#include "parallel.h"
 #include "tensor.h"
 #include "utils.h"
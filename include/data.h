@@ -1,10 +1,75 @@
 #pragma once
 
+#include <mutex>
 #include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include "tensor.h"
 
-class Tensor;
+class CoordinateGrid {
+public:
+    const int height{};
+    const int width{};
+    const bool normalized{};
+    CoordinateGrid(int height, int width, bool normalized = true);
+    size_t size() const;
+    PixelGrid pixel_grid(size_t first = 0) const;
+    Tensor coordinates(Device device = default_device()) const;
+    Tensor coordinates(size_t first, size_t n, Device device = default_device()) const;
+    Tensor coordinates(const Tensor& indices) const;
+};
 
-void read_image(const std::string& path, Tensor& tensor, int& height, int& width);
-void write_image(const std::string& path, Tensor& tensor, int height, int width);
+enum class Sampling { sequential, shuffled, stratified };
+
+class DataLoader {
+public:
+    Tensor inputs{};
+    Tensor targets{};
+    const size_t batch_size{};
+    const Sampling sampling{};
+    DataLoader(const Tensor& inputs, const Tensor& targets, size_t batch_size, Sampling sampling = Sampling::shuffled, Device device = default_device());
+    DataLoader(const CoordinateGrid& grid, const Tensor& targets, size_t batch_size, Sampling sampling = Sampling::shuffled, Device device = default_device());
+    DataLoader(const DataLoader&) = delete;
+    DataLoader& operator= (const DataLoader&) = delete;
+    ~DataLoader();
+    size_t n_batches() const;
+    void next();
+private:
+    size_t n_samples{};
+    size_t input_dim{};
+    size_t target_dim{};
+    size_t staged_input_dim{};
+    bool from_grid{};
+    PixelGrid grid{};
+    std::vector<float> input_data{};
+    std::vector<float> target_data{};
+    std::vector<size_t> order{};
+    size_t batch{};
+    std::mt19937 generator{};
+    std::shared_ptr<float> staging[2]{};
+    size_t slot{};
+    Tensor staged{};
+    std::function<bool(bool)> staged_copy{};
+    std::thread worker{};
+    std::mutex mutex{};
+    std::condition_variable wake{};
+    std::condition_variable finished{};
+    bool requested{};
+    bool stop{};
+    void start(Device device);
+    void reorder();
+    void gather(float* buffer);
+    void request(size_t slot);
+    void wait();
+    void work();
+};
+
+void read_image(const std::string& path, Tensor& tensor, int& height, int& width, bool normalized = false);
+void write_image(const std::string& path, Tensor& tensor, int height, int width, int bit_depth = 8, bool normalized = false);
+void render_image(const std::string& path, const std::function<Tensor(const Tensor&)>& model, int height, int width, int bit_depth = 8);
 void create_coordinates(int height, int width, Tensor& tensor);
 void normalize(const std::vector<float>& max, Tensor& tensor);
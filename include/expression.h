@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "tensor.h"
+
+class ExpressionNode;
+
+class Expression {
+public:
+    std::shared_ptr<const ExpressionNode> node{};
+    Expression(const Tensor& tensor);
+    Expression(float scalar);
+    Expression(ExpressionOperation operation, const Expression& input);
+    Expression(ExpressionOperation operation, const Expression& input1, const Expression& input2);
+    Tensor evaluate() const;
+    Expression detach() const;
+    std::vector<Tensor> gradients(const Tensor& output_gradients, const std::vector<Tensor>& inputs, const std::vector<bool>& required) const;
+};
+
+class ExpressionNode {
+public:
+    const ExpressionOperation operation{};
+    const Tensor tensor{};
+    const float constant{};
+    const std::vector<Expression> inputs{};
+    ExpressionNode(const Tensor& tensor);
+    ExpressionNode(float constant);
+    ExpressionNode(ExpressionOperation operation, const std::vector<Expression>& inputs);
+};
+
+Expression operator+ (const Expression& expression1, const Expression& expression2);
+Expression operator- (const Expression& expression1, const Expression& expression2);
+Expression operator* (const Expression& expression1, const Expression& expression2);
+Expression operator/ (const Expression& expression1, const Expression& expression2);
+Expression operator- (const Expression& input);
+Expression square(const Expression& input);
+Expression relu(const Expression& input);
+Expression relu_d(const Expression& input);
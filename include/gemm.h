@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+
+struct Matrix {
+    float* data;
+    size_t batch_stride;
+    size_t row_stride;
+    size_t column_stride;
+};
+
+struct Epilogue {
+    const float* bias;
+    bool relu;
+};
+
+void gemm(size_t batch_size, size_t height, size_t width, size_t shared_dim, Matrix tensor1, Matrix tensor2, Matrix output, Epilogue epilogue = Epilogue{ nullptr, false });
+
+struct QuantizedMatrix {
+    const void* data;
+    size_t row_stride;
+    size_t column_stride;
+    bool int8;
+    float scale;
+};
+
+struct QuantizedEpilogue {
+    const float* scales;
+    const float* bias;
+    bool relu;
+    bool int8;
+    float scale;
+};
+
+inline signed char quantize(float value) {
+    value = value > -127.f ? value : -127.f;
+    value = value < 127.f ? value : 127.f;
+    return static_cast<signed char>(static_cast<int>(value + 12582912.f) - 12582912);
+}
+
+void gemm_int8(size_t height, size_t width, size_t shared_dim, QuantizedMatrix input, QuantizedMatrix weights, void* output, QuantizedEpilogue epilogue);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include "backend.h"
+#include "allocator.h"
+
+struct Instruction {
+    std::function<void(Backend& backend, const std::vector<float*>& buffers)> run;
+    std::vector<float*> buffers;
+};
+
+struct MemoryPlan {
+    size_t n_buffers{};
+    size_t naive_bytes{};
+    size_t planned_bytes{};
+    size_t persistent_bytes{};
+};
+
+class RecordingBackend : public Backend {
+public:
+    std::vector<Instruction> instructions{};
+    RecordingBackend(Backend& backend);
+    virtual float* allocate(size_t size);
+    virtual void deallocate(float* data);
+    virtual void copy_from_host(size_t size, const float* input, float* output);
+    virtual void copy_to_host(size_t size, const float* input, float* output);
+    virtual float* allocate_host(size_t size);
+    virtual void deallocate_host(float* data);
+    virtual std::function<bool(bool)> copy_to_host_async(size_t size, const float* input, float* output);
+    virtual std::function<bool(bool)> copy_from_host_async(size_t size, const float* input, float* output);
+    virtual void copy(size_t size, float* input, float* output);
+    virtual void convert(size_t n, DType input_type, DType output_type, float* input, float* output);
+    virtual void fill_scalar(size_t n, float scalar, float* output);
+    virtual void add(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* sum);
+    virtual void subtract(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* difference);
+    virtual void multiply(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* product);
+    virtual void divide(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* quotient);
+    virtual void matrix_multiply(size_t batch_size, size_t rank, size_t height, size_t width, size_t shared_dim, const size_t* tensor1_strides, const size_t* tensor2_strides, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product);
+    virtual void linear(size_t height, size_t width, size_t shared_dim, const size_t* input_strides, const size_t* weights_strides, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output);
+    virtual void linear_backward(size_t height, size_t width, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* bias_gradients);
+    virtual void quantized_linear(size_t height, size_t width, size_t shared_dim, const QuantizedLinear& layer, float* input, float* weights, float* scales, float* bias, float* output);
+    virtual void perceptron(size_t n, const Perceptron& perceptron, float* input, float* output);
+    virtual void perceptron_backward(size_t n, const Perceptron& perceptron, float* gradients);
+    virtual void hash_encode(size_t n, const HashGrid& grid, float* input, float* tables, float* output);
+    virtual void hash_encode_backward(size_t n, const HashGrid& grid, float* input, float* gradients, float* table_gradients);
+    virtual void positional_encode(size_t n, const FourierFeatures& features, float* input, float* output);
+    virtual void positional_encode_backward(size_t n, const FourierFeatures& features, float* output, float* gradients, float* input_gradients);
+    virtual void grid_coordinates(size_t n, const PixelGrid& grid, float* indices, float* output);
+    virtual void adam(const AdamUpdate& update, float* step, float* finite);
+    virtual void unscale_gradients(const GradientScaling& scaling, float* scale, float* finite);
+    virtual void update_scale(const GradientScaling& scaling, float* scale, float* finite, float* growth_tracker);
+    virtual void negate(size_t n, float* input, float* output);
+    virtual void square(size_t n, float* input, float* output);
+    virtual void sum(const Reduction& reduction, float* input, float* output);
+    virtual void relu(size_t n, float* input, float* output);
+    virtual void relu_d(size_t n, float* input, float* output);
+    virtual void evaluate(size_t n, const Program& program, float* output);
+    virtual std::function<void()> instantiate(const std::vector<std::function<void()>>& instructions);
+    virtual std::thread::id stream();
+private:
+    Backend& backend;
+    void record(const std::vector<float*>& buffers, const std::function<void(Backend& backend, const std::vector<float*>& buffers)>& run);
+};
+
+class Graph {
+public:
+    const Device device{};
+    Graph(Device device = default_device());
+    Graph(const Graph&) = delete;
+    Graph& operator= (const Graph&) = delete;
+    ~Graph();
+    // Runs the step once while recording it, so after capture and n replays the step has run n + 1 times.
+    void capture(const std::function<void()>& step);
+    void replay() const;
+    size_t size() const;
+    MemoryPlan memory_plan() const;
+private:
+    size_t n_instructions{};
+    MemoryPlan plan{};
+    float* arena{};
+    std::vector<float*> blocks{};
+    std::function<void()> replay_step{};
+    void plan_memory(const std::vector<CapturedBlock>& captured_blocks, std::vector<Instruction>& instructions);
+    void release();
+};
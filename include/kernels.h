@@ -1,15 +1,38 @@
 #pragma once
 
+#include "backend.h"
+
+const int linear_tile{ 16 };
+const int perceptron_tile{ 32 };
+const int max_perceptron_width{ 128 };
+const int perceptron_threads{ 256 };
+const int perceptron_weight_rows{ 16 };
+const int perceptron_items{ perceptron_tile * max_perceptron_width / perceptron_threads };
+
 __global__ void fill_scalar(size_t n, float scalar, float* output);
-__global__ void add(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* sum);
-__global__ void subtract(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* difference);
-__global__ void subtract(size_t n, float* tensor1, float* tensor2, float* difference);
-__global__ void multiply(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* product);
-__global__ void divide(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* quotient);
-__global__ void matrix_multiply(size_t rank, size_t height, size_t width, size_t shared_dim, size_t* tensor1_strides, size_t* tensor2_strides, float* tensor1, float* tensor2, float* matrix_product);
+__global__ void convert(size_t n, DType input_type, DType output_type, float* input, float* output);
+__global__ void add(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* sum);
+__global__ void subtract(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* difference);
+__global__ void multiply(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* product);
+__global__ void divide(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* quotient);
+__global__ void matrix_multiply(size_t height, size_t width, size_t shared_dim, size_t tensor1_row_stride, size_t tensor1_column_stride, size_t tensor2_row_stride, size_t tensor2_column_stride, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product);
+__global__ void linear(size_t height, size_t width, size_t shared_dim, size_t input_row_stride, size_t input_column_stride, size_t weights_row_stride, size_t weights_column_stride, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output);
+__global__ void quantized_linear(size_t height, size_t width, size_t shared_dim, QuantizedLinear layer, float* input, float* weights, float* scales, float* bias, float* output);
+__global__ void linear_backward(size_t height, size_t width, size_t chunk_size, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* partial_sums);
+__global__ void perceptron(size_t n, Perceptron perceptron, float* input, float* output);
+__global__ void perceptron_backward(size_t n, Perceptron perceptron, float* gradients);
+__global__ void hash_encode(size_t n, HashGrid grid, float* input, float* tables, float* output);
+__global__ void hash_encode_backward(size_t n, HashGrid grid, float* input, float* gradients, float* table_gradients);
+__global__ void positional_encode(size_t n, FourierFeatures features, float* input, float* output);
+__global__ void positional_encode_backward(size_t n, FourierFeatures features, float* output, float* gradients, float* input_gradients);
+__global__ void grid_coordinates(size_t n, PixelGrid grid, float* indices, float* output);
+__global__ void adam(AdamUpdate update, float* step, float* finite);
+__global__ void unscale_gradients(GradientScaling scaling, float* scale, float* finite);
+__global__ void update_scale(GradientScaling scaling, float* scale, float* finite, float* growth_tracker);
 __global__ void negate(size_t n, float* input, float* output);
 __global__ void square(size_t n, float* input, float* output);
-__global__ void sum(size_t n, float* input, float* output);
-__global__ void batch_sum(size_t n, size_t batch_size, size_t stride, float* input, float* output);
+__global__ void reduce_rows(Reduction reduction, size_t chunk_size, float* input, float* output);
+__global__ void reduce_columns(Reduction reduction, size_t chunk_size, float* input, float* output);
 __global__ void relu(size_t n, float* input, float* output);
 __global__ void relu_d(size_t n, float* input, float* output);
+__global__ void evaluate(size_t n, Program program, float* output);
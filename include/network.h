@@ -4,20 +4,30 @@
 #include <initializer_list>
 #include "tensor.h"
 
+const size_t flat_alignment{ 16 };
+
 class Module {
 public:
+    Tensor flat_parameters{};
+    Tensor flat_gradients{};
     virtual Tensor operator() (const Tensor& input) const = 0;
     virtual std::vector<Tensor*> parameters();
     void detach();
+    void flatten_parameters();
 };
 
 class Linear : public Module {
 public:
     Tensor weights{};
     Tensor bias{};
+    Tensor quantized_weights{};
+    Tensor weight_scales{};
+    float input_scale{};
+    bool quantized{};
     Linear(size_t input_dim, size_t output_dim, bool requires_gradients = true);
     virtual Tensor operator() (const Tensor& input) const;
     virtual std::vector<Tensor*> parameters();
+    void quantize(const Tensor& calibration_input);
 };
 
 class ReLU : public Module {
@@ -25,11 +35,36 @@ public:
     virtual Tensor operator() (const Tensor& input) const;
 };
 
+class HashEncoding : public Module {
+public:
+    Tensor tables{};
+    const HashGrid grid;
+    HashEncoding(size_t input_dim, size_t n_levels = 16, size_t n_features = 2, size_t log2_table_size = 19, size_t base_resolution = 16, size_t max_resolution = 2048, bool requires_gradients = true);
+    size_t output_dim() const;
+    virtual Tensor operator() (const Tensor& input) const;
+    virtual std::vector<Tensor*> parameters();
+};
+
+class PositionalEncoding : public Module {
+public:
+    const size_t input_dim{};
+    const size_t n_frequencies{};
+    const bool cache{};
+    PositionalEncoding(size_t input_dim, size_t n_frequencies = 10, bool cache = false);
+    size_t output_dim() const;
+    virtual Tensor operator() (const Tensor& input) const;
+private:
+    mutable Tensor cached_input{};
+    mutable Tensor cached_output{};
+    mutable size_t cached_version{};
+};
+
 class MultiLayerPerceptron : public Module {
 public:
     std::vector<Linear> linear_layers{};
-    const ReLU relu_layer{};
-    MultiLayerPerceptron(size_t input_layer_dim, std::initializer_list<size_t> layer_dims, bool requires_gradients = true);
+    bool fused{};
+    MultiLayerPerceptron(size_t input_layer_dim, std::initializer_list<size_t> layer_dims, bool requires_gradients = true, bool fused = false);
     virtual Tensor operator() (const Tensor& input) const;
     virtual std::vector<Tensor*> parameters();
+    void quantize(const Tensor& calibration_input);
 };
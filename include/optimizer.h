@@ -10,6 +10,19 @@ public:
     Optimizer(const std::vector<Tensor*>& parameters, float learning_rate);
     virtual void step() = 0;
     void zero_gradients() const;
+    void mixed_precision(DType dtype, float initial_scale = 65536, float growth_factor = 2, float backoff_factor = 0.5, size_t growth_interval = 2000);
+    Tensor scale_loss(const Tensor& loss) const;
+    const Tensor& loss_scale() const;
+protected:
+    std::vector<Tensor> master_parameters{};
+    Tensor finite_gradients{};
+    Tensor& master(size_t index);
+    void unscale_gradients();
+    void update_parameters();
+private:
+    GradientScaling scaling{};
+    Tensor scale{};
+    Tensor growth_tracker{};
 };
 
 class StochasticGradientDescent : public Optimizer {
@@ -17,3 +30,22 @@ public:
     StochasticGradientDescent(const std::vector<Tensor*>& parameters, float learning_rate);
     virtual void step();
 };
+
+class Adam : public Optimizer {
+public:
+    Adam(const std::vector<Tensor*>& parameters, float learning_rate = 0.001, float beta1 = 0.9, float beta2 = 0.999, float epsilon = 1e-8, float weight_decay = 0);
+    virtual void step();
+protected:
+    Adam(const std::vector<Tensor*>& parameters, float learning_rate, float beta1, float beta2, float epsilon, float weight_decay, bool decoupled);
+private:
+    AdamUpdate update{};
+    std::vector<Tensor> first_moments{};
+    std::vector<Tensor> second_moments{};
+    Tensor step_count{};
+    Tensor one{};
+};
+
+class AdamW : public Adam {
+public:
+    AdamW(const std::vector<Tensor*>& parameters, float learning_rate = 0.001, float beta1 = 0.9, float beta2 = 0.999, float epsilon = 1e-8, float weight_decay = 0.01);
+};
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+size_t n_threads();
+void parallel_for(size_t n, size_t grain_size, const std::function<void(size_t begin, size_t end)>& body);
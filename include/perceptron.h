@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include "backend.h"
+
+bool perceptron_width_supported(size_t width);
+void perceptron_forward(size_t n, const Perceptron& perceptron, const float* input, float* output);
+void perceptron_backward(size_t n, const Perceptron& perceptron, const float* gradients);
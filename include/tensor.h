@@ -2,10 +2,24 @@
 
 #include <vector>
 #include <memory>
+#include <functional>
 #include <iostream>
+#include "backend.h"
 
 class Backward;
 
+class Readback {
+public:
+    Readback();
+    Readback(std::shared_ptr<float> data, const std::function<bool(bool)>& wait);
+    bool valid() const;
+    bool ready() const;
+    float get() const;
+private:
+    std::shared_ptr<float> data{};
+    std::function<bool(bool)> wait{};
+};
+
 class Tensor {
 public:
     std::vector<int> shape{};
@@ -13,18 +27,33 @@ public:
     std::vector<size_t> strides{};
     size_t n_elements{};
     size_t size{};
+    Device device{};
+    DType dtype{ DType::float32 };
     std::shared_ptr<float> data{};
     std::shared_ptr<Backward> backward_pointer{};
+    std::shared_ptr<size_t> version{};
 
     Tensor();
-    Tensor(const std::vector<int>& shape);
-    static Tensor from_scalar(float scalar, const std::vector<int>& shape);
-    static Tensor from_vector(const std::vector<float>& vector, const std::vector<int>& shape);
-    static Tensor random_uniform(float min, float max, const std::vector<int>& shape);
-    static Tensor random_normal(float mean, float standard_deviation, const std::vector<int>& shape);
+    Tensor(const std::vector<int>& shape, Device device = default_device(), DType dtype = DType::float32);
+    static Tensor from_scalar(float scalar, const std::vector<int>& shape, Device device = default_device());
+    static Tensor from_vector(const std::vector<float>& vector, const std::vector<int>& shape, Device device = default_device());
+    static Tensor random_uniform(float min, float max, const std::vector<int>& shape, Device device = default_device());
+    static Tensor random_normal(float mean, float standard_deviation, const std::vector<int>& shape, Device device = default_device());
 
     float operator[] (const std::vector<int>& indices) const;
+    Readback read_async(const std::vector<int>& indices) const;
+    std::vector<float> to_host() const;
     Tensor transpose(size_t dim1, size_t dim2) const;
+    Tensor view(size_t offset, const std::vector<int>& shape) const;
+    Tensor slice(size_t dim, size_t start, size_t end, size_t step = 1) const;
+    Tensor narrow(size_t dim, size_t start, size_t length) const;
+    Tensor select(size_t dim, size_t index) const;
+    Tensor reshape(const std::vector<int>& shape) const;
+    Tensor expand(const std::vector<int>& shape) const;
+    bool is_contiguous() const;
+    Tensor contiguous() const;
+    Tensor to(Device device) const;
+    Tensor to(DType dtype) const;
     void requires_gradients(bool sum = false);
     Tensor detach() const;
     void backward() const;
@@ -32,18 +61,45 @@ public:
     Tensor& gradients() const;
 
     void fill(float scalar);
+    Tensor& add_(const Tensor& tensor);
+    Tensor& subtract_(const Tensor& tensor);
+    Tensor& multiply_(const Tensor& tensor);
+    Tensor& divide_(const Tensor& tensor);
+    Tensor& negate_();
+    Tensor& square_();
+    Tensor& relu_();
+    Tensor& operator+= (const Tensor& tensor);
     Tensor& operator-= (const Tensor& tensor);
+    Tensor& operator*= (const Tensor& tensor);
+    Tensor& operator/= (const Tensor& tensor);
     friend Tensor operator- (const Tensor& input);
     friend Tensor operator+ (const Tensor& tensor1, const Tensor& tensor2);
     friend Tensor operator- (const Tensor& tensor1, const Tensor& tensor2);
     friend Tensor operator* (const Tensor& tensor1, const Tensor& tensor2);
     friend Tensor operator/ (const Tensor& tensor1, const Tensor& tensor2);
     friend Tensor mm (const Tensor& tensor1, const Tensor& tensor2);
+    friend Tensor linear (const Tensor& input, const Tensor& weights, const Tensor& bias, bool apply_relu);
+    friend Tensor perceptron (const Tensor& input, const std::vector<Tensor>& weights, const std::vector<Tensor>& biases);
+    friend Tensor hash_encode (const Tensor& input, const Tensor& tables, const HashGrid& grid);
+    friend Tensor positional_encode (const Tensor& input, size_t n_frequencies);
     friend Tensor relu (const Tensor& input);
     friend Tensor relu_d (const Tensor& input);
     friend Tensor square(const Tensor& input);
     friend Tensor sum (const Tensor& input);
-    friend Tensor batch_sum (const Tensor& input);
 
     friend std::ostream& operator<< (std::ostream& out, const Tensor& tensor);
 };
+
+Tensor sum(const Tensor& input, const std::vector<int>& dims, bool keepdim = false);
+Tensor& add(const Tensor& tensor1, const Tensor& tensor2, Tensor& output);
+Tensor& subtract(const Tensor& tensor1, const Tensor& tensor2, Tensor& output);
+Tensor& multiply(const Tensor& tensor1, const Tensor& tensor2, Tensor& output);
+Tensor& divide(const Tensor& tensor1, const Tensor& tensor2, Tensor& output);
+Tensor& negate(const Tensor& input, Tensor& output);
+Tensor& square(const Tensor& input, Tensor& output);
+Tensor& relu(const Tensor& input, Tensor& output);
+Tensor& relu_d(const Tensor& input, Tensor& output);
+Tensor& mm(const Tensor& tensor1, const Tensor& tensor2, Tensor& output);
+Tensor& linear(const Tensor& input, const Tensor& weights, const Tensor& bias, bool apply_relu, Tensor& output);
+Tensor& sum(const Tensor& input, const std::vector<int>& dims, bool keepdim, Tensor& output);
+Tensor quantized_linear(const Tensor& input, const Tensor& weights, const Tensor& scales, const Tensor& bias, float input_scale, bool apply_relu, float output_scale = 0);
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <vector>
+#include "backend.h"
+
 class Tensor;
 
-void prepare_broadcast(const Tensor& tensor1, const Tensor& tensor2, size_t** d_tensor1_strides, size_t** d_tensor2_strides, size_t** d_strides, Tensor& sum);
-float* dataMalloc(size_t size);
+void require_float32(const Tensor& tensor);
+std::vector<int> broadcast_shape(const Tensor& tensor1, const Tensor& tensor2);
+void prepare_broadcast(const Tensor& tensor1, const Tensor& tensor2, const Tensor& output, Broadcast& broadcast);
+bool prepare_perceptron(const Tensor& input, const std::vector<Tensor>& weights, const std::vector<Tensor>& biases, Perceptron& perceptron);
+void prepare_reduction(const Tensor& input, const std::vector<int>& dims, bool keepdim, Reduction& reduction, std::vector<int>& reduced_shape, std::vector<int>& shape);
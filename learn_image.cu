@@ -1,31 +1,52 @@
+#include <chrono>
+#include <string>
 #include <cuda-ml/cuda-ml.h>
 
-int main()
+int main(int argc, char** argv)
 {
+    if (argc > 1 && std::string{ argv[1] } == "cpu") set_default_device(Device::CPU);
     Tensor targets{};
-    Tensor coordinates{};
     int height{};
     int width{};
-    read_image("image.png", targets, height, width);
-    create_coordinates(height, width, coordinates);
-    normalize({255}, targets);
-    normalize({static_cast<float>(height - 1), static_cast<float>(width - 1)}, coordinates);
-    MultiLayerPerceptron network{2, {64, 1}};
-    StochasticGradientDescent optimizer{network.parameters(), 0.001};
+    read_image("image.png", targets, height, width, true);
+    const CoordinateGrid grid{ height, width };
+    MultiLayerPerceptron network{2, {64, static_cast<size_t>(targets.shape[1])}, true, true};
+    network.flatten_parameters();
+    Adam optimizer{{&network.flat_parameters}, 0.001};
+    DataLoader loader{grid, targets, 2048, Sampling::stratified};
     const size_t n_epochs{ 5000 };
     const size_t print_epochs{ 100 };
-    for (int epoch = 0; epoch < n_epochs; ++epoch) {
-        const Tensor predictions{ network(coordinates) };
-        const Tensor loss{ mean_squared_error(predictions, targets) };
-        loss.backward();
+    Tensor loss{};
+    const auto training_step = [&]() {
+        const Tensor predictions{ network(loader.inputs) };
+        const Tensor step_loss{ mean_squared_error(predictions, loader.targets) };
+        step_loss.backward();
+        loss = step_loss.detach();
         optimizer.step();
         optimizer.zero_gradients();
-        if ((epoch + 1) % print_epochs == 0)
-            std::cout << "epoch " << epoch + 1 << " loss " << loss[{0, 0}] << '\n';
+    };
+    Graph training_graph{};
+    Readback loss_readback{};
+    int loss_epoch{};
+    const auto start = std::chrono::steady_clock::now();
+    for (int epoch = 0; epoch < n_epochs; ++epoch) {
+        for (size_t batch = 0; batch < loader.n_batches(); ++batch) {
+            loader.next();
+            if (epoch == 0 && batch == 0) training_graph.capture(training_step);
+            else training_graph.replay();
+        }
+        if ((epoch + 1) % print_epochs == 0) {
+            if (loss_readback.valid()) std::cout << "epoch " << loss_epoch << " loss " << loss_readback.get() << '\n';
+            loss_readback = loss.read_async({0, 0});
+            loss_epoch = epoch + 1;
+        }
     }
+    std::cout << "epoch " << loss_epoch << " loss " << loss_readback.get() << '\n';
+    const std::chrono::duration<double> duration{ std::chrono::steady_clock::now() - start };
+    std::cout << "epochs/s " << n_epochs / duration.count() << '\n';
+    const MemoryPlan memory_plan{ training_graph.memory_plan() };
+    std::cout << "planned " << memory_plan.planned_bytes << " of " << memory_plan.naive_bytes << " bytes\n";
     network.detach();
-    Tensor predictions{ network(coordinates) };
-    normalize({1. / 255.}, predictions);
-    write_image("reconstruction.png", predictions, height, width);
+    render_image("reconstruction.png", network, height, width);
     return 0;
 }
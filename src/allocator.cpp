@@ -0,0 +1,137 @@
+#include <new>
+#include <stdexcept>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include "allocator.h"
+
+// Blocks are reused in the order operations are issued. Each host thread launches its kernels on
+// its own stream, so a freed block is cached under the stream of the thread that freed it and only
+// handed out again to allocations from that stream, where later kernels are ordered after the free.
+// A tensor used by more than one thread must be freed on the thread whose stream used it last.
+// Blocks allocated while a graph is captured are pinned: replays write to their addresses, so
+// they only return to the cache once they are freed and the graph has released them.
+
+CachingAllocator::CachingAllocator(Backend& backend) : backend{ backend } {}
+
+CachingAllocator::~CachingAllocator() {
+    release_cached_blocks();
+}
+
+float* CachingAllocator::allocate(size_t size) {
+    const size_t block_size{ bucket_size(size) };
+    const std::thread::id stream{ backend.stream() };
+    std::lock_guard<std::mutex> lock{ mutex };
+    float* data{};
+    std::vector<float*>& blocks{ free_blocks[stream][block_size] };
+    if (blocks.size()) {
+        data = blocks.back();
+        blocks.pop_back();
+        allocator_stats.bytes_cached -= block_size;
+        ++allocator_stats.cache_hits;
+    }
+    else {
+        data = backend.allocate(block_size);
+        if (!data) {
+            release_cached_blocks();
+            data = backend.allocate(block_size);
+        }
+        if (!data) throw std::bad_alloc{};
+        ++allocator_stats.cache_misses;
+    }
+    block_sizes[data] = block_size;
+    if (capturing) {
+        captured_blocks.push_back(data);
+        pinned_blocks.insert(data);
+    }
+    allocator_stats.bytes_in_use += block_size;
+    allocator_stats.peak_bytes_in_use = std::max(allocator_stats.peak_bytes_in_use, allocator_stats.bytes_in_use);
+    return data;
+}
+
+void CachingAllocator::deallocate(float* data) {
+    if (!data) return;
+    const std::thread::id stream{ backend.stream() };
+    std::lock_guard<std::mutex> lock{ mutex };
+    if (pinned_blocks.count(data)) freed_pinned_blocks.insert(data);
+    else cache_block(data, stream);
+}
+
+void CachingAllocator::begin_capture() {
+    std::lock_guard<std::mutex> lock{ mutex };
+    if (capturing) throw std::logic_error("allocator is already capturing");
+    capturing = true;
+}
+
+std::vector<CapturedBlock> CachingAllocator::end_capture() {
+    std::lock_guard<std::mutex> lock{ mutex };
+    capturing = false;
+    std::vector<CapturedBlock> blocks{};
+    for (float* data : captured_blocks) blocks.push_back(CapturedBlock{ data, block_sizes[data], freed_pinned_blocks.count(data) > 0 });
+    captured_blocks.clear();
+    return blocks;
+}
+
+void CachingAllocator::release_captured_blocks(const std::vector<float*>& blocks) {
+    const std::thread::id stream{ backend.stream() };
+    std::lock_guard<std::mutex> lock{ mutex };
+    for (float* data : blocks) {
+        pinned_blocks.erase(data);
+        if (freed_pinned_blocks.erase(data)) cache_block(data, stream);
+    }
+}
+
+void CachingAllocator::cache_block(float* data, std::thread::id stream) {
+    const auto block = block_sizes.find(data);
+    const size_t block_size{ block->second };
+    block_sizes.erase(block);
+    free_blocks[stream][block_size].push_back(data);
+    allocator_stats.bytes_in_use -= block_size;
+    allocator_stats.bytes_cached += block_size;
+}
+
+void CachingAllocator::empty_cache() {
+    std::lock_guard<std::mutex> lock{ mutex };
+    release_cached_blocks();
+}
+
+AllocatorStats CachingAllocator::stats() const {
+    std::lock_guard<std::mutex> lock{ mutex };
+    return allocator_stats;
+}
+
+void CachingAllocator::release_cached_blocks() {
+    for (auto& stream_blocks : free_blocks) {
+        for (auto& blocks : stream_blocks.second) {
+            for (float* data : blocks.second) backend.deallocate(data);
+        }
+    }
+    free_blocks.clear();
+    allocator_stats.bytes_cached = 0;
+}
+
+size_t bucket_size(size_t size) {
+    const size_t minimum_size{ 512 };
+    if (size <= minimum_size) return minimum_size;
+    size_t power{ minimum_size };
+    while (power * 2 <= size) power *= 2;
+    const size_t step{ power / 4 };
+    return (size + step - 1) / step * step;
+}
+
+CachingAllocator& allocator(Device device) {
+    if (device == Device::CPU) {
+        static CachingAllocator cpu_allocator{ backend(Device::CPU) };
+        return cpu_allocator;
+    }
+    static CachingAllocator cuda_allocator{ backend(Device::CUDA) };
+    return cuda_allocator;
+}
+
+void empty_cache(Device device) {
+    allocator(device).empty_cache();
+}
+
+AllocatorStats allocator_stats(Device device) {
+    return allocator(device).stats();
+}
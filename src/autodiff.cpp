@@ -1,22 +1,71 @@
 #include <vector>
+#include <utility>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
 #include "autodiff.h"
 #include "tensor.h"
+#include "expression.h"
+
+static std::vector<size_t> saved_versions(const std::vector<Tensor>& tensors) {
+    std::vector<size_t> versions{};
+    for (const Tensor& tensor : tensors) versions.push_back(tensor.version ? *tensor.version : 0);
+    return versions;
+}
 
 Backward::Backward() = default;
 Backward::Backward(const std::vector<std::shared_ptr<Backward>>& backwards) : backwards{ backwards } {}
-Backward::Backward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards) : tensors{ tensors }, backwards{ backwards } {}
+Backward::Backward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards) : tensors{ tensors }, versions{ saved_versions(tensors) }, backwards{ backwards } {}
 void Backward::operator() (const Tensor& gradients) {
-    for (int i = 0; i < backwards.size(); ++i) {
-        if (backwards[i]) (*backwards[i])(backward(gradients, i));
+    std::vector<Backward*> order{};
+    std::unordered_set<Backward*> visited{ this };
+    std::vector<std::pair<Backward*, size_t>> stack{ {this, 0} };
+    while (stack.size()) {
+        Backward* node{ stack.back().first };
+        if (stack.back().second == node->backwards.size()) {
+            order.push_back(node);
+            stack.pop_back();
+            continue;
+        }
+        Backward* input{ node->backwards[stack.back().second++].get() };
+        if (input && visited.insert(input).second) stack.push_back({ input, 0 });
+    }
+    std::unordered_map<Backward*, Tensor> node_gradients{ {this, gradients} };
+    for (auto node = order.rbegin(); node != order.rend(); ++node) {
+        const Tensor node_gradient{ node_gradients.at(*node).contiguous() };
+        node_gradients.erase(*node);
+        for (size_t i = 0; i < (*node)->versions.size(); ++i) {
+            const Tensor& tensor{ (*node)->tensors[i] };
+            if (tensor.version && *tensor.version != (*node)->versions[i]) throw std::runtime_error("a tensor needed for gradient computation was modified by an in-place operation");
+        }
+        if ((*node)->backwards.empty()) (*node)->accumulate(node_gradient);
+        const std::vector<Tensor> input_gradients{ (*node)->input_gradients(node_gradient) };
+        for (size_t i = 0; i < (*node)->backwards.size(); ++i) {
+            Backward* input{ (*node)->backwards[i].get() };
+            if (!input) continue;
+            const Tensor& input_gradient{ input_gradients[i] };
+            const auto pending = node_gradients.find(input);
+            if (pending == node_gradients.end()) node_gradients.emplace(input, input_gradient);
+            else pending->second = pending->second + input_gradient;
+        }
+    }
+}
+std::vector<Tensor> Backward::input_gradients(const Tensor& gradients) const {
+    std::vector<Tensor> input_gradients(backwards.size());
+    for (size_t i = 0; i < backwards.size(); ++i) {
+        if (backwards[i]) input_gradients[i] = backward(gradients, i);
     }
+    return input_gradients;
 }
 Tensor Backward::backward(const Tensor& gradients, size_t input_index) const { return gradients; }
+void Backward::accumulate(const Tensor& gradients) {}
 
 AccumulateGradients::AccumulateGradients(bool sum) : sum{ sum } {}
-void AccumulateGradients::operator() (const Tensor& gradients) {
-    const Tensor accumulate_gradients{ sum ? batch_sum(gradients) : gradients };
-    if (tensors.size()) tensors[0] = tensors[0] + accumulate_gradients;
-    else tensors.push_back(accumulate_gradients);
+void AccumulateGradients::accumulate(const Tensor& gradients) {
+    const Tensor accumulate_gradients{ sum && gradients.shape[0] != 1 ? ::sum(gradients, {0}, true) : gradients };
+    if (!tensors.size()) tensors.push_back(Tensor::from_scalar(0, accumulate_gradients.shape, accumulate_gradients.device));
+    if (tensors[0].shape == accumulate_gradients.shape) tensors[0] += accumulate_gradients;
+    else tensors[0] = tensors[0] + accumulate_gradients;
 }
 
 AddBackward::AddBackward(const std::vector<std::shared_ptr<Backward>>& backwards) : Backward{ backwards } {}
@@ -29,17 +78,107 @@ Tensor SubtractBackward::backward(const Tensor& gradients, size_t input_index) c
 MultiplyBackward::MultiplyBackward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards) : Backward{ backwards } {
     if (backwards[1]) this->tensors.push_back(tensors[0]); 
     if (backwards[0]) this->tensors.push_back(tensors[1]); 
+    versions = saved_versions(this->tensors);
 }
 Tensor MultiplyBackward::backward(const Tensor& gradients, size_t input_index) const {
     return tensors[input_index ? 0 : tensors.size() - 1] * gradients;
 }
 
+DivideBackward::DivideBackward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards) : Backward{ backwards } {
+    if (backwards[1]) this->tensors.push_back(tensors[0]);
+    this->tensors.push_back(tensors[1]);
+    versions = saved_versions(this->tensors);
+}
+Tensor DivideBackward::backward(const Tensor& gradients, size_t input_index) const {
+    const Tensor& divisor{ tensors.back() };
+    if (!input_index) return gradients / divisor;
+    return -(tensors[0] * gradients) / (divisor * divisor);
+}
+
 MatrixMultiplyBackward::MatrixMultiplyBackward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards) : Backward{ backwards } {
     if (backwards[1]) this->tensors.push_back(tensors[0]); 
     if (backwards[0]) this->tensors.push_back(tensors[1]); 
+    versions = saved_versions(this->tensors);
 }
 Tensor MatrixMultiplyBackward::backward(const Tensor& gradients, size_t input_index) const {
-    return mm(tensors[input_index ? 0 : tensors.size() - 1].transpose(tensors[0].rank - 1, tensors[0].rank - 2), gradients);
+    const size_t rank{ tensors[0].rank };
+    if (input_index) return mm(tensors[0].transpose(rank - 1, rank - 2), gradients);
+    return mm(gradients, tensors.back().transpose(rank - 1, rank - 2));
+}
+
+LinearBackward::LinearBackward(const std::vector<Tensor>& tensors, bool relu, const std::vector<std::shared_ptr<Backward>>& backwards) : relu{ relu }, Backward{ tensors, backwards } {}
+std::vector<Tensor> LinearBackward::input_gradients(const Tensor& gradients) const {
+    const Tensor& input{ tensors[0] };
+    const Tensor& weights{ tensors[1] };
+    const Tensor& output{ tensors[2] };
+    const Tensor contiguous_gradients{ gradients.strides == output.strides ? gradients : Expression{ gradients }.evaluate() };
+    const size_t height = output.shape[0];
+    const size_t width = output.shape[1];
+    Tensor pre_activation_gradients{ output.shape, output.device };
+    Tensor bias_gradients{ {1, output.shape[1]}, output.device };
+    backend(output.device).linear_backward(height, width, relu, output.data.get(), contiguous_gradients.data.get(), pre_activation_gradients.data.get(), bias_gradients.data.get());
+    std::vector<Tensor> input_gradients(3);
+    if (backwards[0]) input_gradients[0] = mm(pre_activation_gradients, weights.transpose(0, 1));
+    if (backwards[1]) input_gradients[1] = mm(input.transpose(0, 1), pre_activation_gradients);
+    if (backwards[2]) input_gradients[2] = bias_gradients;
+    return input_gradients;
+}
+
+PerceptronBackward::PerceptronBackward(const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards) : Backward{ tensors, backwards } {}
+std::vector<Tensor> PerceptronBackward::input_gradients(const Tensor& gradients) const {
+    const size_t n_layers{ tensors.size() / 2 };
+    const Tensor& input{ tensors[0] };
+    const Tensor contiguous_gradients{ gradients.strides[1] == 1 && gradients.strides[0] == gradients.shape[1] ? gradients : Expression{ gradients }.evaluate() };
+    const size_t n = contiguous_gradients.shape[0];
+    Perceptron perceptron{};
+    perceptron.n_layers = n_layers;
+    perceptron.input_dim = input.shape[1];
+    perceptron.width = tensors[1].shape[1];
+    perceptron.output_dim = contiguous_gradients.shape[1];
+    perceptron.input_strides[0] = input.strides[0];
+    perceptron.input_strides[1] = input.strides[1];
+    std::vector<Tensor> pre_activation_gradients(n_layers);
+    std::vector<Tensor> bias_gradients(n_layers);
+    for (size_t layer = 0; layer < n_layers; ++layer) {
+        perceptron.weights[layer] = tensors[1 + layer].data.get();
+        if (layer + 1 < n_layers) {
+            pre_activation_gradients[layer] = Tensor{ tensors[1 + n_layers + layer].shape, input.device };
+            perceptron.activations[layer] = tensors[1 + n_layers + layer].data.get();
+            perceptron.pre_activation_gradients[layer] = pre_activation_gradients[layer].data.get();
+        }
+        else pre_activation_gradients[layer] = contiguous_gradients;
+        if (backwards[1 + n_layers + layer]) {
+            bias_gradients[layer] = Tensor{ {1, pre_activation_gradients[layer].shape[1]}, input.device };
+            perceptron.bias_gradients[layer] = bias_gradients[layer].data.get();
+        }
+    }
+    backend(input.device).perceptron_backward(n, perceptron, contiguous_gradients.data.get());
+    std::vector<Tensor> input_gradients(backwards.size());
+    if (backwards[0]) input_gradients[0] = mm(pre_activation_gradients[0], tensors[1].transpose(0, 1));
+    for (size_t layer = 0; layer < n_layers; ++layer) {
+        const Tensor& layer_input{ layer ? tensors[n_layers + layer] : input };
+        if (backwards[1 + layer]) input_gradients[1 + layer] = mm(layer_input.transpose(0, 1), pre_activation_gradients[layer]);
+        input_gradients[1 + n_layers + layer] = bias_gradients[layer];
+    }
+    return input_gradients;
+}
+
+HashEncodeBackward::HashEncodeBackward(const Tensor& input, const std::vector<int>& shape, const HashGrid& grid, std::shared_ptr<Backward> backward) : shape{ shape }, grid{ grid }, Backward{ {input}, {backward} } {}
+Tensor HashEncodeBackward::backward(const Tensor& gradients, size_t input_index) const {
+    const Tensor& input{ tensors[0] };
+    const Tensor contiguous_gradients{ gradients.strides[1] == 1 && gradients.strides[0] == gradients.shape[1] ? gradients : Expression{ gradients }.evaluate() };
+    Tensor table_gradients{ shape, input.device };
+    backend(input.device).hash_encode_backward(input.shape[0], grid, input.data.get(), contiguous_gradients.data.get(), table_gradients.data.get());
+    return table_gradients;
+}
+
+PositionalEncodeBackward::PositionalEncodeBackward(const Tensor& output, const FourierFeatures& features, std::shared_ptr<Backward> backward) : features{ features }, Backward{ {output}, {backward} } {}
+Tensor PositionalEncodeBackward::backward(const Tensor& gradients, size_t input_index) const {
+    const Tensor& output{ tensors[0] };
+    const Tensor contiguous_gradients{ gradients.strides == output.strides ? gradients : Expression{ gradients }.evaluate() };
+    Tensor input_gradients{ {output.shape[0], static_cast<int>(features.input_dim)}, output.device };
+    backend(output.device).positional_encode_backward(output.shape[0], features, output.data.get(), contiguous_gradients.data.get(), input_gradients.data.get());
+    return input_gradients;
 }
 
 NegateBackward::NegateBackward(std::shared_ptr<Backward> backward) : Backward{ {backward} } {}
@@ -49,15 +188,59 @@ Tensor NegateBackward::backward(const Tensor& gradients, size_t input_index) con
 
 SquareBackward::SquareBackward(const Tensor& tensor, std::shared_ptr<Backward> backward) : Backward{ {tensor}, {backward} } {}
 Tensor SquareBackward::backward(const Tensor& gradients, size_t input_index) const {
-    return Tensor::from_scalar(2, std::vector<int>(tensors[0].rank, 1)) * tensors[0] * gradients;
+    return (2.f * Expression{ tensors[0] } * gradients).evaluate();
 }
 
-SumBackward::SumBackward(const std::vector<int>& shape, std::shared_ptr<Backward> backward) : shape{ shape }, Backward{ {backward} } {}
+SumBackward::SumBackward(const std::vector<int>& shape, const std::vector<int>& reduced_shape, std::shared_ptr<Backward> backward) : shape{ shape }, reduced_shape{ reduced_shape }, Backward{ {backward} } {}
 Tensor SumBackward::backward(const Tensor& gradients, size_t input_index) const {
-    return Tensor::from_scalar(gradients[std::vector<int>(gradients.rank, 0)], shape);
+    Tensor expanded_gradients{ gradients.detach() };
+    expanded_gradients.shape = shape;
+    expanded_gradients.rank = shape.size();
+    expanded_gradients.strides = std::vector<size_t>(shape.size());
+    size_t stride{ 1 };
+    for (size_t i = shape.size(); i-- > 0;) {
+        expanded_gradients.strides[i] = reduced_shape[i] == shape[i] ? stride : 0;
+        stride *= reduced_shape[i];
+    }
+    return Expression{ expanded_gradients }.evaluate();
+}
+
+SliceBackward::SliceBackward(const std::vector<int>& shape, size_t dim, size_t start, size_t end, size_t step, std::shared_ptr<Backward> backward) : shape{ shape }, dim{ dim }, start{ start }, end{ end }, step{ step }, Backward{ {backward} } {}
+Tensor SliceBackward::backward(const Tensor& gradients, size_t input_index) const {
+    const Tensor input_gradients{ Tensor::from_scalar(0, shape, gradients.device) };
+    Tensor slice{ input_gradients.slice(dim, start, end, step) };
+    slice += gradients.reshape(slice.shape);
+    return input_gradients;
+}
+
+ExpandBackward::ExpandBackward(const std::vector<int>& shape, std::shared_ptr<Backward> backward) : shape{ shape }, Backward{ {backward} } {}
+Tensor ExpandBackward::backward(const Tensor& gradients, size_t input_index) const {
+    const size_t leading{ gradients.rank - shape.size() };
+    std::vector<int> dims{};
+    for (size_t i = 0; i < gradients.rank; ++i) {
+        if (i < leading || (shape[i - leading] == 1 && gradients.shape[i] != 1)) dims.push_back(i);
+    }
+    return (dims.size() ? sum(gradients, dims, true) : gradients).reshape(shape);
+}
+
+ReshapeBackward::ReshapeBackward(const std::vector<int>& shape, std::shared_ptr<Backward> backward) : shape{ shape }, Backward{ {backward} } {}
+Tensor ReshapeBackward::backward(const Tensor& gradients, size_t input_index) const {
+    return gradients.reshape(shape);
+}
+
+TransposeBackward::TransposeBackward(size_t dim1, size_t dim2, std::shared_ptr<Backward> backward) : dim1{ dim1 }, dim2{ dim2 }, Backward{ {backward} } {}
+Tensor TransposeBackward::backward(const Tensor& gradients, size_t input_index) const {
+    return gradients.transpose(dim1, dim2);
 }
 
 ReluBackward::ReluBackward(const Tensor& tensor, std::shared_ptr<Backward> backward) : Backward{ {tensor}, {backward} } {}
 Tensor ReluBackward::backward(const Tensor& gradients, size_t input_index) const {
-    return relu_d(tensors[0]) * gradients;
+    return (relu_d(Expression{ tensors[0] }) * gradients).evaluate();
+}
+
+ExpressionBackward::ExpressionBackward(const Expression& expression, const std::vector<Tensor>& tensors, const std::vector<std::shared_ptr<Backward>>& backwards) : expression{ expression }, Backward{ tensors, backwards } {}
+std::vector<Tensor> ExpressionBackward::input_gradients(const Tensor& gradients) const {
+    std::vector<bool> required{};
+    for (const std::shared_ptr<Backward>& backward : backwards) required.push_back(backward != nullptr);
+    return expression.gradients(gradients, tensors, required);
 }
@@ -0,0 +1,39 @@
+#include <stdexcept>
+#include "backend.h"
+
+#ifdef CUDA_ML_WITH_CUDA
+Device current_default_device{ Device::CUDA };
+#else
+Device current_default_device{ Device::CPU };
+#endif
+Backend* override_backends[]{ nullptr, nullptr };
+
+size_t element_size(DType dtype) {
+    if (dtype == DType::int8) return sizeof(signed char);
+    return dtype == DType::float32 ? sizeof(float) : sizeof(unsigned short);
+}
+
+Backend& backend(Device device) {
+    static CPUBackend cpu_backend{};
+    Backend* override_backend{ override_backends[static_cast<size_t>(device)] };
+    if (override_backend) return *override_backend;
+#ifdef CUDA_ML_WITH_CUDA
+    static CUDABackend cuda_backend{};
+    if (device == Device::CUDA) return cuda_backend;
+#else
+    if (device == Device::CUDA) throw std::runtime_error{ "cuda-ml was built without CUDA" };
+#endif
+    return cpu_backend;
+}
+
+void set_backend(Device device, Backend* backend) {
+    override_backends[static_cast<size_t>(device)] = backend;
+}
+
+Device default_device() {
+    return current_default_device;
+}
+
+void set_default_device(Device device) {
+    current_default_device = device;
+}
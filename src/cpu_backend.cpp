@@ -0,0 +1,649 @@
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include "backend.h"
+#include "gemm.h"
+#include "perceptron.h"
+#include "parallel.h"
+
+const size_t grain_size{ 16384 };
+
+template <typename Operation>
+void apply_broadcast(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* output, Operation operation) {
+    if (broadcast.contiguous) {
+        parallel_for(n, grain_size, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) output[i] = operation(tensor1[i], tensor2[i]);
+        });
+        return;
+    }
+    parallel_for(n, grain_size, [&](size_t begin, size_t end) {
+        size_t position[max_rank];
+        size_t index1{ 0 };
+        size_t index2{ 0 };
+        size_t output_index{ 0 };
+        size_t index_remainder{ begin };
+        for (size_t i = 0; i < broadcast.rank; ++i) {
+            position[i] = index_remainder / broadcast.strides[i];
+            index_remainder -= position[i] * broadcast.strides[i];
+            index1 += position[i] * broadcast.tensor1_strides[i];
+            index2 += position[i] * broadcast.tensor2_strides[i];
+            output_index += position[i] * broadcast.output_strides[i];
+        }
+        for (size_t index = begin; index < end; ++index) {
+            output[output_index] = operation(tensor1[index1], tensor2[index2]);
+            for (size_t i = broadcast.rank; i-- > 0;) {
+                index1 += broadcast.tensor1_strides[i];
+                index2 += broadcast.tensor2_strides[i];
+                output_index += broadcast.output_strides[i];
+                if (++position[i] < broadcast.shape[i]) break;
+                index1 -= broadcast.shape[i] * broadcast.tensor1_strides[i];
+                index2 -= broadcast.shape[i] * broadcast.tensor2_strides[i];
+                output_index -= broadcast.shape[i] * broadcast.output_strides[i];
+                position[i] = 0;
+            }
+        }
+    });
+}
+
+static size_t reduction_offset(size_t index, size_t rank, const size_t* shape, const size_t* strides) {
+    size_t offset{ 0 };
+    for (size_t i = rank; i-- > 0;) {
+        offset += index % shape[i] * strides[i];
+        index /= shape[i];
+    }
+    return offset;
+}
+
+static float pairwise_sum(const float* input, size_t n) {
+    const size_t block_size{ 128 };
+    if (n > block_size) {
+        const size_t half{ n / 16 * 8 };
+        return pairwise_sum(input, half) + pairwise_sum(input + half, n - half);
+    }
+    float sums[8]{};
+    size_t i{ 0 };
+    for (; i + 8 <= n; i += 8) {
+        for (size_t j = 0; j < 8; ++j) sums[j] += input[i + j];
+    }
+    for (; i < n; ++i) sums[i % 8] += input[i];
+    return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+}
+
+static void kahan_add(const float* input, size_t n, float* sums, float* compensations) {
+    for (size_t i = 0; i < n; ++i) {
+        const float value{ input[i] - compensations[i] };
+        const float sum{ sums[i] + value };
+        compensations[i] = (sum - sums[i]) - value;
+        sums[i] = sum;
+    }
+}
+
+static float half_to_float(unsigned short half) {
+    const unsigned sign{ static_cast<unsigned>(half & 0x8000) << 16 };
+    const unsigned exponent{ static_cast<unsigned>(half >> 10 & 0x1f) };
+    const unsigned mantissa{ static_cast<unsigned>(half & 0x3ff) };
+    unsigned bits{ sign };
+    if (exponent == 0x1f) bits |= 0x7f800000 | mantissa << 13;
+    else if (exponent) bits |= (exponent + 112) << 23 | mantissa << 13;
+    else if (mantissa) {
+        const float value{ std::ldexp(static_cast<float>(mantissa), -24) };
+        std::memcpy(&bits, &value, sizeof(float));
+        bits |= sign;
+    }
+    float value;
+    std::memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+static unsigned short float_to_half(float value) {
+    unsigned bits;
+    std::memcpy(&bits, &value, sizeof(float));
+    const unsigned sign{ bits >> 16 & 0x8000 };
+    const unsigned magnitude{ bits & 0x7fffffff };
+    if (magnitude > 0x7f800000) return sign | 0x7e00;
+    if (magnitude >= 0x47800000) return sign | 0x7c00;
+    if (magnitude < 0x33000000) return sign;
+    unsigned half;
+    unsigned remainder;
+    unsigned halfway;
+    if (magnitude < 0x38800000) {
+        const unsigned shift{ 126 - (magnitude >> 23) };
+        const unsigned mantissa{ (magnitude & 0x7fffff) | 0x800000 };
+        half = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else {
+        half = (magnitude - 0x38000000) >> 13;
+        remainder = magnitude & 0x1fff;
+        halfway = 0x1000;
+    }
+    if (remainder > halfway || (remainder == halfway && (half & 1))) ++half;
+    return static_cast<unsigned short>(sign | half);
+}
+
+static float bfloat16_to_float(unsigned short bfloat16) {
+    const unsigned bits{ static_cast<unsigned>(bfloat16) << 16 };
+    float value;
+    std::memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+static unsigned short float_to_bfloat16(float value) {
+    unsigned bits;
+    std::memcpy(&bits, &value, sizeof(float));
+    if ((bits & 0x7fffffff) > 0x7f800000) return static_cast<unsigned short>(bits >> 16 | 0x40);
+    return static_cast<unsigned short>((bits + 0x7fff + (bits >> 16 & 1)) >> 16);
+}
+
+static float load(const float* data, size_t index, DType dtype) {
+    if (dtype == DType::float32) return data[index];
+    if (dtype == DType::int8) return reinterpret_cast<const signed char*>(data)[index];
+    const unsigned short element{ reinterpret_cast<const unsigned short*>(data)[index] };
+    return dtype == DType::float16 ? half_to_float(element) : bfloat16_to_float(element);
+}
+
+static void store(float* data, size_t index, DType dtype, float value) {
+    if (dtype == DType::float32) data[index] = value;
+    else if (dtype == DType::int8) reinterpret_cast<signed char*>(data)[index] = quantize(value);
+    else reinterpret_cast<unsigned short*>(data)[index] = dtype == DType::float16 ? float_to_half(value) : float_to_bfloat16(value);
+}
+
+static const float* widen(size_t extent, DType dtype, const float* data, std::vector<float>& widened) {
+    if (dtype == DType::float32) return data;
+    widened.resize(extent);
+    parallel_for(extent, grain_size, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) widened[i] = load(data, i, dtype);
+    });
+    return widened.data();
+}
+
+static size_t matrix_extent(size_t batch_size, size_t height, size_t width, size_t row_stride, size_t column_stride) {
+    return (batch_size - 1) * height * width + (height - 1) * row_stride + (width - 1) * column_stride + 1;
+}
+
+template <size_t Dim>
+static size_t grid_corners(const HashGrid& grid, size_t level, const float* position, size_t* indices, float* weights) {
+    const size_t resolution{ grid.resolutions[level] };
+    size_t cells[max_grid_dim];
+    float fractions[max_grid_dim];
+    size_t dense_size{ 1 };
+    for (size_t d = 0; d < Dim; ++d) {
+        const float scaled{ std::min(std::max(position[d], 0.f), 1.f) * (resolution - 1) };
+        cells[d] = std::min(static_cast<size_t>(scaled), resolution - 2);
+        fractions[d] = scaled - cells[d];
+        dense_size *= resolution;
+    }
+    const size_t primes[max_grid_dim]{ 1, 2654435761u, 805459861u };
+    const size_t n_corners{ static_cast<size_t>(1) << Dim };
+    for (size_t corner = 0; corner < n_corners; ++corner) {
+        size_t index{ 0 };
+        size_t stride{ 1 };
+        float weight{ 1 };
+        for (size_t d = 0; d < Dim; ++d) {
+            const size_t offset{ corner >> d & 1 };
+            weight *= offset ? fractions[d] : 1 - fractions[d];
+            if (dense_size <= grid.table_size) index += (cells[d] + offset) * stride;
+            else index ^= (cells[d] + offset) * primes[d];
+            stride *= resolution;
+        }
+        indices[corner] = level * grid.table_size + (dense_size <= grid.table_size ? index : index & (grid.table_size - 1));
+        weights[corner] = weight;
+    }
+    return n_corners;
+}
+
+template <typename Operation>
+void elementwise(size_t n, float* input, float* output, Operation operation) {
+    parallel_for(n, grain_size, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) output[i] = operation(input[i]);
+    });
+}
+
+float* CPUBackend::allocate(size_t size) {
+    return static_cast<float*>(std::malloc(size));
+}
+
+void CPUBackend::deallocate(float* data) {
+    std::free(data);
+}
+
+void CPUBackend::copy_from_host(size_t size, const float* input, float* output) {
+    std::memcpy(output, input, size);
+}
+
+void CPUBackend::copy_to_host(size_t size, const float* input, float* output) {
+    std::memcpy(output, input, size);
+}
+
+float* CPUBackend::allocate_host(size_t size) {
+    return static_cast<float*>(std::malloc(size));
+}
+
+void CPUBackend::deallocate_host(float* data) {
+    std::free(data);
+}
+
+std::function<bool(bool)> CPUBackend::copy_to_host_async(size_t size, const float* input, float* output) {
+    std::memcpy(output, input, size);
+    return [](bool wait) { return true; };
+}
+
+std::function<bool(bool)> CPUBackend::copy_from_host_async(size_t size, const float* input, float* output) {
+    std::memcpy(output, input, size);
+    return [](bool wait) { return true; };
+}
+
+void CPUBackend::copy(size_t size, float* input, float* output) {
+    const char* input_bytes{ reinterpret_cast<const char*>(input) };
+    char* output_bytes{ reinterpret_cast<char*>(output) };
+    parallel_for(size, grain_size * sizeof(float), [&](size_t begin, size_t end) {
+        std::memcpy(output_bytes + begin, input_bytes + begin, end - begin);
+    });
+}
+
+void CPUBackend::convert(size_t n, DType input_type, DType output_type, float* input, float* output) {
+    parallel_for(n, grain_size, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) store(output, i, output_type, load(input, i, input_type));
+    });
+}
+
+void CPUBackend::fill_scalar(size_t n, float scalar, float* output) {
+    parallel_for(n, grain_size, [&](size_t begin, size_t end) {
+        std::fill(output + begin, output + end, scalar);
+    });
+}
+
+void CPUBackend::add(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* sum) {
+    apply_broadcast(n, broadcast, tensor1, tensor2, sum, [](float a, float b){ return a + b; });
+}
+
+void CPUBackend::subtract(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* difference) {
+    apply_broadcast(n, broadcast, tensor1, tensor2, difference, [](float a, float b){ return a - b; });
+}
+
+void CPUBackend::multiply(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* product) {
+    apply_broadcast(n, broadcast, tensor1, tensor2, product, [](float a, float b){ return a * b; });
+}
+
+void CPUBackend::divide(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* quotient) {
+    apply_broadcast(n, broadcast, tensor1, tensor2, quotient, [](float a, float b){ return a / b; });
+}
+
+void CPUBackend::matrix_multiply(size_t batch_size, size_t rank, size_t height, size_t width, size_t shared_dim, const size_t* tensor1_strides, const size_t* tensor2_strides, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product) {
+    std::vector<float> widened1{};
+    std::vector<float> widened2{};
+    const float* tensor1_data{ widen(matrix_extent(batch_size, height, shared_dim, tensor1_strides[rank - 2], tensor1_strides[rank - 1]), tensor1_type, tensor1, widened1) };
+    const float* tensor2_data{ widen(matrix_extent(batch_size, shared_dim, width, tensor2_strides[rank - 2], tensor2_strides[rank - 1]), tensor2_type, tensor2, widened2) };
+    const Matrix tensor1_matrix{ const_cast<float*>(tensor1_data), height * shared_dim, tensor1_strides[rank - 2], tensor1_strides[rank - 1] };
+    const Matrix tensor2_matrix{ const_cast<float*>(tensor2_data), width * shared_dim, tensor2_strides[rank - 2], tensor2_strides[rank - 1] };
+    const Matrix matrix_product_matrix{ matrix_product, height * width, width, 1 };
+    gemm(batch_size, height, width, shared_dim, tensor1_matrix, tensor2_matrix, matrix_product_matrix);
+}
+
+void CPUBackend::linear(size_t height, size_t width, size_t shared_dim, const size_t* input_strides, const size_t* weights_strides, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output) {
+    std::vector<float> widened_input{};
+    std::vector<float> widened_weights{};
+    const float* input_data{ widen(matrix_extent(1, height, shared_dim, input_strides[0], input_strides[1]), input_type, input, widened_input) };
+    const float* weights_data{ widen(matrix_extent(1, shared_dim, width, weights_strides[0], weights_strides[1]), weights_type, weights, widened_weights) };
+    const Matrix input_matrix{ const_cast<float*>(input_data), height * shared_dim, input_strides[0], input_strides[1] };
+    const Matrix weights_matrix{ const_cast<float*>(weights_data), width * shared_dim, weights_strides[0], weights_strides[1] };
+    const Matrix output_matrix{ output, height * width, width, 1 };
+    gemm(1, height, width, shared_dim, input_matrix, weights_matrix, output_matrix, Epilogue{ bias, relu });
+}
+
+void CPUBackend::linear_backward(size_t height, size_t width, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* bias_gradients) {
+    const size_t n_chunks{ std::max(std::min(height * width / grain_size, 4 * n_threads()), static_cast<size_t>(1)) };
+    std::vector<float> partial_sums(n_chunks * width, 0);
+    parallel_for(n_chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; ++chunk) {
+            float* sums{ &partial_sums[chunk * width] };
+            for (size_t row = chunk * height / n_chunks; row < (chunk + 1) * height / n_chunks; ++row) {
+                const float* gradient_row{ gradients + row * width };
+                float* pre_activation_row{ pre_activation_gradients + row * width };
+                if (relu) {
+                    const float* output_row{ output + row * width };
+                    for (size_t column = 0; column < width; ++column) pre_activation_row[column] = output_row[column] > 0 ? gradient_row[column] : 0;
+                }
+                else std::copy(gradient_row, gradient_row + width, pre_activation_row);
+                for (size_t column = 0; column < width; ++column) sums[column] += pre_activation_row[column];
+            }
+        }
+    });
+    for (size_t column = 0; column < width; ++column) {
+        double sum{ 0 };
+        for (size_t chunk = 0; chunk < n_chunks; ++chunk) sum += partial_sums[chunk * width + column];
+        bias_gradients[column] = static_cast<float>(sum);
+    }
+}
+
+void CPUBackend::quantized_linear(size_t height, size_t width, size_t shared_dim, const QuantizedLinear& layer, float* input, float* weights, float* scales, float* bias, float* output) {
+    const QuantizedMatrix input_matrix{ input, layer.input_strides[0], layer.input_strides[1], layer.input_type == DType::int8, layer.input_scale };
+    const QuantizedMatrix weights_matrix{ weights, layer.weights_strides[0], layer.weights_strides[1], true, 1 };
+    gemm_int8(height, width, shared_dim, input_matrix, weights_matrix, output, QuantizedEpilogue{ scales, bias, layer.relu, layer.output_type == DType::int8, layer.output_scale });
+}
+
+void CPUBackend::perceptron(size_t n, const Perceptron& perceptron, float* input, float* output) {
+    perceptron_forward(n, perceptron, input, output);
+}
+
+void CPUBackend::perceptron_backward(size_t n, const Perceptron& perceptron, float* gradients) {
+    ::perceptron_backward(n, perceptron, gradients);
+}
+
+template <size_t Dim>
+static void hash_encode_points(size_t begin, size_t end, const HashGrid& grid, const float* input, const float* tables, float* output) {
+    const size_t n_outputs{ grid.n_levels * grid.n_features };
+    size_t indices[1 << max_grid_dim];
+    float weights[1 << max_grid_dim];
+    float position[max_grid_dim];
+    for (size_t i = begin; i < end; ++i) {
+        for (size_t d = 0; d < Dim; ++d) position[d] = input[i * grid.input_strides[0] + d * grid.input_strides[1]];
+        for (size_t level = 0; level < grid.n_levels; ++level) {
+            float* features{ output + i * n_outputs + level * grid.n_features };
+            std::fill(features, features + grid.n_features, 0.f);
+            const size_t n_corners{ grid_corners<Dim>(grid, level, position, indices, weights) };
+            for (size_t corner = 0; corner < n_corners; ++corner) {
+                const float* entry{ tables + indices[corner] * grid.n_features };
+                for (size_t f = 0; f < grid.n_features; ++f) features[f] += weights[corner] * entry[f];
+            }
+        }
+    }
+}
+
+template <size_t Dim>
+static void hash_encode_level(size_t n, size_t level, const HashGrid& grid, const float* input, const float* gradients, float* table_gradients) {
+    const size_t n_outputs{ grid.n_levels * grid.n_features };
+    size_t indices[1 << max_grid_dim];
+    float weights[1 << max_grid_dim];
+    float position[max_grid_dim];
+    std::fill(table_gradients + level * grid.table_size * grid.n_features, table_gradients + (level + 1) * grid.table_size * grid.n_features, 0.f);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t d = 0; d < Dim; ++d) position[d] = input[i * grid.input_strides[0] + d * grid.input_strides[1]];
+        const float* features{ gradients + i * n_outputs + level * grid.n_features };
+        const size_t n_corners{ grid_corners<Dim>(grid, level, position, indices, weights) };
+        for (size_t corner = 0; corner < n_corners; ++corner) {
+            float* entry{ table_gradients + indices[corner] * grid.n_features };
+            for (size_t f = 0; f < grid.n_features; ++f) entry[f] += weights[corner] * features[f];
+        }
+    }
+}
+
+void CPUBackend::hash_encode(size_t n, const HashGrid& grid, float* input, float* tables, float* output) {
+    parallel_for(n, grain_size / (grid.n_levels * grid.n_features) + 1, [&](size_t begin, size_t end) {
+        switch (grid.input_dim) {
+            case 1: hash_encode_points<1>(begin, end, grid, input, tables, output); break;
+            case 2: hash_encode_points<2>(begin, end, grid, input, tables, output); break;
+            default: hash_encode_points<3>(begin, end, grid, input, tables, output); break;
+        }
+    });
+}
+
+void CPUBackend::hash_encode_backward(size_t n, const HashGrid& grid, float* input, float* gradients, float* table_gradients) {
+    parallel_for(grid.n_levels, 1, [&](size_t begin, size_t end) {
+        for (size_t level = begin; level < end; ++level) {
+            switch (grid.input_dim) {
+                case 1: hash_encode_level<1>(n, level, grid, input, gradients, table_gradients); break;
+                case 2: hash_encode_level<2>(n, level, grid, input, gradients, table_gradients); break;
+                default: hash_encode_level<3>(n, level, grid, input, gradients, table_gradients); break;
+            }
+        }
+    });
+}
+
+void CPUBackend::positional_encode(size_t n, const FourierFeatures& features, float* input, float* output) {
+    const size_t n_outputs{ 2 * features.input_dim * features.n_frequencies };
+    parallel_for(n, grain_size / n_outputs + 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t d = 0; d < features.input_dim; ++d) {
+                const double angle{ 3.14159265358979323846 * input[i * features.input_strides[0] + d * features.input_strides[1]] };
+                double sine{ std::sin(angle) };
+                double cosine{ std::cos(angle) };
+                float* encoded{ output + i * n_outputs + 2 * d * features.n_frequencies };
+                for (size_t frequency = 0; frequency < features.n_frequencies; ++frequency) {
+                    encoded[2 * frequency] = sine;
+                    encoded[2 * frequency + 1] = cosine;
+                    const double doubled_sine{ 2 * sine * cosine };
+                    cosine = (cosine - sine) * (cosine + sine);
+                    sine = doubled_sine;
+                }
+            }
+        }
+    });
+}
+
+void CPUBackend::positional_encode_backward(size_t n, const FourierFeatures& features, float* output, float* gradients, float* input_gradients) {
+    parallel_for(n * features.input_dim, grain_size / (2 * features.n_frequencies) + 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const float* encoded{ output + 2 * i * features.n_frequencies };
+            const float* encoded_gradients{ gradients + 2 * i * features.n_frequencies };
+            float gradient{ 0 };
+            float scale{ 3.14159265358979f };
+            for (size_t frequency = 0; frequency < features.n_frequencies; ++frequency) {
+                gradient += scale * (encoded_gradients[2 * frequency] * encoded[2 * frequency + 1] - encoded_gradients[2 * frequency + 1] * encoded[2 * frequency]);
+                scale *= 2;
+            }
+            input_gradients[i] = gradient;
+        }
+    });
+}
+
+void CPUBackend::grid_coordinates(size_t n, const PixelGrid& grid, float* indices, float* output) {
+    parallel_for(n, grain_size, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const size_t pixel{ indices ? static_cast<size_t>(indices[i]) : grid.first + i };
+            output[2 * i] = (pixel / grid.width) * grid.scales[0];
+            output[2 * i + 1] = (pixel % grid.width) * grid.scales[1];
+        }
+    });
+}
+
+void CPUBackend::adam(const AdamUpdate& update, float* step, float* finite) {
+    if (finite && !*finite) return;
+    const double t{ *step };
+    const float step_size{ static_cast<float>(update.learning_rate / (1 - std::pow(static_cast<double>(update.beta1), t))) };
+    const float correction{ static_cast<float>(1 / std::sqrt(1 - std::pow(static_cast<double>(update.beta2), t))) };
+    const float decay{ update.decoupled ? 1 - update.learning_rate * update.weight_decay : 1 };
+    const float weight_decay{ update.decoupled ? 0 : update.weight_decay };
+    parallel_for(update.offsets[update.n_tensors], grain_size, [&](size_t begin, size_t end) {
+        size_t tensor = std::upper_bound(update.offsets, update.offsets + update.n_tensors + 1, begin) - update.offsets - 1;
+        for (; begin < end; ++tensor) {
+            const size_t offset{ update.offsets[tensor] };
+            const size_t tensor_end{ std::min(end, update.offsets[tensor + 1]) };
+            float* parameters{ update.parameters[tensor] };
+            const float* gradients{ update.gradients[tensor] };
+            float* first_moments{ update.first_moments[tensor] };
+            float* second_moments{ update.second_moments[tensor] };
+            for (size_t i = begin - offset; i < tensor_end - offset; ++i) {
+                const float gradient{ gradients[i] + weight_decay * parameters[i] };
+                first_moments[i] = update.beta1 * first_moments[i] + (1 - update.beta1) * gradient;
+                second_moments[i] = update.beta2 * second_moments[i] + (1 - update.beta2) * gradient * gradient;
+                parameters[i] = decay * parameters[i] - step_size * first_moments[i] / (std::sqrt(second_moments[i]) * correction + update.epsilon);
+            }
+            begin = tensor_end;
+        }
+    });
+}
+
+void CPUBackend::unscale_gradients(const GradientScaling& scaling, float* scale, float* finite) {
+    const float inverse_scale{ 1 / *scale };
+    std::atomic<bool> overflow{ false };
+    parallel_for(scaling.offsets[scaling.n_tensors], grain_size, [&](size_t begin, size_t end) {
+        size_t tensor = std::upper_bound(scaling.offsets, scaling.offsets + scaling.n_tensors + 1, begin) - scaling.offsets - 1;
+        bool range_overflow{ false };
+        for (; begin < end; ++tensor) {
+            const size_t offset{ scaling.offsets[tensor] };
+            const size_t tensor_end{ std::min(end, scaling.offsets[tensor + 1]) };
+            float* gradients{ scaling.gradients[tensor] };
+            for (size_t i = begin - offset; i < tensor_end - offset; ++i) {
+                const bool representable{ std::fabs(gradients[i]) <= scaling.max_gradient };
+                gradients[i] = representable ? gradients[i] * inverse_scale : 0;
+                range_overflow = range_overflow || !representable;
+            }
+            begin = tensor_end;
+        }
+        if (range_overflow) overflow = true;
+    });
+    if (overflow) *finite = 0;
+}
+
+void CPUBackend::update_scale(const GradientScaling& scaling, float* scale, float* finite, float* growth_tracker) {
+    if (!*finite) {
+        *scale *= scaling.backoff_factor;
+        *growth_tracker = 0;
+        return;
+    }
+    if (++*growth_tracker < scaling.growth_interval) return;
+    if (std::isfinite(*scale * scaling.growth_factor)) *scale *= scaling.growth_factor;
+    *growth_tracker = 0;
+}
+
+void CPUBackend::negate(size_t n, float* input, float* output) {
+    elementwise(n, input, output, [](float x){ return -x; });
+}
+
+void CPUBackend::square(size_t n, float* input, float* output) {
+    elementwise(n, input, output, [](float x){ return x * x; });
+}
+
+void CPUBackend::sum(const Reduction& reduction, float* input, float* output) {
+    if (reduction.input_type != DType::float32) {
+        size_t extent{ 1 };
+        for (size_t i = 0; i < reduction.kept_rank; ++i) extent += (reduction.kept_shape[i] - 1) * reduction.kept_strides[i];
+        for (size_t i = 0; i < reduction.reduced_rank; ++i) extent += (reduction.reduced_shape[i] - 1) * reduction.reduced_strides[i];
+        std::vector<float> widened{};
+        widen(extent, reduction.input_type, input, widened);
+        Reduction widened_reduction{ reduction };
+        widened_reduction.input_type = DType::float32;
+        sum(widened_reduction, widened.data(), output);
+        return;
+    }
+    const size_t n_outputs{ reduction.n_outputs };
+    const size_t n_reduced{ reduction.n_reduced };
+    const bool contiguous{ reduction.reduced_rank == 0 || (reduction.reduced_rank == 1 && reduction.reduced_strides[0] == 1) };
+    if (contiguous) {
+        const size_t n_chunks{ std::max(std::min(n_reduced / grain_size, (4 * n_threads() + n_outputs - 1) / n_outputs), static_cast<size_t>(1)) };
+        std::vector<float> partial_sums(n_chunks > 1 ? n_outputs * n_chunks : 0);
+        float* sums{ n_chunks > 1 ? partial_sums.data() : output };
+        parallel_for(n_outputs * n_chunks, std::max(grain_size * n_chunks / std::max(n_reduced, static_cast<size_t>(1)), static_cast<size_t>(1)), [&](size_t begin, size_t end) {
+            for (size_t item = begin; item < end; ++item) {
+                const size_t chunk{ item % n_chunks };
+                const float* row{ input + reduction_offset(item / n_chunks, reduction.kept_rank, reduction.kept_shape, reduction.kept_strides) };
+                sums[item] = pairwise_sum(row + chunk * n_reduced / n_chunks, (chunk + 1) * n_reduced / n_chunks - chunk * n_reduced / n_chunks);
+            }
+        });
+        if (n_chunks == 1) return;
+        for (size_t index = 0; index < n_outputs; ++index) output[index] = pairwise_sum(sums + index * n_chunks, n_chunks);
+        return;
+    }
+    const bool kept_contiguous{ reduction.kept_rank == 0 || (reduction.kept_rank == 1 && reduction.kept_strides[0] == 1) };
+    std::vector<size_t> offsets(kept_contiguous ? 0 : n_outputs);
+    for (size_t index = 0; !kept_contiguous && index < n_outputs; ++index) offsets[index] = reduction_offset(index, reduction.kept_rank, reduction.kept_shape, reduction.kept_strides);
+    const size_t n_chunks{ std::max(std::min(std::min(n_reduced, n_reduced * n_outputs / grain_size), 4 * n_threads()), static_cast<size_t>(1)) };
+    const size_t n_blocks{ std::max(std::min((4 * n_threads() + n_chunks - 1) / n_chunks, n_outputs * n_reduced / n_chunks / grain_size), static_cast<size_t>(1)) };
+    std::vector<float> partial_sums(n_chunks * n_outputs, 0);
+    std::vector<float> compensations(n_chunks * n_outputs, 0);
+    parallel_for(n_chunks * n_blocks, 1, [&](size_t begin, size_t end) {
+        for (size_t item = begin; item < end; ++item) {
+            const size_t chunk{ item / n_blocks };
+            const size_t block{ item % n_blocks };
+            float* sums{ &partial_sums[chunk * n_outputs] };
+            float* compensation{ &compensations[chunk * n_outputs] };
+            const size_t first{ block * n_outputs / n_blocks };
+            const size_t last{ (block + 1) * n_outputs / n_blocks };
+            std::vector<float> gathered(kept_contiguous ? 0 : last - first);
+            for (size_t i = chunk * n_reduced / n_chunks; i < (chunk + 1) * n_reduced / n_chunks; ++i) {
+                const float* values{ input + reduction_offset(i, reduction.reduced_rank, reduction.reduced_shape, reduction.reduced_strides) };
+                if (kept_contiguous) kahan_add(values + first, last - first, sums + first, compensation + first);
+                else {
+                    for (size_t index = first; index < last; ++index) gathered[index - first] = values[offsets[index]];
+                    kahan_add(gathered.data(), last - first, sums + first, compensation + first);
+                }
+            }
+        }
+    });
+    for (size_t index = 0; index < n_outputs; ++index) {
+        double sum{ 0 };
+        for (size_t chunk = 0; chunk < n_chunks; ++chunk) sum += static_cast<double>(partial_sums[chunk * n_outputs + index]) - compensations[chunk * n_outputs + index];
+        output[index] = static_cast<float>(sum);
+    }
+}
+
+void CPUBackend::relu(size_t n, float* input, float* output) {
+    elementwise(n, input, output, [](float x){ return x > 0 ? x : 0; });
+}
+
+void CPUBackend::relu_d(size_t n, float* input, float* output) {
+    elementwise(n, input, output, [](float x){ return x > 0 ? 1.f : 0.f; });
+}
+
+void CPUBackend::evaluate(size_t n, const Program& program, float* output) {
+    const size_t block_size{ 256 };
+    bool contiguous{ true };
+    for (size_t j = 0; j < program.n_inputs; ++j) contiguous = contiguous && program.contiguous[j];
+    parallel_for(n, grain_size, [&](size_t begin, size_t end) {
+        float stack[max_stack_size][block_size];
+        float gathered[max_inputs][block_size];
+        const float* values[max_inputs];
+        size_t position[max_rank];
+        size_t offsets[max_inputs]{};
+        size_t index_remainder{ begin };
+        for (size_t i = 0; i < program.rank; ++i) {
+            position[i] = index_remainder / program.strides[i];
+            index_remainder -= position[i] * program.strides[i];
+            for (size_t j = 0; j < program.n_inputs; ++j) offsets[j] += position[i] * program.input_strides[j][i];
+        }
+        for (size_t block = begin; block < end; block += block_size) {
+            const size_t length{ std::min(block_size, end - block) };
+            for (size_t j = 0; j < program.n_inputs; ++j) values[j] = program.contiguous[j] ? program.inputs[j] + block : gathered[j];
+            for (size_t e = 0; !contiguous && e < length;) {
+                const size_t inner{ program.rank - 1 };
+                const size_t run{ std::min(length - e, program.shape[inner] - position[inner]) };
+                for (size_t j = 0; j < program.n_inputs; ++j) {
+                    const float* input{ program.inputs[j] + offsets[j] };
+                    const size_t stride{ program.input_strides[j][inner] };
+                    for (size_t k = 0; !program.contiguous[j] && k < run; ++k) gathered[j][e + k] = input[k * stride];
+                    offsets[j] += run * stride;
+                }
+                e += run;
+                position[inner] += run;
+                for (size_t i = inner; i > 0 && position[i] == program.shape[i]; --i) {
+                    for (size_t j = 0; j < program.n_inputs; ++j) offsets[j] += program.input_strides[j][i - 1] - program.shape[i] * program.input_strides[j][i];
+                    position[i] = 0;
+                    ++position[i - 1];
+                }
+            }
+            size_t top{ 0 };
+            for (size_t i = 0; i < program.n_instructions; ++i) {
+                float* a{ top > 1 ? stack[top - 2] : nullptr };
+                float* b{ top > 0 ? stack[top - 1] : nullptr };
+                switch (program.operations[i]) {
+                    case ExpressionOperation::load: std::copy(values[program.operands[i]], values[program.operands[i]] + length, stack[top++]); break;
+                    case ExpressionOperation::constant: std::fill(stack[top], stack[top] + length, program.constants[i]); ++top; break;
+                    case ExpressionOperation::add: for (size_t e = 0; e < length; ++e) a[e] += b[e]; --top; break;
+                    case ExpressionOperation::subtract: for (size_t e = 0; e < length; ++e) a[e] -= b[e]; --top; break;
+                    case ExpressionOperation::multiply: for (size_t e = 0; e < length; ++e) a[e] *= b[e]; --top; break;
+                    case ExpressionOperation::divide: for (size_t e = 0; e < length; ++e) a[e] /= b[e]; --top; break;
+                    case ExpressionOperation::negate: for (size_t e = 0; e < length; ++e) b[e] = -b[e]; break;
+                    case ExpressionOperation::square: for (size_t e = 0; e < length; ++e) b[e] *= b[e]; break;
+                    case ExpressionOperation::relu: for (size_t e = 0; e < length; ++e) b[e] = b[e] > 0 ? b[e] : 0; break;
+                    case ExpressionOperation::relu_d: for (size_t e = 0; e < length; ++e) b[e] = b[e] > 0 ? 1 : 0; break;
+                }
+            }
+            std::copy(stack[0], stack[0] + length, output + block);
+        }
+    });
+}
+
+std::function<void()> CPUBackend::instantiate(const std::vector<std::function<void()>>& instructions) {
+    return [instructions]() {
+        for (const std::function<void()>& instruction : instructions) instruction();
+    };
+}
+
+std::thread::id CPUBackend::stream() {
+    return std::thread::id{};
+}
@@ -0,0 +1,293 @@
+#include <new>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include "backend.h"
+#include "allocator.h"
+#include "kernels.h"
+
+static cudaStream_t create_copy_stream() {
+    cudaStream_t stream{};
+    cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+    return stream;
+}
+
+float* CUDABackend::allocate(size_t size) {
+    float* data{};
+    if (cudaMalloc(&data, size) != cudaSuccess) {
+        cudaGetLastError();
+        return nullptr;
+    }
+    return data;
+}
+
+void CUDABackend::deallocate(float* data) {
+    cudaFree(data);
+}
+
+void CUDABackend::copy_from_host(size_t size, const float* input, float* output) {
+    cudaMemcpy(output, input, size, cudaMemcpyHostToDevice);
+}
+
+void CUDABackend::copy_to_host(size_t size, const float* input, float* output) {
+    cudaMemcpy(output, input, size, cudaMemcpyDeviceToHost);
+}
+
+float* CUDABackend::allocate_host(size_t size) {
+    const size_t block_size{ bucket_size(size) };
+    {
+        std::lock_guard<std::mutex> lock{ host_mutex };
+        std::vector<float*>& blocks{ free_host_blocks[block_size] };
+        if (blocks.size()) {
+            float* data{ blocks.back() };
+            blocks.pop_back();
+            return data;
+        }
+    }
+    float* data{};
+    if (cudaMallocHost(&data, block_size) != cudaSuccess) throw std::bad_alloc{};
+    std::lock_guard<std::mutex> lock{ host_mutex };
+    host_block_sizes[data] = block_size;
+    return data;
+}
+
+void CUDABackend::deallocate_host(float* data) {
+    std::lock_guard<std::mutex> lock{ host_mutex };
+    free_host_blocks[host_block_sizes[data]].push_back(data);
+}
+
+std::function<bool(bool)> CUDABackend::copy_to_host_async(size_t size, const float* input, float* output) {
+    cudaEvent_t copied{};
+    cudaMemcpyAsync(output, input, size, cudaMemcpyDeviceToHost, cudaStreamPerThread);
+    cudaEventCreateWithFlags(&copied, cudaEventDisableTiming);
+    cudaEventRecord(copied, cudaStreamPerThread);
+    const std::shared_ptr<std::remove_pointer<cudaEvent_t>::type> event{ copied, cudaEventDestroy };
+    return [event](bool wait) { return (wait ? cudaEventSynchronize(event.get()) : cudaEventQuery(event.get())) == cudaSuccess; };
+}
+
+std::function<bool(bool)> CUDABackend::copy_from_host_async(size_t size, const float* input, float* output) {
+    static const cudaStream_t copy_stream{ create_copy_stream() };
+    cudaEvent_t issued{};
+    cudaEvent_t copied{};
+    cudaEventCreateWithFlags(&issued, cudaEventDisableTiming);
+    cudaEventRecord(issued, cudaStreamPerThread);
+    cudaStreamWaitEvent(copy_stream, issued, 0);
+    cudaEventDestroy(issued);
+    cudaMemcpyAsync(output, input, size, cudaMemcpyHostToDevice, copy_stream);
+    cudaEventCreateWithFlags(&copied, cudaEventDisableTiming);
+    cudaEventRecord(copied, copy_stream);
+    const std::shared_ptr<std::remove_pointer<cudaEvent_t>::type> event{ copied, cudaEventDestroy };
+    return [event](bool wait) { return (wait ? cudaEventSynchronize(event.get()) : cudaEventQuery(event.get())) == cudaSuccess; };
+}
+
+void CUDABackend::copy(size_t size, float* input, float* output) {
+    cudaMemcpyAsync(output, input, size, cudaMemcpyDeviceToDevice, cudaStreamPerThread);
+}
+
+void CUDABackend::convert(size_t n, DType input_type, DType output_type, float* input, float* output) {
+    ::convert<<<(n + 255) / 256, 256>>>(n, input_type, output_type, input, output);
+}
+
+void CUDABackend::fill_scalar(size_t n, float scalar, float* output) {
+    ::fill_scalar<<<(n + 255) / 256, 256>>>(n, scalar, output);
+}
+
+void CUDABackend::add(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* sum) {
+    ::add<<<(n + 255) / 256, 256>>>(n, broadcast, tensor1, tensor2, sum);
+}
+
+void CUDABackend::subtract(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* difference) {
+    ::subtract<<<(n + 255) / 256, 256>>>(n, broadcast, tensor1, tensor2, difference);
+}
+
+void CUDABackend::multiply(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* product) {
+    ::multiply<<<(n + 255) / 256, 256>>>(n, broadcast, tensor1, tensor2, product);
+}
+
+void CUDABackend::divide(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* quotient) {
+    ::divide<<<(n + 255) / 256, 256>>>(n, broadcast, tensor1, tensor2, quotient);
+}
+
+void CUDABackend::matrix_multiply(size_t batch_size, size_t rank, size_t height, size_t width, size_t shared_dim, const size_t* tensor1_strides, const size_t* tensor2_strides, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product) {
+    dim3 block_dim(16, 16);
+    dim3 grid_dim((height + block_dim.x - 1) / block_dim.x, (width + block_dim.y - 1) / block_dim.y, batch_size);
+    ::matrix_multiply<<<grid_dim, block_dim>>>(height, width, shared_dim, tensor1_strides[rank - 2], tensor1_strides[rank - 1], tensor2_strides[rank - 2], tensor2_strides[rank - 1], tensor1_type, tensor2_type, tensor1, tensor2, matrix_product);
+}
+
+void CUDABackend::linear(size_t height, size_t width, size_t shared_dim, const size_t* input_strides, const size_t* weights_strides, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output) {
+    dim3 block_dim(linear_tile, linear_tile);
+    dim3 grid_dim((width + linear_tile - 1) / linear_tile, (height + linear_tile - 1) / linear_tile);
+    ::linear<<<grid_dim, block_dim>>>(height, width, shared_dim, input_strides[0], input_strides[1], weights_strides[0], weights_strides[1], input_type, weights_type, relu, input, weights, bias, output);
+}
+
+void CUDABackend::linear_backward(size_t height, size_t width, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* bias_gradients) {
+    const size_t n_blocks{ (width + 127) / 128 };
+    const size_t n_chunks{ std::max(std::min(height / 32, 1024 / n_blocks), static_cast<size_t>(1)) };
+    const size_t chunk_size{ (height + n_chunks - 1) / n_chunks };
+    if (n_chunks == 1) {
+        ::linear_backward<<<n_blocks, 128>>>(height, width, chunk_size, relu, output, gradients, pre_activation_gradients, bias_gradients);
+        return;
+    }
+    float* partial_sums{ allocator(Device::CUDA).allocate(width * n_chunks * sizeof(float)) };
+    ::linear_backward<<<dim3(n_blocks, n_chunks), 128>>>(height, width, chunk_size, relu, output, gradients, pre_activation_gradients, partial_sums);
+    Reduction partial_reduction{};
+    partial_reduction.n_outputs = width;
+    partial_reduction.n_reduced = n_chunks;
+    partial_reduction.kept_rank = 1;
+    partial_reduction.kept_shape[0] = width;
+    partial_reduction.kept_strides[0] = 1;
+    partial_reduction.reduced_rank = 1;
+    partial_reduction.reduced_shape[0] = n_chunks;
+    partial_reduction.reduced_strides[0] = width;
+    ::reduce_columns<<<(width + 255) / 256, 256>>>(partial_reduction, n_chunks, partial_sums, bias_gradients);
+    allocator(Device::CUDA).deallocate(partial_sums);
+}
+
+void CUDABackend::quantized_linear(size_t height, size_t width, size_t shared_dim, const QuantizedLinear& layer, float* input, float* weights, float* scales, float* bias, float* output) {
+    dim3 block_dim(linear_tile, linear_tile);
+    dim3 grid_dim((width + linear_tile - 1) / linear_tile, (height + linear_tile - 1) / linear_tile);
+    ::quantized_linear<<<grid_dim, block_dim>>>(height, width, shared_dim, layer, input, weights, scales, bias, output);
+}
+
+void CUDABackend::perceptron(size_t n, const Perceptron& perceptron, float* input, float* output) {
+    ::perceptron<<<(n + perceptron_tile - 1) / perceptron_tile, perceptron_threads>>>(n, perceptron, input, output);
+}
+
+void CUDABackend::perceptron_backward(size_t n, const Perceptron& perceptron, float* gradients) {
+    ::perceptron_backward<<<(n + perceptron_tile - 1) / perceptron_tile, perceptron_threads>>>(n, perceptron, gradients);
+    const size_t last{ perceptron.n_layers - 1 };
+    for (size_t layer = 0; layer <= last; ++layer) {
+        if (!perceptron.bias_gradients[layer]) continue;
+        const size_t columns{ layer == last ? perceptron.output_dim : perceptron.width };
+        Reduction reduction{};
+        reduction.n_outputs = columns;
+        reduction.n_reduced = n;
+        reduction.kept_rank = 1;
+        reduction.kept_shape[0] = columns;
+        reduction.kept_strides[0] = 1;
+        reduction.reduced_rank = 1;
+        reduction.reduced_shape[0] = n;
+        reduction.reduced_strides[0] = columns;
+        sum(reduction, layer == last ? gradients : perceptron.pre_activation_gradients[layer], perceptron.bias_gradients[layer]);
+    }
+}
+
+void CUDABackend::hash_encode(size_t n, const HashGrid& grid, float* input, float* tables, float* output) {
+    ::hash_encode<<<dim3((n + 255) / 256, grid.n_levels), 256>>>(n, grid, input, tables, output);
+}
+
+void CUDABackend::hash_encode_backward(size_t n, const HashGrid& grid, float* input, float* gradients, float* table_gradients) {
+    fill_scalar(grid.n_levels * grid.table_size * grid.n_features, 0, table_gradients);
+    ::hash_encode_backward<<<dim3((n + 255) / 256, grid.n_levels), 256>>>(n, grid, input, gradients, table_gradients);
+}
+
+void CUDABackend::positional_encode(size_t n, const FourierFeatures& features, float* input, float* output) {
+    const size_t n_threads{ n * features.input_dim * features.n_frequencies };
+    ::positional_encode<<<(n_threads + 255) / 256, 256>>>(n, features, input, output);
+}
+
+void CUDABackend::positional_encode_backward(size_t n, const FourierFeatures& features, float* output, float* gradients, float* input_gradients) {
+    const size_t n_threads{ n * features.input_dim };
+    ::positional_encode_backward<<<(n_threads + 255) / 256, 256>>>(n, features, output, gradients, input_gradients);
+}
+
+void CUDABackend::grid_coordinates(size_t n, const PixelGrid& grid, float* indices, float* output) {
+    ::grid_coordinates<<<(n + 255) / 256, 256>>>(n, grid, indices, output);
+}
+
+void CUDABackend::adam(const AdamUpdate& update, float* step, float* finite) {
+    const size_t n{ update.offsets[update.n_tensors] };
+    ::adam<<<(n + 255) / 256, 256>>>(update, step, finite);
+}
+
+void CUDABackend::unscale_gradients(const GradientScaling& scaling, float* scale, float* finite) {
+    const size_t n{ scaling.offsets[scaling.n_tensors] };
+    ::unscale_gradients<<<(n + 255) / 256, 256>>>(scaling, scale, finite);
+}
+
+void CUDABackend::update_scale(const GradientScaling& scaling, float* scale, float* finite, float* growth_tracker) {
+    ::update_scale<<<1, 1>>>(scaling, scale, finite, growth_tracker);
+}
+
+void CUDABackend::negate(size_t n, float* input, float* output) {
+    ::negate<<<(n + 255) / 256, 256>>>(n, input, output);
+}
+
+void CUDABackend::square(size_t n, float* input, float* output) {
+    ::square<<<(n + 255) / 256, 256>>>(n, input, output);
+}
+
+void CUDABackend::sum(const Reduction& reduction, float* input, float* output) {
+    const size_t n_outputs{ reduction.n_outputs };
+    const bool coalesced{ reduction.reduced_rank == 0 || reduction.reduced_strides[reduction.reduced_rank - 1] == 1 || n_outputs < 256 };
+    Reduction partial_reduction{};
+    partial_reduction.n_outputs = n_outputs;
+    partial_reduction.kept_rank = 1;
+    partial_reduction.kept_shape[0] = n_outputs;
+    partial_reduction.reduced_rank = 1;
+    if (coalesced) {
+        const size_t n_chunks{ std::min((reduction.n_reduced + 4095) / 4096, static_cast<size_t>(1024)) };
+        const size_t chunk_size{ (reduction.n_reduced + n_chunks - 1) / n_chunks };
+        const dim3 grid_dim(n_chunks, std::min(n_outputs, static_cast<size_t>(65535)));
+        if (n_chunks == 1) {
+            ::reduce_rows<<<grid_dim, 256>>>(reduction, chunk_size, input, output);
+            return;
+        }
+        float* partial_sums{ allocator(Device::CUDA).allocate(n_outputs * n_chunks * sizeof(float)) };
+        ::reduce_rows<<<grid_dim, 256>>>(reduction, chunk_size, input, partial_sums);
+        partial_reduction.n_reduced = n_chunks;
+        partial_reduction.kept_strides[0] = n_chunks;
+        partial_reduction.reduced_shape[0] = n_chunks;
+        partial_reduction.reduced_strides[0] = 1;
+        ::reduce_rows<<<dim3(1, grid_dim.y), 256>>>(partial_reduction, n_chunks, partial_sums, output);
+        allocator(Device::CUDA).deallocate(partial_sums);
+        return;
+    }
+    const size_t n_blocks{ (n_outputs + 255) / 256 };
+    const size_t n_chunks{ std::max(std::min(reduction.n_reduced / 32, 1024 / n_blocks), static_cast<size_t>(1)) };
+    const size_t chunk_size{ (reduction.n_reduced + n_chunks - 1) / n_chunks };
+    if (n_chunks == 1) {
+        ::reduce_columns<<<n_blocks, 256>>>(reduction, chunk_size, input, output);
+        return;
+    }
+    float* partial_sums{ allocator(Device::CUDA).allocate(n_outputs * n_chunks * sizeof(float)) };
+    ::reduce_columns<<<dim3(n_blocks, n_chunks), 256>>>(reduction, chunk_size, input, partial_sums);
+    partial_reduction.n_reduced = n_chunks;
+    partial_reduction.kept_strides[0] = 1;
+    partial_reduction.reduced_shape[0] = n_chunks;
+    partial_reduction.reduced_strides[0] = n_outputs;
+    ::reduce_columns<<<n_blocks, 256>>>(partial_reduction, n_chunks, partial_sums, output);
+    allocator(Device::CUDA).deallocate(partial_sums);
+}
+
+void CUDABackend::relu(size_t n, float* input, float* output) {
+    ::relu<<<(n + 255) / 256, 256>>>(n, input, output);
+}
+
+void CUDABackend::relu_d(size_t n, float* input, float* output) {
+    ::relu_d<<<(n + 255) / 256, 256>>>(n, input, output);
+}
+
+void CUDABackend::evaluate(size_t n, const Program& program, float* output) {
+    ::evaluate<<<(n + 255) / 256, 256>>>(n, program, output);
+}
+
+std::function<void()> CUDABackend::instantiate(const std::vector<std::function<void()>>& instructions) {
+    cudaGraph_t graph{};
+    cudaGraphExec_t graph_exec{};
+    cudaStreamBeginCapture(cudaStreamPerThread, cudaStreamCaptureModeRelaxed);
+    for (const std::function<void()>& instruction : instructions) instruction();
+    cudaStreamEndCapture(cudaStreamPerThread, &graph);
+    const cudaError_t error{ cudaGraphInstantiateWithFlags(&graph_exec, graph, 0) };
+    cudaGraphDestroy(graph);
+    if (error != cudaSuccess) throw std::runtime_error(cudaGetErrorString(error));
+    const std::shared_ptr<std::remove_pointer<cudaGraphExec_t>::type> executable{ graph_exec, cudaGraphExecDestroy };
+    return [executable]() { cudaGraphLaunch(executable.get(), cudaStreamPerThread); };
+}
+
+std::thread::id CUDABackend::stream() {
+    return std::this_thread::get_id();
+}
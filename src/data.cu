@@ -1,69 +1,348 @@
 #include <png.h>
+#include <mutex>
 #include <vector>
 #include <string>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
 #include "data.h"
 #include "tensor.h"
+#include "expression.h"
 
-void read_image(const std::string& path, Tensor& tensor, int& height, int& width) {
+extern std::mt19937 random_number_generator;
+
+const size_t max_pixel_index{ 1 << 24 };
+
+CoordinateGrid::CoordinateGrid(int height, int width, bool normalized) :
+    height{ height },
+    width{ width },
+    normalized{ normalized }
+{
+    if (height < 1 || width < 1) throw std::invalid_argument("grid must have at least one pixel");
+}
+
+size_t CoordinateGrid::size() const {
+    return static_cast<size_t>(height) * width;
+}
+
+PixelGrid CoordinateGrid::pixel_grid(size_t first) const {
+    PixelGrid grid{};
+    grid.width = width;
+    grid.first = first;
+    grid.scales[0] = normalized && height > 1 ? 1.f / (height - 1) : 1.f;
+    grid.scales[1] = normalized && width > 1 ? 1.f / (width - 1) : 1.f;
+    return grid;
+}
+
+Tensor CoordinateGrid::coordinates(Device device) const {
+    return coordinates(0, size(), device);
+}
+
+Tensor CoordinateGrid::coordinates(size_t first, size_t n, Device device) const {
+    if (first + n > size()) throw std::invalid_argument("pixels exceed the grid");
+    Tensor output{ {static_cast<int>(n), 2}, device };
+    backend(device).grid_coordinates(n, pixel_grid(first), nullptr, output.data.get());
+    return output;
+}
+
+Tensor CoordinateGrid::coordinates(const Tensor& indices) const {
+    if (indices.rank != 2 || indices.shape[1] != 1 || indices.dtype != DType::float32) throw std::invalid_argument("indices must be a float32 column vector");
+    if (size() > max_pixel_index) throw std::invalid_argument("grid has too many pixels to be indexed");
+    const Tensor contiguous_indices{ indices.strides[0] == 1 ? indices : Expression{ indices }.evaluate() };
+    Tensor output{ {indices.shape[0], 2}, indices.device };
+    backend(indices.device).grid_coordinates(indices.shape[0], pixel_grid(), contiguous_indices.data.get(), output.data.get());
+    return output;
+}
+
+DataLoader::DataLoader(const Tensor& inputs, const Tensor& targets, size_t batch_size, Sampling sampling, Device device) :
+    batch_size{ batch_size },
+    sampling{ sampling },
+    generator{ random_number_generator() }
+{
+    if (inputs.rank != 2 || targets.rank != 2 || inputs.shape[0] != targets.shape[0]) throw std::invalid_argument("inputs and targets must be matrices with the same number of rows");
+    if (batch_size < 1 || batch_size > inputs.shape[0]) throw std::invalid_argument("batch size must be between 1 and the number of samples");
+    n_samples = inputs.shape[0];
+    input_dim = inputs.shape[1];
+    target_dim = targets.shape[1];
+    staged_input_dim = input_dim;
+    input_data = inputs.to_host();
+    target_data = targets.to_host();
+    start(device);
+}
+
+DataLoader::DataLoader(const CoordinateGrid& grid, const Tensor& targets, size_t batch_size, Sampling sampling, Device device) :
+    batch_size{ batch_size },
+    sampling{ sampling },
+    generator{ random_number_generator() }
+{
+    if (targets.rank != 2 || static_cast<size_t>(targets.shape[0]) != grid.size()) throw std::invalid_argument("targets must be a matrix with one row per pixel");
+    if (batch_size < 1 || batch_size > grid.size()) throw std::invalid_argument("batch size must be between 1 and the number of samples");
+    if (grid.size() > max_pixel_index) throw std::invalid_argument("grid has too many pixels to be indexed");
+    n_samples = grid.size();
+    input_dim = 2;
+    target_dim = targets.shape[1];
+    staged_input_dim = 1;
+    from_grid = true;
+    this->grid = grid.pixel_grid();
+    target_data = targets.to_host();
+    start(device);
+}
+
+void DataLoader::start(Device device) {
+    inputs = Tensor{ {static_cast<int>(batch_size), static_cast<int>(input_dim)}, device };
+    targets = Tensor{ {static_cast<int>(batch_size), static_cast<int>(target_dim)}, device };
+    staged = Tensor{ {static_cast<int>(batch_size * (staged_input_dim + target_dim))}, device };
+    const size_t staging_size{ staged.size };
+    for (std::shared_ptr<float>& buffer : staging) buffer = std::shared_ptr<float>{ backend(device).allocate_host(staging_size), [device](float* data){ backend(device).deallocate_host(data); } };
+    batch = n_batches();
+    worker = std::thread{ [this]{ work(); } };
+    request(0);
+    wait();
+    staged_copy = backend(device).copy_from_host_async(staging_size, staging[0].get(), staged.data.get());
+    request(1);
+}
+
+DataLoader::~DataLoader() {
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        stop = true;
+    }
+    wake.notify_all();
+    worker.join();
+    staged_copy(true);
+}
+
+size_t DataLoader::n_batches() const {
+    return n_samples / batch_size;
+}
+
+void DataLoader::next() {
+    Backend& device_backend{ backend(staged.device) };
+    staged_copy(true);
+    if (from_grid) device_backend.grid_coordinates(batch_size, grid, staged.data.get(), inputs.data.get());
+    else device_backend.copy(inputs.size, staged.data.get(), inputs.data.get());
+    device_backend.copy(targets.size, staged.data.get() + batch_size * staged_input_dim, targets.data.get());
+    wait();
+    staged_copy = device_backend.copy_from_host_async(staged.size, staging[slot].get(), staged.data.get());
+    request(1 - slot);
+}
+
+void DataLoader::reorder() {
+    order.resize(n_batches() * batch_size);
+    if (sampling == Sampling::stratified) {
+        const size_t stratum_size{ n_samples / batch_size };
+        std::vector<size_t> stratum(stratum_size);
+        for (size_t j = 0; j < batch_size; ++j) {
+            std::iota(stratum.begin(), stratum.end(), j * stratum_size);
+            std::shuffle(stratum.begin(), stratum.end(), generator);
+            for (size_t b = 0; b < stratum_size; ++b) order[b * batch_size + j] = stratum[b];
+        }
+        return;
+    }
+    std::vector<size_t> indices(n_samples);
+    std::iota(indices.begin(), indices.end(), 0);
+    if (sampling == Sampling::shuffled) std::shuffle(indices.begin(), indices.end(), generator);
+    std::copy(indices.begin(), indices.begin() + order.size(), order.begin());
+}
+
+void DataLoader::gather(float* buffer) {
+    if (batch == n_batches()) {
+        reorder();
+        batch = 0;
+    }
+    float* batch_inputs{ buffer };
+    float* batch_targets{ buffer + batch_size * staged_input_dim };
+    for (size_t j = 0; j < batch_size; ++j) {
+        const size_t i{ order[batch * batch_size + j] };
+        if (from_grid) batch_inputs[j] = static_cast<float>(i);
+        else std::copy(input_data.begin() + i * input_dim, input_data.begin() + (i + 1) * input_dim, batch_inputs + j * input_dim);
+        std::copy(target_data.begin() + i * target_dim, target_data.begin() + (i + 1) * target_dim, batch_targets + j * target_dim);
+    }
+    ++batch;
+}
+
+void DataLoader::request(size_t slot) {
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        this->slot = slot;
+        requested = true;
+    }
+    wake.notify_all();
+}
+
+void DataLoader::wait() {
+    std::unique_lock<std::mutex> lock{ mutex };
+    finished.wait(lock, [this]{ return !requested; });
+}
+
+void DataLoader::work() {
+    std::unique_lock<std::mutex> lock{ mutex };
+    while (true) {
+        wake.wait(lock, [this]{ return stop || requested; });
+        if (stop) return;
+        float* buffer{ staging[slot].get() };
+        lock.unlock();
+        gather(buffer);
+        lock.lock();
+        requested = false;
+        finished.notify_all();
+    }
+}
+
+const int strip_rows{ 64 };
+
+static void decode_samples(size_t n, const png_byte* samples, int bit_depth, float scale, float* output) {
+    if (bit_depth == 16) {
+        for (size_t i = 0; i < n; ++i) output[i] = (samples[2 * i] << 8 | samples[2 * i + 1]) * scale;
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) output[i] = samples[i] * scale;
+}
+
+static void encode_samples(size_t n, const float* input, int bit_depth, float scale, png_byte* samples) {
+    const float max{ bit_depth == 16 ? 65535.f : 255.f };
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned sample{ static_cast<unsigned>(std::min(std::max(input[i] * scale + 0.5f, 0.f), max)) };
+        if (bit_depth == 16) {
+            samples[2 * i] = static_cast<png_byte>(sample >> 8);
+            samples[2 * i + 1] = static_cast<png_byte>(sample);
+        }
+        else samples[i] = static_cast<png_byte>(sample);
+    }
+}
+
+static png_structp create_writer(const std::string& path, FILE*& file_pointer, png_infop& info_pointer, int height, int width, int channels, int bit_depth) {
+    const int color_types[]{ PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA };
+    if (channels < 1 || channels > 4) throw std::invalid_argument("images must have 1 to 4 channels");
+    if (bit_depth != 8 && bit_depth != 16) throw std::invalid_argument("bit depth must be 8 or 16");
+    file_pointer = fopen(path.c_str(), "wb");
+    if (!file_pointer) throw std::runtime_error("cannot open " + path);
+    png_structp png_pointer = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_pointer = png_create_info_struct(png_pointer);
+    png_init_io(png_pointer, file_pointer);
+    png_set_IHDR(png_pointer, info_pointer, width, height,
+        bit_depth, color_types[channels - 1], PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_write_info(png_pointer, info_pointer);
+    return png_pointer;
+}
+
+static void close_writer(png_structp png_pointer, png_infop info_pointer, FILE* file_pointer) {
+    png_write_end(png_pointer, NULL);
+    png_destroy_write_struct(&png_pointer, &info_pointer);
+    fclose(file_pointer);
+}
+
+void read_image(const std::string& path, Tensor& tensor, int& height, int& width, bool normalized) {
     FILE* file_pointer = fopen(path.c_str(), "rb");
+    if (!file_pointer) throw std::runtime_error("cannot open " + path);
     png_structp png_pointer = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     png_infop info_pointer = png_create_info_struct(png_pointer);
     png_init_io(png_pointer, file_pointer);
     png_read_info(png_pointer, info_pointer);
     height = png_get_image_height(png_pointer, info_pointer);
     width = png_get_image_width(png_pointer, info_pointer);
-    png_bytep* row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-    for (int y = 0; y < height; ++y)
-        row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_pointer, info_pointer));
-    png_read_image(png_pointer, row_pointers);
-    std::vector<float> vector{};
-    for (int y = 0; y < height; ++y) {
-        png_byte* row = row_pointers[y];
-        for (int x = 0; x < width; ++x) {
-            vector.push_back(static_cast<float>(row[x]));
+    png_set_palette_to_rgb(png_pointer);
+    png_set_expand_gray_1_2_4_to_8(png_pointer);
+    if (png_get_valid(png_pointer, info_pointer, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png_pointer);
+    const int n_passes = png_set_interlace_handling(png_pointer);
+    png_read_update_info(png_pointer, info_pointer);
+    const int channels = png_get_channels(png_pointer, info_pointer);
+    const int bit_depth = png_get_bit_depth(png_pointer, info_pointer);
+    const float scale{ normalized ? 1.f / (bit_depth == 16 ? 65535 : 255) : 1.f };
+    const size_t row_bytes = png_get_rowbytes(png_pointer, info_pointer);
+    const size_t row_size{ static_cast<size_t>(width) * channels };
+    std::vector<png_byte> rows(row_bytes * (n_passes > 1 ? height : 1));
+    if (n_passes > 1) {
+        std::vector<png_bytep> row_pointers(height);
+        for (int y = 0; y < height; ++y) row_pointers[y] = rows.data() + y * row_bytes;
+        png_read_image(png_pointer, row_pointers.data());
+    }
+    tensor = Tensor{ {height * width, channels} };
+    Backend& device_backend{ backend(tensor.device) };
+    const size_t strip_size{ strip_rows * row_size };
+    const Device device{ tensor.device };
+    const std::shared_ptr<float> staging{ device_backend.allocate_host(2 * strip_size * sizeof(float)), [device](float* data){ backend(device).deallocate_host(data); } };
+    std::function<bool(bool)> copies[2]{ [](bool wait) { return true; }, [](bool wait) { return true; } };
+    for (int first = 0, strip = 0; first < height; first += strip_rows, strip ^= 1) {
+        const int last = std::min(first + strip_rows, height);
+        float* samples = staging.get() + strip * strip_size;
+        copies[strip](true);
+        for (int y = first; y < last; ++y) {
+            png_byte* row = rows.data();
+            if (n_passes > 1) row += y * row_bytes;
+            else png_read_row(png_pointer, row, NULL);
+            decode_samples(row_size, row, bit_depth, scale, samples + (y - first) * row_size);
         }
-        free(row);
+        copies[strip] = device_backend.copy_from_host_async((last - first) * row_size * sizeof(float), samples, tensor.data.get() + first * row_size);
     }
-    free(row_pointers);
-    tensor = Tensor::from_vector(vector, {height * width, 1});
+    for (const std::function<bool(bool)>& copy : copies) copy(true);
+    png_read_end(png_pointer, NULL);
+    png_destroy_read_struct(&png_pointer, &info_pointer, NULL);
     fclose(file_pointer);
 }
 
-void write_image(const std::string& path, Tensor& tensor, int height, int width) {
-    FILE* file_pointer = fopen(path.c_str(), "wb");
-    png_structp png_pointer = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info_pointer = png_create_info_struct(png_pointer);
-    png_init_io(png_pointer, file_pointer);
-    png_set_IHDR(png_pointer, info_pointer, width, height,
-        8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_write_info(png_pointer, info_pointer);
-    png_bytep* row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-    for (int y = 0; y < height; ++y) {
-        png_byte* row = (png_byte*) malloc(png_get_rowbytes(png_pointer, info_pointer));
-        row_pointers[y] = row;
-        for (int x = 0; x < width; ++x) {
-            row[x] = static_cast<png_byte>(tensor[{y * width + x, 0}]);
+void write_image(const std::string& path, Tensor& tensor, int height, int width, int bit_depth, bool normalized) {
+    const Tensor input{ tensor.dtype == DType::float32 ? tensor : tensor.to(DType::float32) };
+    const Tensor samples{ input.strides[0] == input.shape[1] && input.strides[1] == 1 ? input : Expression{ input }.evaluate() };
+    const int channels{ samples.shape[1] };
+    const float scale{ normalized ? (bit_depth == 16 ? 65535.f : 255.f) : 1.f };
+    FILE* file_pointer{};
+    png_infop info_pointer{};
+    png_structp png_pointer = create_writer(path, file_pointer, info_pointer, height, width, channels, bit_depth);
+    Backend& device_backend{ backend(samples.device) };
+    const size_t row_size{ static_cast<size_t>(width) * channels };
+    const size_t strip_size{ strip_rows * row_size };
+    const Device device{ samples.device };
+    const std::shared_ptr<float> staging{ device_backend.allocate_host(2 * strip_size * sizeof(float)), [device](float* data){ backend(device).deallocate_host(data); } };
+    std::function<bool(bool)> copies[2]{};
+    const auto copy_strip = [&](int first, int strip) {
+        const int last = std::min(first + strip_rows, height);
+        copies[strip] = device_backend.copy_to_host_async((last - first) * row_size * sizeof(float), samples.data.get() + first * row_size, staging.get() + strip * strip_size);
+    };
+    std::vector<png_byte> row(row_size * bit_depth / 8);
+    copy_strip(0, 0);
+    for (int first = 0, strip = 0; first < height; first += strip_rows, strip ^= 1) {
+        if (first + strip_rows < height) copy_strip(first + strip_rows, strip ^ 1);
+        copies[strip](true);
+        const float* strip_samples = staging.get() + strip * strip_size;
+        for (int y = first; y < std::min(first + strip_rows, height); ++y) {
+            encode_samples(row_size, strip_samples + (y - first) * row_size, bit_depth, scale, row.data());
+            png_write_row(png_pointer, row.data());
         }
     }
-    png_write_image(png_pointer, row_pointers);
-    png_write_end(png_pointer, NULL);
-    for (int y = 0; y < height; ++y)
-        free(row_pointers[y]);
-    free(row_pointers);
-    fclose(file_pointer);
+    close_writer(png_pointer, info_pointer, file_pointer);
 }
 
-void create_coordinates(int height, int width, Tensor& tensor) {
-    std::vector<float> vector{};
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            vector.insert(vector.end(), {static_cast<float>(y), static_cast<float>(x)});
+void render_image(const std::string& path, const std::function<Tensor(const Tensor&)>& model, int height, int width, int bit_depth) {
+    FILE* file_pointer{};
+    png_infop info_pointer{};
+    png_structp png_pointer{};
+    const CoordinateGrid grid{ height, width };
+    const float scale{ bit_depth == 16 ? 65535.f : 255.f };
+    std::vector<png_byte> row{};
+    for (int first = 0; first < height; first += strip_rows) {
+        const int last = std::min(first + strip_rows, height);
+        const Tensor output{ model(grid.coordinates(static_cast<size_t>(first) * width, static_cast<size_t>(last - first) * width)) };
+        const size_t row_size{ static_cast<size_t>(width) * output.shape[1] };
+        if (!png_pointer) {
+            png_pointer = create_writer(path, file_pointer, info_pointer, height, width, output.shape[1], bit_depth);
+            row.resize(row_size * bit_depth / 8);
+        }
+        const std::vector<float> samples{ output.to_host() };
+        for (int y = first; y < last; ++y) {
+            encode_samples(row_size, samples.data() + (y - first) * row_size, bit_depth, scale, row.data());
+            png_write_row(png_pointer, row.data());
         }
     }
-    tensor = Tensor::from_vector(vector, {height * width, 2});
+    if (png_pointer) close_writer(png_pointer, info_pointer, file_pointer);
+}
+
+void create_coordinates(int height, int width, Tensor& tensor) {
+    tensor = CoordinateGrid{ height, width, false }.coordinates();
 }
 
 void normalize(const std::vector<float>& max, Tensor& tensor) {
-    tensor = tensor / Tensor::from_vector(max, {1, static_cast<int>(max.size())});
+    tensor = tensor / Tensor::from_vector(max, {1, static_cast<int>(max.size())}, tensor.device);
 }
@@ -0,0 +1,303 @@
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include "expression.h"
+#include "autodiff.h"
+#include "backend.h"
+#include "utils.h"
+
+ExpressionNode::ExpressionNode(const Tensor& tensor) : operation{ ExpressionOperation::load }, tensor{ tensor } {}
+ExpressionNode::ExpressionNode(float constant) : operation{ ExpressionOperation::constant }, constant{ constant } {}
+ExpressionNode::ExpressionNode(ExpressionOperation operation, const std::vector<Expression>& inputs) : operation{ operation }, inputs{ inputs } {}
+
+Expression::Expression(const Tensor& tensor) : node{ new ExpressionNode{ tensor } } {}
+Expression::Expression(float scalar) : node{ new ExpressionNode{ scalar } } {}
+Expression::Expression(ExpressionOperation operation, const Expression& input) : node{ new ExpressionNode{ operation, {input} } } {}
+Expression::Expression(ExpressionOperation operation, const Expression& input1, const Expression& input2) : node{ new ExpressionNode{ operation, {input1, input2} } } {}
+
+static bool is_constant(const Expression& expression) {
+    return expression.node->operation == ExpressionOperation::constant;
+}
+
+static bool is_constant(const Expression& expression, float value) {
+    return is_constant(expression) && expression.node->constant == value;
+}
+
+static bool same_tensor(const Tensor& tensor1, const Tensor& tensor2) {
+    return tensor1.data == tensor2.data && tensor1.shape == tensor2.shape && tensor1.strides == tensor2.strides;
+}
+
+static bool compile(const Expression& expression, Program& program, std::vector<Tensor>& inputs, size_t depth, size_t& max_depth) {
+    const ExpressionNode& node{ *expression.node };
+    for (size_t i = 0; i < node.inputs.size(); ++i) {
+        if (!compile(node.inputs[i], program, inputs, depth + i, max_depth)) return false;
+    }
+    if (program.n_instructions == max_instructions) return false;
+    const size_t instruction{ program.n_instructions++ };
+    program.operations[instruction] = node.operation;
+    program.operands[instruction] = 0;
+    program.constants[instruction] = node.constant;
+    max_depth = std::max(max_depth, depth + 1);
+    if (max_depth > max_stack_size) return false;
+    if (node.operation != ExpressionOperation::load) return true;
+    size_t input{ 0 };
+    while (input < inputs.size() && !same_tensor(inputs[input], node.tensor)) ++input;
+    if (input == max_inputs) return false;
+    if (input == inputs.size()) inputs.push_back(node.tensor);
+    program.operands[instruction] = static_cast<unsigned char>(input);
+    return true;
+}
+
+static bool fits(const Expression& expression) {
+    Program program{};
+    std::vector<Tensor> inputs{};
+    size_t max_depth{ 0 };
+    return compile(expression, program, inputs, 0, max_depth);
+}
+
+static size_t count_instructions(const Expression& expression) {
+    size_t n_instructions{ 1 };
+    for (const Expression& input : expression.node->inputs) n_instructions += count_instructions(input);
+    return n_instructions;
+}
+
+static Expression split(const Expression& expression) {
+    const ExpressionNode& node{ *expression.node };
+    if (node.inputs.empty()) return expression;
+    std::vector<Expression> inputs{};
+    for (const Expression& input : node.inputs) inputs.push_back(split(input));
+    while (true) {
+        const Expression candidate{ inputs.size() == 1 ? Expression{ node.operation, inputs[0] } : Expression{ node.operation, inputs[0], inputs[1] } };
+        if (fits(candidate)) return candidate;
+        size_t largest{ 0 };
+        for (size_t i = 1; i < inputs.size(); ++i) {
+            if (count_instructions(inputs[i]) > count_instructions(inputs[largest])) largest = i;
+        }
+        inputs[largest] = Expression{ inputs[largest].evaluate() };
+    }
+}
+static void coalesce(Program& program) {
+    size_t rank{ 0 };
+    for (size_t i = 0; i < program.rank; ++i) {
+        if (program.shape[i] == 1) continue;
+        bool merge{ rank > 0 };
+        for (size_t j = 0; j < program.n_inputs; ++j) merge = merge && program.input_strides[j][rank - 1] == program.input_strides[j][i] * program.shape[i];
+        if (merge) program.shape[rank - 1] *= program.shape[i];
+        else program.shape[rank++] = program.shape[i];
+        for (size_t j = 0; j < program.n_inputs; ++j) program.input_strides[j][rank - 1] = program.input_strides[j][i];
+    }
+    if (!rank) {
+        program.shape[rank++] = 1;
+        for (size_t j = 0; j < program.n_inputs; ++j) program.input_strides[j][0] = 0;
+    }
+    program.rank = rank;
+    size_t stride{ 1 };
+    for (size_t i = rank; i-- > 0;) {
+        program.strides[i] = stride;
+        stride *= program.shape[i];
+    }
+}
+
+Tensor Expression::evaluate() const {
+    const Expression expression{ split(*this) };
+    Program program{};
+    std::vector<Tensor> inputs{};
+    size_t max_depth{ 0 };
+    compile(expression, program, inputs, 0, max_depth);
+    size_t rank{ 1 };
+    for (const Tensor& input : inputs) rank = std::max(rank, input.rank);
+    if (rank > max_rank) throw std::invalid_argument("tensor rank exceeds max_rank");
+    std::vector<int> shape(rank, 1);
+    for (const Tensor& input : inputs) {
+        if (input.device != inputs[0].device) throw std::invalid_argument("tensors are on different devices");
+        require_float32(input);
+        for (size_t i = 0; i < input.rank; ++i) {
+            int& dim{ shape[rank - input.rank + i] };
+            if (input.shape[i] == 1) continue;
+            if (dim != 1 && dim != input.shape[i]) throw std::invalid_argument("shapes cannot be broadcast");
+            dim = input.shape[i];
+        }
+    }
+    Tensor output{ shape, inputs.size() ? inputs[0].device : default_device() };
+    program.rank = rank;
+    for (size_t i = 0; i < rank; ++i) {
+        program.shape[i] = output.shape[i];
+        program.strides[i] = output.strides[i];
+    }
+    program.n_inputs = inputs.size();
+    std::vector<std::shared_ptr<Backward>> backwards{};
+    std::vector<Tensor> detached_inputs{};
+    bool requires_gradients{ false };
+    for (size_t j = 0; j < inputs.size(); ++j) {
+        const Tensor& input{ inputs[j] };
+        program.inputs[j] = input.data.get();
+        program.contiguous[j] = input.shape == output.shape && input.strides == output.strides;
+        for (size_t i = 0; i < rank; ++i) program.input_strides[j][i] = 0;
+        for (size_t i = 0; i < input.rank; ++i) {
+            if (input.shape[i] != 1) program.input_strides[j][rank - input.rank + i] = input.strides[i];
+        }
+        backwards.push_back(input.backward_pointer);
+        detached_inputs.push_back(input.detach());
+        if (input.backward_pointer) requires_gradients = true;
+    }
+    coalesce(program);
+    backend(output.device).evaluate(output.n_elements, program, output.data.get());
+    if (requires_gradients) output.backward_pointer = std::shared_ptr<Backward>{ new ExpressionBackward{ expression.detach(), detached_inputs, backwards } };
+    return output;
+}
+
+Expression Expression::detach() const {
+    const ExpressionNode& expression_node{ *node };
+    if (expression_node.operation == ExpressionOperation::load) return Expression{ expression_node.tensor.detach() };
+    if (expression_node.operation == ExpressionOperation::constant) return *this;
+    if (expression_node.inputs.size() == 1) return Expression{ expression_node.operation, expression_node.inputs[0].detach() };
+    return Expression{ expression_node.operation, expression_node.inputs[0].detach(), expression_node.inputs[1].detach() };
+}
+
+static void sort_nodes(const Expression& expression, std::unordered_set<const ExpressionNode*>& visited, std::vector<Expression>& order) {
+    if (!visited.insert(expression.node.get()).second) return;
+    for (const Expression& input : expression.node->inputs) sort_nodes(input, visited, order);
+    order.push_back(expression);
+}
+
+std::vector<Tensor> Expression::gradients(const Tensor& output_gradients, const std::vector<Tensor>& inputs, const std::vector<bool>& required) const {
+    std::vector<Expression> order{};
+    std::unordered_set<const ExpressionNode*> visited{};
+    sort_nodes(*this, visited, order);
+    std::unordered_map<const ExpressionNode*, bool> requires_gradients{};
+    std::unordered_map<const ExpressionNode*, Expression> values{};
+    for (const Expression& expression : order) {
+        const ExpressionNode& node{ *expression.node };
+        bool required_node{ false };
+        if (node.operation == ExpressionOperation::load) {
+            for (size_t i = 0; i < inputs.size(); ++i) required_node = required_node || (required[i] && same_tensor(inputs[i], node.tensor));
+        }
+        for (const Expression& input : node.inputs) required_node = required_node || requires_gradients.at(input.node.get());
+        requires_gradients.emplace(&node, required_node);
+        if (node.inputs.empty()) values.emplace(&node, expression);
+    }
+    const auto value = [&](const Expression& expression) {
+        std::vector<const ExpressionNode*> pending{ expression.node.get() };
+        while (pending.size()) {
+            const ExpressionNode& node{ *pending.back() };
+            if (values.count(&node)) {
+                pending.pop_back();
+                continue;
+            }
+            bool ready{ true };
+            for (const Expression& input : node.inputs) {
+                if (!values.count(input.node.get())) {
+                    pending.push_back(input.node.get());
+                    ready = false;
+                }
+            }
+            if (!ready) continue;
+            const Expression& input1{ values.at(node.inputs[0].node.get()) };
+            const Expression result{ node.inputs.size() == 1 ? Expression{ node.operation, input1 } : Expression{ node.operation, input1, values.at(node.inputs[1].node.get()) } };
+            values.emplace(&node, Expression{ result.evaluate() });
+            pending.pop_back();
+        }
+        return values.at(expression.node.get());
+    };
+    std::unordered_map<const ExpressionNode*, Tensor> node_gradients{ {node.get(), output_gradients} };
+    std::vector<Tensor> input_gradients(inputs.size());
+    const auto accumulate = [](Tensor& accumulated, const Expression& gradients) {
+        accumulated = (accumulated.data ? Expression{ accumulated } + gradients : gradients).evaluate();
+    };
+    for (auto expression = order.rbegin(); expression != order.rend(); ++expression) {
+        const ExpressionNode& node{ *expression->node };
+        const auto found = node_gradients.find(&node);
+        if (found == node_gradients.end() || !requires_gradients.at(&node)) continue;
+        const Expression gradients{ found->second };
+        const std::vector<Expression>& node_inputs{ node.inputs };
+        std::vector<Expression> local_gradients{};
+        switch (node.operation) {
+            case ExpressionOperation::load:
+                for (size_t i = 0; i < inputs.size(); ++i) {
+                    if (required[i] && same_tensor(inputs[i], node.tensor)) accumulate(input_gradients[i], gradients);
+                }
+                break;
+            case ExpressionOperation::add:
+                local_gradients = { gradients, gradients };
+                break;
+            case ExpressionOperation::subtract:
+                local_gradients = { gradients, -gradients };
+                break;
+            case ExpressionOperation::multiply:
+                local_gradients = { gradients * value(node_inputs[1]), gradients * value(node_inputs[0]) };
+                break;
+            case ExpressionOperation::divide:
+                local_gradients = { gradients / value(node_inputs[1]), -gradients * value(node_inputs[0]) / square(value(node_inputs[1])) };
+                break;
+            case ExpressionOperation::negate:
+                local_gradients = { -gradients };
+                break;
+            case ExpressionOperation::square:
+                local_gradients = { 2.f * value(node_inputs[0]) * gradients };
+                break;
+            case ExpressionOperation::relu:
+                local_gradients = { relu_d(value(node_inputs[0])) * gradients };
+                break;
+            default:
+                break;
+        }
+        for (size_t i = 0; i < local_gradients.size(); ++i) {
+            const ExpressionNode* input{ node_inputs[i].node.get() };
+            if (requires_gradients.at(input)) accumulate(node_gradients[input], local_gradients[i]);
+        }
+        node_gradients.erase(&node);
+    }
+    return input_gradients;
+}
+
+Expression operator+ (const Expression& expression1, const Expression& expression2) {
+    if (is_constant(expression1) && is_constant(expression2)) return Expression{ expression1.node->constant + expression2.node->constant };
+    if (is_constant(expression1, 0)) return expression2;
+    if (is_constant(expression2, 0)) return expression1;
+    return Expression{ ExpressionOperation::add, expression1, expression2 };
+}
+
+Expression operator- (const Expression& expression1, const Expression& expression2) {
+    if (is_constant(expression1) && is_constant(expression2)) return Expression{ expression1.node->constant - expression2.node->constant };
+    if (is_constant(expression1, 0)) return -expression2;
+    if (is_constant(expression2, 0)) return expression1;
+    return Expression{ ExpressionOperation::subtract, expression1, expression2 };
+}
+
+Expression operator* (const Expression& expression1, const Expression& expression2) {
+    if (is_constant(expression1) && is_constant(expression2)) return Expression{ expression1.node->constant * expression2.node->constant };
+    if (is_constant(expression1, 0) || is_constant(expression2, 0)) return Expression{ 0.f };
+    if (is_constant(expression1, 1)) return expression2;
+    if (is_constant(expression2, 1)) return expression1;
+    return Expression{ ExpressionOperation::multiply, expression1, expression2 };
+}
+
+Expression operator/ (const Expression& expression1, const Expression& expression2) {
+    if (is_constant(expression1) && is_constant(expression2)) return Expression{ expression1.node->constant / expression2.node->constant };
+    if (is_constant(expression1, 0)) return Expression{ 0.f };
+    if (is_constant(expression2, 1)) return expression1;
+    return Expression{ ExpressionOperation::divide, expression1, expression2 };
+}
+
+Expression operator- (const Expression& input) {
+    if (is_constant(input)) return Expression{ -input.node->constant };
+    if (input.node->operation == ExpressionOperation::negate) return input.node->inputs[0];
+    return Expression{ ExpressionOperation::negate, input };
+}
+
+Expression square(const Expression& input) {
+    if (is_constant(input)) return Expression{ input.node->constant * input.node->constant };
+    return Expression{ ExpressionOperation::square, input };
+}
+
+Expression relu(const Expression& input) {
+    if (is_constant(input)) return Expression{ input.node->constant > 0 ? input.node->constant : 0.f };
+    return Expression{ ExpressionOperation::relu, input };
+}
+
+Expression relu_d(const Expression& input) {
+    if (is_constant(input)) return Expression{ input.node->constant > 0 ? 1.f : 0.f };
+    return Expression{ ExpressionOperation::relu_d, input };
+}
@@ -0,0 +1,497 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "gemm.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GEMM_X86
+#endif
+
+const size_t KC{ 256 };
+
+struct PortableKernel {
+    enum { MR = 4, NR = 8 };
+    static void run(size_t k, const float* a, const float* b, float* c, size_t c_stride, bool accumulate) {
+        float accumulators[MR][NR]{};
+        for (size_t p = 0; p < k; ++p, a += MR, b += NR) {
+            for (size_t i = 0; i < MR; ++i) {
+                for (size_t j = 0; j < NR; ++j) accumulators[i][j] += a[i] * b[j];
+            }
+        }
+        for (size_t i = 0; i < MR; ++i) {
+            for (size_t j = 0; j < NR; ++j) c[i * c_stride + j] = accumulate ? c[i * c_stride + j] + accumulators[i][j] : accumulators[i][j];
+        }
+    }
+};
+
+#ifdef GEMM_X86
+struct AVX2Kernel {
+    enum { MR = 6, NR = 16 };
+    __attribute__((target("avx2,fma")))
+    static void run(size_t k, const float* a, const float* b, float* c, size_t c_stride, bool accumulate) {
+        __m256 accumulators[MR][2];
+        for (size_t i = 0; i < MR; ++i) accumulators[i][0] = accumulators[i][1] = _mm256_setzero_ps();
+        for (size_t p = 0; p < k; ++p, a += MR, b += NR) {
+            const __m256 b0{ _mm256_loadu_ps(b) };
+            const __m256 b1{ _mm256_loadu_ps(b + 8) };
+            for (size_t i = 0; i < MR; ++i) {
+                const __m256 a_i{ _mm256_broadcast_ss(a + i) };
+                accumulators[i][0] = _mm256_fmadd_ps(a_i, b0, accumulators[i][0]);
+                accumulators[i][1] = _mm256_fmadd_ps(a_i, b1, accumulators[i][1]);
+            }
+        }
+        for (size_t i = 0; i < MR; ++i) {
+            float* c_row{ c + i * c_stride };
+            if (accumulate) {
+                accumulators[i][0] = _mm256_add_ps(accumulators[i][0], _mm256_loadu_ps(c_row));
+                accumulators[i][1] = _mm256_add_ps(accumulators[i][1], _mm256_loadu_ps(c_row + 8));
+            }
+            _mm256_storeu_ps(c_row, accumulators[i][0]);
+            _mm256_storeu_ps(c_row + 8, accumulators[i][1]);
+        }
+    }
+};
+
+struct AVX512Kernel {
+    enum { MR = 8, NR = 32 };
+    __attribute__((target("avx512f")))
+    static void run(size_t k, const float* a, const float* b, float* c, size_t c_stride, bool accumulate) {
+        __m512 accumulators[MR][2];
+        for (size_t i = 0; i < MR; ++i) accumulators[i][0] = accumulators[i][1] = _mm512_setzero_ps();
+        for (size_t p = 0; p < k; ++p, a += MR, b += NR) {
+            const __m512 b0{ _mm512_loadu_ps(b) };
+            const __m512 b1{ _mm512_loadu_ps(b + 16) };
+            for (size_t i = 0; i < MR; ++i) {
+                const __m512 a_i{ _mm512_set1_ps(a[i]) };
+                accumulators[i][0] = _mm512_fmadd_ps(a_i, b0, accumulators[i][0]);
+                accumulators[i][1] = _mm512_fmadd_ps(a_i, b1, accumulators[i][1]);
+            }
+        }
+        for (size_t i = 0; i < MR; ++i) {
+            float* c_row{ c + i * c_stride };
+            if (accumulate) {
+                accumulators[i][0] = _mm512_add_ps(accumulators[i][0], _mm512_loadu_ps(c_row));
+                accumulators[i][1] = _mm512_add_ps(accumulators[i][1], _mm512_loadu_ps(c_row + 16));
+            }
+            _mm512_storeu_ps(c_row, accumulators[i][0]);
+            _mm512_storeu_ps(c_row + 16, accumulators[i][1]);
+        }
+    }
+};
+#endif
+
+template <typename Kernel>
+void pack_tensor1(size_t rows, size_t k, const float* tensor1, size_t row_stride, size_t column_stride, float* packed) {
+    for (size_t panel = 0; panel < rows; panel += Kernel::MR) {
+        const size_t panel_rows{ std::min(static_cast<size_t>(Kernel::MR), rows - panel) };
+        for (size_t p = 0; p < k; ++p) {
+            const float* column{ tensor1 + panel * row_stride + p * column_stride };
+            for (size_t i = 0; i < panel_rows; ++i) packed[i] = column[i * row_stride];
+            for (size_t i = panel_rows; i < Kernel::MR; ++i) packed[i] = 0;
+            packed += Kernel::MR;
+        }
+    }
+}
+
+template <typename Kernel>
+void pack_tensor2(size_t k, size_t columns, const float* tensor2, size_t row_stride, size_t column_stride, float* packed) {
+    for (size_t panel = 0; panel < columns; panel += Kernel::NR) {
+        const size_t panel_columns{ std::min(static_cast<size_t>(Kernel::NR), columns - panel) };
+        for (size_t p = 0; p < k; ++p) {
+            const float* row{ tensor2 + p * row_stride + panel * column_stride };
+            if (column_stride == 1) std::copy(row, row + panel_columns, packed);
+            else for (size_t j = 0; j < panel_columns; ++j) packed[j] = row[j * column_stride];
+            std::fill(packed + panel_columns, packed + Kernel::NR, 0.f);
+            packed += Kernel::NR;
+        }
+    }
+}
+
+template <typename Kernel>
+void macro_kernel(size_t rows, size_t columns, size_t k, const float* packed1, const float* packed2, float* output, size_t row_stride, size_t column_stride, bool accumulate) {
+    float tile[Kernel::MR * Kernel::NR];
+    for (size_t j = 0; j < columns; j += Kernel::NR) {
+        const size_t tile_columns{ std::min(static_cast<size_t>(Kernel::NR), columns - j) };
+        for (size_t i = 0; i < rows; i += Kernel::MR) {
+            const size_t tile_rows{ std::min(static_cast<size_t>(Kernel::MR), rows - i) };
+            const float* panel1{ packed1 + i * k };
+            const float* panel2{ packed2 + j * k };
+            float* c{ output + i * row_stride + j * column_stride };
+            if (tile_rows == Kernel::MR && tile_columns == Kernel::NR && column_stride == 1) {
+                Kernel::run(k, panel1, panel2, c, row_stride, accumulate);
+                continue;
+            }
+            Kernel::run(k, panel1, panel2, tile, Kernel::NR, false);
+            for (size_t ti = 0; ti < tile_rows; ++ti) {
+                for (size_t tj = 0; tj < tile_columns; ++tj) {
+                    float& element{ c[ti * row_stride + tj * column_stride] };
+                    element = accumulate ? element + tile[ti * Kernel::NR + tj] : tile[ti * Kernel::NR + tj];
+                }
+            }
+        }
+    }
+}
+
+void apply_epilogue(size_t rows, size_t columns, float* output, size_t row_stride, size_t column_stride, size_t column, Epilogue epilogue) {
+    if (!epilogue.bias && !epilogue.relu) return;
+    for (size_t i = 0; i < rows; ++i) {
+        float* row{ output + i * row_stride };
+        for (size_t j = 0; j < columns; ++j) {
+            float& element{ row[j * column_stride] };
+            if (epilogue.bias) element += epilogue.bias[column + j];
+            if (epilogue.relu) element = element > 0 ? element : 0;
+        }
+    }
+}
+
+template <typename Kernel>
+void gemm_blocked(size_t batch_size, size_t height, size_t width, size_t shared_dim, Matrix tensor1, Matrix tensor2, Matrix output, Epilogue epilogue) {
+    const size_t MC{ 16 * Kernel::MR };
+    const size_t NC{ 64 * Kernel::NR };
+    const size_t row_blocks{ (height + MC - 1) / MC };
+    const size_t column_blocks{ (width + NC - 1) / NC };
+    const size_t blocks{ batch_size * row_blocks * column_blocks };
+    size_t k_splits{ 1 };
+    if (blocks < n_threads()) k_splits = std::max(std::min((n_threads() + blocks - 1) / blocks, shared_dim / KC), static_cast<size_t>(1));
+    const size_t output_elements{ batch_size * height * width };
+    std::vector<float> partials((k_splits - 1) * output_elements);
+    parallel_for(blocks * k_splits, 1, [&](size_t begin, size_t end) {
+        thread_local std::vector<float> packed1{};
+        thread_local std::vector<float> packed2{};
+        packed1.resize(MC * KC);
+        packed2.resize(KC * NC);
+        for (size_t job = begin; job < end; ++job) {
+            const size_t split{ job / blocks };
+            const size_t block{ job % blocks };
+            const size_t batch{ block / (row_blocks * column_blocks) };
+            const size_t row_block{ block / column_blocks % row_blocks };
+            const size_t column_block{ block % column_blocks };
+            const size_t row{ row_block * MC };
+            const size_t column{ column_block * NC };
+            const size_t rows{ std::min(MC, height - row) };
+            const size_t columns{ std::min(NC, width - column) };
+            const size_t k_begin{ split * shared_dim / k_splits };
+            const size_t k_end{ (split + 1) * shared_dim / k_splits };
+            float* c{ split ? &partials[(split - 1) * output_elements] + batch * height * width + row * width + column : output.data + batch * output.batch_stride + row * output.row_stride + column * output.column_stride };
+            const size_t c_row_stride{ split ? width : output.row_stride };
+            const size_t c_column_stride{ split ? 1 : output.column_stride };
+            for (size_t p = k_begin; p < k_end; p += KC) {
+                const size_t k{ std::min(KC, k_end - p) };
+                pack_tensor2<Kernel>(k, columns, tensor2.data + batch * tensor2.batch_stride + p * tensor2.row_stride + column * tensor2.column_stride, tensor2.row_stride, tensor2.column_stride, &packed2[0]);
+                pack_tensor1<Kernel>(rows, k, tensor1.data + batch * tensor1.batch_stride + row * tensor1.row_stride + p * tensor1.column_stride, tensor1.row_stride, tensor1.column_stride, &packed1[0]);
+                macro_kernel<Kernel>(rows, columns, k, &packed1[0], &packed2[0], c, c_row_stride, c_column_stride, p != k_begin);
+            }
+            if (k_begin == k_end && !split) {
+                for (size_t i = 0; i < rows; ++i) {
+                    for (size_t j = 0; j < columns; ++j) c[i * c_row_stride + j * c_column_stride] = 0;
+                }
+            }
+            if (k_splits == 1) apply_epilogue(rows, columns, c, c_row_stride, c_column_stride, column, epilogue);
+        }
+    });
+    if (k_splits == 1) return;
+    parallel_for(output_elements, 4096, [&](size_t begin, size_t end) {
+        for (size_t index = begin; index < end; ++index) {
+            const size_t batch{ index / (height * width) };
+            const size_t row{ index / width % height };
+            const size_t column{ index % width };
+            float& element{ output.data[batch * output.batch_stride + row * output.row_stride + column * output.column_stride] };
+            for (size_t split = 1; split < k_splits; ++split) element += partials[(split - 1) * output_elements + index];
+            apply_epilogue(1, 1, &element, 0, 0, column, epilogue);
+        }
+    });
+}
+
+void gemv(size_t batch_size, size_t height, size_t shared_dim, Matrix matrix, Matrix vector, Matrix output) {
+    if (matrix.column_stride == 1 || matrix.row_stride != 1) {
+        parallel_for(batch_size * height, std::max(16384 / (shared_dim + 1), static_cast<size_t>(1)), [&](size_t begin, size_t end) {
+            for (size_t index = begin; index < end; ++index) {
+                const size_t batch{ index / height };
+                const size_t row{ index % height };
+                const float* matrix_row{ matrix.data + batch * matrix.batch_stride + row * matrix.row_stride };
+                const float* vector_data{ vector.data + batch * vector.batch_stride };
+                float sums[8]{};
+                size_t p{ 0 };
+                if (matrix.column_stride == 1 && vector.row_stride == 1) {
+                    for (; p + 8 <= shared_dim; p += 8) {
+                        for (size_t i = 0; i < 8; ++i) sums[i] += matrix_row[p + i] * vector_data[p + i];
+                    }
+                }
+                for (; p < shared_dim; ++p) sums[0] += matrix_row[p * matrix.column_stride] * vector_data[p * vector.row_stride];
+                output.data[batch * output.batch_stride + row * output.row_stride] = ((sums[0] + sums[4]) + (sums[1] + sums[5])) + ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+            }
+        });
+        return;
+    }
+    const size_t n_splits{ std::max(std::min(n_threads(), shared_dim * height / 16384), static_cast<size_t>(1)) };
+    for (size_t batch = 0; batch < batch_size; ++batch) {
+        std::vector<float> partials(n_splits * height, 0);
+        const float* matrix_data{ matrix.data + batch * matrix.batch_stride };
+        const float* vector_data{ vector.data + batch * vector.batch_stride };
+        parallel_for(n_splits, 1, [&](size_t begin, size_t end) {
+            for (size_t split = begin; split < end; ++split) {
+                float* partial{ &partials[split * height] };
+                for (size_t p = split * shared_dim / n_splits; p < (split + 1) * shared_dim / n_splits; ++p) {
+                    const float* matrix_column{ matrix_data + p * matrix.column_stride };
+                    const float scalar{ vector_data[p * vector.row_stride] };
+                    for (size_t row = 0; row < height; ++row) partial[row] += matrix_column[row] * scalar;
+                }
+            }
+        });
+        for (size_t row = 0; row < height; ++row) {
+            float sum{ 0 };
+            for (size_t split = 0; split < n_splits; ++split) sum += partials[split * height + row];
+            output.data[batch * output.batch_stride + row * output.row_stride] = sum;
+        }
+    }
+}
+
+typedef void (*GemmFunction)(size_t, size_t, size_t, size_t, Matrix, Matrix, Matrix, Epilogue);
+
+GemmFunction select_gemm() {
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return gemm_blocked<AVX512Kernel>;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return gemm_blocked<AVX2Kernel>;
+#endif
+    return gemm_blocked<PortableKernel>;
+}
+
+void gemm(size_t batch_size, size_t height, size_t width, size_t shared_dim, Matrix tensor1, Matrix tensor2, Matrix output, Epilogue epilogue) {
+    static const GemmFunction gemm_function{ select_gemm() };
+    if (width != 1 && height != 1) {
+        gemm_function(batch_size, height, width, shared_dim, tensor1, tensor2, output, epilogue);
+        return;
+    }
+    if (width == 1) {
+        gemv(batch_size, height, shared_dim, tensor1, Matrix{ tensor2.data, tensor2.batch_stride, tensor2.row_stride, 0 }, Matrix{ output.data, output.batch_stride, output.row_stride, 0 });
+    }
+    else {
+        gemv(batch_size, width, shared_dim, Matrix{ tensor2.data, tensor2.batch_stride, tensor2.column_stride, tensor2.row_stride }, Matrix{ tensor1.data, tensor1.batch_stride, tensor1.column_stride, 0 }, Matrix{ output.data, output.batch_stride, output.column_stride, 0 });
+    }
+    for (size_t batch = 0; batch < batch_size; ++batch) apply_epilogue(height, width, output.data + batch * output.batch_stride, output.row_stride, output.column_stride, 0, epilogue);
+}
+
+struct Requantization {
+    const int* compensations;
+    const float* multipliers;
+    const float* bias;
+    bool relu;
+    bool int8;
+    float inverse_scale;
+};
+
+void requantize(size_t columns, const int* accumulators, const Requantization& requantization, void* output) {
+    for (size_t j = 0; j < columns; ++j) {
+        float value{ static_cast<float>(accumulators[j] - requantization.compensations[j]) * requantization.multipliers[j] + requantization.bias[j] };
+        if (requantization.relu) value = value > 0 ? value : 0;
+        if (requantization.int8) static_cast<signed char*>(output)[j] = quantize(value * requantization.inverse_scale);
+        else static_cast<float*>(output)[j] = value;
+    }
+}
+
+struct PortableInt8Kernel {
+    enum { MR = 4, NR = 8, KR = 4, offset = 0 };
+    typedef signed char Input;
+    typedef signed char Weight;
+    static void run(size_t k, const Input* a, size_t a_stride, const Weight* b, int* c) {
+        int accumulators[MR][NR]{};
+        for (size_t p = 0; p < k; p += KR, b += NR * KR) {
+            for (size_t i = 0; i < MR; ++i) {
+                for (size_t j = 0; j < NR; ++j) {
+                    for (size_t r = 0; r < KR; ++r) accumulators[i][j] += a[i * a_stride + p + r] * b[j * KR + r];
+                }
+            }
+        }
+        for (size_t i = 0; i < MR; ++i) std::copy(accumulators[i], accumulators[i] + NR, c + i * NR);
+    }
+    static void requantize(const int* accumulators, const Requantization& requantization, void* output) {
+        ::requantize(NR, accumulators, requantization, output);
+    }
+};
+
+#ifdef GEMM_X86
+struct AVX2Int8Kernel {
+    enum { MR = 6, NR = 16, KR = 2, offset = 0 };
+    typedef short Input;
+    typedef short Weight;
+    __attribute__((target("avx2")))
+    static void run(size_t k, const Input* a, size_t a_stride, const Weight* b, int* c) {
+        __m256i accumulators[MR][2];
+        for (size_t i = 0; i < MR; ++i) accumulators[i][0] = accumulators[i][1] = _mm256_setzero_si256();
+        for (size_t p = 0; p < k; p += KR, b += NR * KR) {
+            const __m256i b0{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)) };
+            const __m256i b1{ _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + 16)) };
+            for (size_t i = 0; i < MR; ++i) {
+                int pair;
+                std::memcpy(&pair, a + i * a_stride + p, sizeof(int));
+                const __m256i broadcast{ _mm256_set1_epi32(pair) };
+                accumulators[i][0] = _mm256_add_epi32(accumulators[i][0], _mm256_madd_epi16(broadcast, b0));
+                accumulators[i][1] = _mm256_add_epi32(accumulators[i][1], _mm256_madd_epi16(broadcast, b1));
+            }
+        }
+        for (size_t i = 0; i < MR; ++i) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(c + i * NR), accumulators[i][0]);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(c + i * NR + 8), accumulators[i][1]);
+        }
+    }
+    __attribute__((target("avx2")))
+    static void requantize(const int* accumulators, const Requantization& requantization, void* output) {
+        for (size_t j = 0; j < NR; j += 8) {
+            const __m256i accumulator{ _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(accumulators + j)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(requantization.compensations + j))) };
+            __m256 value{ _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(accumulator), _mm256_loadu_ps(requantization.multipliers + j)), _mm256_loadu_ps(requantization.bias + j)) };
+            if (requantization.relu) value = _mm256_max_ps(value, _mm256_setzero_ps());
+            if (!requantization.int8) {
+                _mm256_storeu_ps(static_cast<float*>(output) + j, value);
+                continue;
+            }
+            value = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(value, _mm256_set1_ps(requantization.inverse_scale)), _mm256_set1_ps(-127.f)), _mm256_set1_ps(127.f));
+            const __m256i rounded{ _mm256_cvtps_epi32(value) };
+            const __m128i words{ _mm_packs_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1)) };
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(static_cast<signed char*>(output) + j), _mm_packs_epi16(words, words));
+        }
+    }
+};
+
+struct AVX512VNNIKernel {
+    enum { MR = 8, NR = 32, KR = 4, offset = 128 };
+    typedef signed char Input;
+    typedef signed char Weight;
+    __attribute__((target("avx512f,avx512vnni")))
+    static void run(size_t k, const Input* a, size_t a_stride, const Weight* b, int* c) {
+        __m512i accumulators[MR][2];
+        for (size_t i = 0; i < MR; ++i) accumulators[i][0] = accumulators[i][1] = _mm512_setzero_si512();
+        for (size_t p = 0; p < k; p += KR, b += NR * KR) {
+            const __m512i b0{ _mm512_loadu_si512(b) };
+            const __m512i b1{ _mm512_loadu_si512(b + 64) };
+            for (size_t i = 0; i < MR; ++i) {
+                unsigned quad;
+                std::memcpy(&quad, a + i * a_stride + p, sizeof(unsigned));
+                const __m512i broadcast{ _mm512_set1_epi32(static_cast<int>(quad ^ 0x80808080u)) };
+                accumulators[i][0] = _mm512_dpbusd_epi32(accumulators[i][0], broadcast, b0);
+                accumulators[i][1] = _mm512_dpbusd_epi32(accumulators[i][1], broadcast, b1);
+            }
+        }
+        for (size_t i = 0; i < MR; ++i) {
+            _mm512_storeu_si512(c + i * NR, accumulators[i][0]);
+            _mm512_storeu_si512(c + i * NR + 16, accumulators[i][1]);
+        }
+    }
+    __attribute__((target("avx512f")))
+    static void requantize(const int* accumulators, const Requantization& requantization, void* output) {
+        const __mmask16 all{ 0xFFFF };
+        for (size_t j = 0; j < NR; j += 16) {
+            const __m512i accumulator{ _mm512_sub_epi32(_mm512_loadu_si512(accumulators + j), _mm512_loadu_si512(requantization.compensations + j)) };
+            __m512 value{ _mm512_add_ps(_mm512_mul_ps(_mm512_maskz_cvtepi32_ps(all, accumulator), _mm512_loadu_ps(requantization.multipliers + j)), _mm512_loadu_ps(requantization.bias + j)) };
+            if (requantization.relu) value = _mm512_maskz_max_ps(all, value, _mm512_setzero_ps());
+            if (!requantization.int8) {
+                _mm512_storeu_ps(static_cast<float*>(output) + j, value);
+                continue;
+            }
+            value = _mm512_maskz_min_ps(all, _mm512_maskz_max_ps(all, _mm512_mul_ps(value, _mm512_set1_ps(requantization.inverse_scale)), _mm512_set1_ps(-127.f)), _mm512_set1_ps(127.f));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(static_cast<signed char*>(output) + j), _mm512_maskz_cvtepi32_epi8(all, _mm512_maskz_cvtps_epi32(all, value)));
+        }
+    }
+};
+#endif
+
+template <typename Input>
+void quantize_rows(size_t rows, size_t shared_dim, size_t k, const QuantizedMatrix& input, size_t row, Input* output) {
+    const float inverse_scale{ 1 / input.scale };
+    for (size_t i = 0; i < rows; ++i) {
+        Input* output_row{ output + i * k };
+        const size_t start{ (row + i) * input.row_stride };
+        if (input.int8) {
+            const signed char* input_row{ static_cast<const signed char*>(input.data) + start };
+            for (size_t p = 0; p < shared_dim; ++p) output_row[p] = input_row[p * input.column_stride];
+        }
+        else if (input.column_stride == 1) {
+            const float* input_row{ static_cast<const float*>(input.data) + start };
+            for (size_t p = 0; p < shared_dim; ++p) output_row[p] = quantize(input_row[p] * inverse_scale);
+        }
+        else {
+            const float* input_row{ static_cast<const float*>(input.data) + start };
+            for (size_t p = 0; p < shared_dim; ++p) output_row[p] = quantize(input_row[p * input.column_stride] * inverse_scale);
+        }
+        std::fill(output_row + shared_dim, output_row + k, 0);
+    }
+}
+
+template <typename Kernel>
+void pack_quantized_weights(size_t shared_dim, size_t width, size_t k, const QuantizedMatrix& weights, size_t column, typename Kernel::Weight* packed, int* compensations) {
+    for (size_t j = 0; j < Kernel::NR; ++j) {
+        int sum{ 0 };
+        for (size_t p = 0; p < k; ++p) {
+            const int value{ column + j < width && p < shared_dim ? static_cast<const signed char*>(weights.data)[p * weights.row_stride + (column + j) * weights.column_stride] : 0 };
+            packed[(p / Kernel::KR * Kernel::NR + j) * Kernel::KR + p % Kernel::KR] = static_cast<typename Kernel::Weight>(value);
+            sum += value;
+        }
+        compensations[j] = Kernel::offset * sum;
+    }
+}
+
+template <typename Kernel>
+void gemm_int8_blocked(size_t height, size_t width, size_t shared_dim, QuantizedMatrix input, QuantizedMatrix weights, void* output, QuantizedEpilogue epilogue) {
+    const size_t MC{ 16 * Kernel::MR };
+    const size_t k{ (shared_dim + Kernel::KR - 1) / Kernel::KR * Kernel::KR };
+    const size_t panels{ (width + Kernel::NR - 1) / Kernel::NR };
+    std::vector<typename Kernel::Weight> packed_weights(panels * k * Kernel::NR);
+    std::vector<int> compensations(panels * Kernel::NR);
+    std::vector<float> multipliers(panels * Kernel::NR, 0.f);
+    std::vector<float> bias(panels * Kernel::NR, 0.f);
+    for (size_t j = 0; j < width; ++j) {
+        multipliers[j] = input.scale * epilogue.scales[j];
+        bias[j] = epilogue.bias[j];
+    }
+    parallel_for(panels, 1, [&](size_t begin, size_t end) {
+        for (size_t panel = begin; panel < end; ++panel) pack_quantized_weights<Kernel>(shared_dim, width, k, weights, panel * Kernel::NR, &packed_weights[panel * k * Kernel::NR], &compensations[panel * Kernel::NR]);
+    });
+    const bool direct{ sizeof(typename Kernel::Input) == 1 && input.int8 && input.column_stride == 1 && shared_dim == k };
+    const size_t output_element_size{ epilogue.int8 ? sizeof(signed char) : sizeof(float) };
+    parallel_for((height + MC - 1) / MC, 1, [&](size_t begin, size_t end) {
+        thread_local std::vector<typename Kernel::Input> quantized_input{};
+        quantized_input.resize(Kernel::MR * k);
+        int tile[Kernel::MR * Kernel::NR];
+        for (size_t block = begin; block < end; ++block) {
+            for (size_t row = block * MC; row < std::min((block + 1) * MC, height); row += Kernel::MR) {
+                const size_t rows{ std::min(static_cast<size_t>(Kernel::MR), height - row) };
+                const typename Kernel::Input* a{ static_cast<const typename Kernel::Input*>(input.data) + row * input.row_stride };
+                size_t a_stride{ input.row_stride };
+                if (!direct || rows < Kernel::MR) {
+                    quantize_rows(rows, shared_dim, k, input, row, &quantized_input[0]);
+                    a = &quantized_input[0];
+                    a_stride = k;
+                }
+                for (size_t panel = 0; panel < panels; ++panel) {
+                    const size_t column{ panel * Kernel::NR };
+                    const size_t columns{ std::min(static_cast<size_t>(Kernel::NR), width - column) };
+                    const Requantization requantization{ &compensations[column], &multipliers[column], &bias[column], epilogue.relu, epilogue.int8, 1 / epilogue.scale };
+                    Kernel::run(k, a, a_stride, &packed_weights[panel * k * Kernel::NR], tile);
+                    for (size_t i = 0; i < rows; ++i) {
+                        char* output_row{ static_cast<char*>(output) + ((row + i) * width + column) * output_element_size };
+                        if (columns == Kernel::NR) Kernel::requantize(tile + i * Kernel::NR, requantization, output_row);
+                        else requantize(columns, tile + i * Kernel::NR, requantization, output_row);
+                    }
+                }
+            }
+        }
+    });
+}
+
+typedef void (*QuantizedGemmFunction)(size_t, size_t, size_t, QuantizedMatrix, QuantizedMatrix, void*, QuantizedEpilogue);
+
+QuantizedGemmFunction select_gemm_int8() {
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni")) return gemm_int8_blocked<AVX512VNNIKernel>;
+    if (__builtin_cpu_supports("avx2")) return gemm_int8_blocked<AVX2Int8Kernel>;
+#endif
+    return gemm_int8_blocked<PortableInt8Kernel>;
+}
+
+void gemm_int8(size_t height, size_t width, size_t shared_dim, QuantizedMatrix input, QuantizedMatrix weights, void* output, QuantizedEpilogue epilogue) {
+    static const QuantizedGemmFunction gemm_function{ select_gemm_int8() };
+    gemm_function(height, width, shared_dim, input, weights, output, epilogue);
+}
@@ -0,0 +1,369 @@
+#include <map>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include "graph.h"
+#include "allocator.h"
+
+struct BufferLifetime {
+    float* data;
+    size_t size;
+    size_t first;
+    size_t last;
+    size_t offset;
+    bool used;
+};
+
+static std::vector<float*> perceptron_buffers(const Perceptron& perceptron) {
+    std::vector<float*> buffers{};
+    for (size_t layer = 0; layer < perceptron.n_layers; ++layer) {
+        buffers.insert(buffers.end(), { perceptron.weights[layer], perceptron.biases[layer], perceptron.activations[layer], perceptron.pre_activation_gradients[layer], perceptron.bias_gradients[layer] });
+    }
+    return buffers;
+}
+
+static Perceptron bind_perceptron(const Perceptron& perceptron, const std::vector<float*>& buffers) {
+    Perceptron bound_perceptron{ perceptron };
+    for (size_t layer = 0; layer < perceptron.n_layers; ++layer) {
+        bound_perceptron.weights[layer] = buffers[5 * layer];
+        bound_perceptron.biases[layer] = buffers[5 * layer + 1];
+        bound_perceptron.activations[layer] = buffers[5 * layer + 2];
+        bound_perceptron.pre_activation_gradients[layer] = buffers[5 * layer + 3];
+        bound_perceptron.bias_gradients[layer] = buffers[5 * layer + 4];
+    }
+    return bound_perceptron;
+}
+
+static std::vector<float*> adam_buffers(const AdamUpdate& update) {
+    std::vector<float*> buffers{};
+    for (size_t tensor = 0; tensor < update.n_tensors; ++tensor) {
+        buffers.insert(buffers.end(), { update.parameters[tensor], update.gradients[tensor], update.first_moments[tensor], update.second_moments[tensor] });
+    }
+    return buffers;
+}
+
+static AdamUpdate bind_adam(const AdamUpdate& update, const std::vector<float*>& buffers) {
+    AdamUpdate bound_update{ update };
+    for (size_t tensor = 0; tensor < update.n_tensors; ++tensor) {
+        bound_update.parameters[tensor] = buffers[4 * tensor];
+        bound_update.gradients[tensor] = buffers[4 * tensor + 1];
+        bound_update.first_moments[tensor] = buffers[4 * tensor + 2];
+        bound_update.second_moments[tensor] = buffers[4 * tensor + 3];
+    }
+    return bound_update;
+}
+
+static std::vector<float*> scaling_buffers(const GradientScaling& scaling) {
+    return std::vector<float*>(scaling.gradients, scaling.gradients + scaling.n_tensors);
+}
+
+static GradientScaling bind_scaling(const GradientScaling& scaling, const std::vector<float*>& buffers) {
+    GradientScaling bound_scaling{ scaling };
+    std::copy(buffers.begin(), buffers.begin() + scaling.n_tensors, bound_scaling.gradients);
+    return bound_scaling;
+}
+
+RecordingBackend::RecordingBackend(Backend& backend) : backend{ backend } {}
+
+void RecordingBackend::record(const std::vector<float*>& buffers, const std::function<void(Backend& backend, const std::vector<float*>& buffers)>& run) {
+    run(backend, buffers);
+    instructions.push_back(Instruction{ run, buffers });
+}
+
+float* RecordingBackend::allocate(size_t size) {
+    return backend.allocate(size);
+}
+
+void RecordingBackend::deallocate(float* data) {
+    backend.deallocate(data);
+}
+
+void RecordingBackend::copy_from_host(size_t size, const float* input, float* output) {
+    throw std::logic_error("host transfers cannot be captured");
+}
+
+void RecordingBackend::copy_to_host(size_t size, const float* input, float* output) {
+    throw std::logic_error("host transfers cannot be captured");
+}
+
+float* RecordingBackend::allocate_host(size_t size) {
+    return backend.allocate_host(size);
+}
+
+void RecordingBackend::deallocate_host(float* data) {
+    backend.deallocate_host(data);
+}
+
+std::function<bool(bool)> RecordingBackend::copy_to_host_async(size_t size, const float* input, float* output) {
+    throw std::logic_error("host transfers cannot be captured");
+}
+
+std::function<bool(bool)> RecordingBackend::copy_from_host_async(size_t size, const float* input, float* output) {
+    throw std::logic_error("host transfers cannot be captured");
+}
+
+void RecordingBackend::copy(size_t size, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.copy(size, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::convert(size_t n, DType input_type, DType output_type, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.convert(n, input_type, output_type, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::fill_scalar(size_t n, float scalar, float* output) {
+    record({output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.fill_scalar(n, scalar, buffers[0]); });
+}
+
+void RecordingBackend::add(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* sum) {
+    record({tensor1, tensor2, sum}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.add(n, broadcast, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::subtract(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* difference) {
+    record({tensor1, tensor2, difference}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.subtract(n, broadcast, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::multiply(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* product) {
+    record({tensor1, tensor2, product}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.multiply(n, broadcast, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::divide(size_t n, const Broadcast& broadcast, float* tensor1, float* tensor2, float* quotient) {
+    record({tensor1, tensor2, quotient}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.divide(n, broadcast, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::matrix_multiply(size_t batch_size, size_t rank, size_t height, size_t width, size_t shared_dim, const size_t* tensor1_strides, const size_t* tensor2_strides, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product) {
+    const std::vector<size_t> strides1(tensor1_strides, tensor1_strides + rank);
+    const std::vector<size_t> strides2(tensor2_strides, tensor2_strides + rank);
+    record({tensor1, tensor2, matrix_product}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.matrix_multiply(batch_size, rank, height, width, shared_dim, strides1.data(), strides2.data(), tensor1_type, tensor2_type, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::linear(size_t height, size_t width, size_t shared_dim, const size_t* input_strides, const size_t* weights_strides, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output) {
+    const std::vector<size_t> strides1(input_strides, input_strides + 2);
+    const std::vector<size_t> strides2(weights_strides, weights_strides + 2);
+    record({input, weights, bias, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.linear(height, width, shared_dim, strides1.data(), strides2.data(), input_type, weights_type, relu, buffers[0], buffers[1], buffers[2], buffers[3]); });
+}
+
+void RecordingBackend::linear_backward(size_t height, size_t width, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* bias_gradients) {
+    record({output, gradients, pre_activation_gradients, bias_gradients}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.linear_backward(height, width, relu, buffers[0], buffers[1], buffers[2], buffers[3]); });
+}
+
+void RecordingBackend::quantized_linear(size_t height, size_t width, size_t shared_dim, const QuantizedLinear& layer, float* input, float* weights, float* scales, float* bias, float* output) {
+    record({input, weights, scales, bias, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.quantized_linear(height, width, shared_dim, layer, buffers[0], buffers[1], buffers[2], buffers[3], buffers[4]); });
+}
+
+void RecordingBackend::perceptron(size_t n, const Perceptron& perceptron, float* input, float* output) {
+    std::vector<float*> buffers{ perceptron_buffers(perceptron) };
+    buffers.insert(buffers.end(), { input, output });
+    record(buffers, [=](Backend& backend, const std::vector<float*>& buffers) { backend.perceptron(n, bind_perceptron(perceptron, buffers), buffers.end()[-2], buffers.back()); });
+}
+
+void RecordingBackend::perceptron_backward(size_t n, const Perceptron& perceptron, float* gradients) {
+    std::vector<float*> buffers{ perceptron_buffers(perceptron) };
+    buffers.push_back(gradients);
+    record(buffers, [=](Backend& backend, const std::vector<float*>& buffers) { backend.perceptron_backward(n, bind_perceptron(perceptron, buffers), buffers.back()); });
+}
+
+void RecordingBackend::hash_encode(size_t n, const HashGrid& grid, float* input, float* tables, float* output) {
+    record({input, tables, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.hash_encode(n, grid, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::hash_encode_backward(size_t n, const HashGrid& grid, float* input, float* gradients, float* table_gradients) {
+    record({input, gradients, table_gradients}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.hash_encode_backward(n, grid, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::positional_encode(size_t n, const FourierFeatures& features, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.positional_encode(n, features, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::positional_encode_backward(size_t n, const FourierFeatures& features, float* output, float* gradients, float* input_gradients) {
+    record({output, gradients, input_gradients}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.positional_encode_backward(n, features, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::grid_coordinates(size_t n, const PixelGrid& grid, float* indices, float* output) {
+    if (!indices) {
+        record({output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.grid_coordinates(n, grid, nullptr, buffers[0]); });
+        return;
+    }
+    record({indices, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.grid_coordinates(n, grid, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::adam(const AdamUpdate& update, float* step, float* finite) {
+    std::vector<float*> buffers{ adam_buffers(update) };
+    buffers.push_back(step);
+    if (!finite) {
+        record(buffers, [=](Backend& backend, const std::vector<float*>& buffers) { backend.adam(bind_adam(update, buffers), buffers.back(), nullptr); });
+        return;
+    }
+    buffers.push_back(finite);
+    record(buffers, [=](Backend& backend, const std::vector<float*>& buffers) { backend.adam(bind_adam(update, buffers), buffers.end()[-2], buffers.back()); });
+}
+
+void RecordingBackend::unscale_gradients(const GradientScaling& scaling, float* scale, float* finite) {
+    std::vector<float*> buffers{ scaling_buffers(scaling) };
+    buffers.insert(buffers.end(), { scale, finite });
+    record(buffers, [=](Backend& backend, const std::vector<float*>& buffers) { backend.unscale_gradients(bind_scaling(scaling, buffers), buffers.end()[-2], buffers.back()); });
+}
+
+void RecordingBackend::update_scale(const GradientScaling& scaling, float* scale, float* finite, float* growth_tracker) {
+    record({scale, finite, growth_tracker}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.update_scale(scaling, buffers[0], buffers[1], buffers[2]); });
+}
+
+void RecordingBackend::negate(size_t n, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.negate(n, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::square(size_t n, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.square(n, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::sum(const Reduction& reduction, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.sum(reduction, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::relu(size_t n, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.relu(n, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::relu_d(size_t n, float* input, float* output) {
+    record({input, output}, [=](Backend& backend, const std::vector<float*>& buffers) { backend.relu_d(n, buffers[0], buffers[1]); });
+}
+
+void RecordingBackend::evaluate(size_t n, const Program& program, float* output) {
+    std::vector<float*> buffers(program.inputs, program.inputs + program.n_inputs);
+    buffers.push_back(output);
+    record(buffers, [=](Backend& backend, const std::vector<float*>& buffers) {
+        Program bound_program{ program };
+        for (size_t j = 0; j < bound_program.n_inputs; ++j) bound_program.inputs[j] = buffers[j];
+        backend.evaluate(n, bound_program, buffers.back());
+    });
+}
+
+std::function<void()> RecordingBackend::instantiate(const std::vector<std::function<void()>>& instructions) {
+    return backend.instantiate(instructions);
+}
+
+std::thread::id RecordingBackend::stream() {
+    return backend.stream();
+}
+
+Graph::Graph(Device device) : device{ device } {}
+
+Graph::~Graph() {
+    release();
+}
+
+void Graph::capture(const std::function<void()>& step) {
+    release();
+    CachingAllocator& device_allocator{ allocator(device) };
+    RecordingBackend recording_backend{ backend(device) };
+    device_allocator.begin_capture();
+    set_backend(device, &recording_backend);
+    try {
+        step();
+    }
+    catch (...) {
+        set_backend(device, nullptr);
+        for (const CapturedBlock& block : device_allocator.end_capture()) blocks.push_back(block.data);
+        release();
+        throw;
+    }
+    set_backend(device, nullptr);
+    std::vector<Instruction>& instructions{ recording_backend.instructions };
+    plan_memory(device_allocator.end_capture(), instructions);
+    Backend* target{ &backend(device) };
+    std::vector<std::function<void()>> steps{};
+    for (const Instruction& instruction : instructions) steps.push_back([instruction, target]() { instruction.run(*target, instruction.buffers); });
+    device_allocator.begin_capture();
+    try {
+        replay_step = target->instantiate(steps);
+    }
+    catch (...) {
+        for (const CapturedBlock& block : device_allocator.end_capture()) blocks.push_back(block.data);
+        release();
+        throw;
+    }
+    for (const CapturedBlock& block : device_allocator.end_capture()) blocks.push_back(block.data);
+    n_instructions = instructions.size();
+}
+
+void Graph::replay() const {
+    if (!replay_step) throw std::logic_error("graph has not been captured");
+    replay_step();
+}
+
+size_t Graph::size() const {
+    return n_instructions;
+}
+
+MemoryPlan Graph::memory_plan() const {
+    return plan;
+}
+
+void Graph::plan_memory(const std::vector<CapturedBlock>& captured_blocks, std::vector<Instruction>& instructions) {
+    std::vector<BufferLifetime> lifetimes{};
+    std::map<float*, size_t> temporaries{};
+    plan = MemoryPlan{};
+    for (const CapturedBlock& block : captured_blocks) {
+        if (!block.freed) {
+            blocks.push_back(block.data);
+            plan.persistent_bytes += block.size;
+            continue;
+        }
+        temporaries[block.data] = lifetimes.size();
+        lifetimes.push_back(BufferLifetime{ block.data, block.size, 0, 0, 0, false });
+    }
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        for (float* buffer : instructions[i].buffers) {
+            auto temporary = temporaries.upper_bound(buffer);
+            if (temporary == temporaries.begin()) continue;
+            BufferLifetime& lifetime{ lifetimes[(--temporary)->second] };
+            if (buffer >= lifetime.data + lifetime.size / sizeof(float)) continue;
+            if (!lifetime.used) lifetime.first = i;
+            lifetime.last = i;
+            lifetime.used = true;
+        }
+    }
+    std::vector<size_t> order(lifetimes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return lifetimes[a].size > lifetimes[b].size; });
+    std::vector<const BufferLifetime*> placed{};
+    for (size_t index : order) {
+        BufferLifetime& lifetime{ lifetimes[index] };
+        if (!lifetime.used) continue;
+        std::vector<const BufferLifetime*> overlapping{};
+        for (const BufferLifetime* other : placed) {
+            if (other->first <= lifetime.last && lifetime.first <= other->last) overlapping.push_back(other);
+        }
+        std::sort(overlapping.begin(), overlapping.end(), [](const BufferLifetime* a, const BufferLifetime* b) { return a->offset < b->offset; });
+        for (const BufferLifetime* other : overlapping) {
+            if (other->offset >= lifetime.offset + lifetime.size) break;
+            lifetime.offset = std::max(lifetime.offset, other->offset + other->size);
+        }
+        placed.push_back(&lifetime);
+        ++plan.n_buffers;
+        plan.naive_bytes += lifetime.size;
+        plan.planned_bytes = std::max(plan.planned_bytes, lifetime.offset + lifetime.size);
+    }
+    if (plan.planned_bytes) arena = allocator(device).allocate(plan.planned_bytes);
+    for (Instruction& instruction : instructions) {
+        for (float*& buffer : instruction.buffers) {
+            auto temporary = temporaries.upper_bound(buffer);
+            if (temporary == temporaries.begin()) continue;
+            const BufferLifetime& lifetime{ lifetimes[(--temporary)->second] };
+            if (buffer < lifetime.data + lifetime.size / sizeof(float)) buffer = arena + lifetime.offset / sizeof(float) + (buffer - lifetime.data);
+        }
+    }
+    std::vector<float*> released_blocks{};
+    for (const BufferLifetime& lifetime : lifetimes) released_blocks.push_back(lifetime.data);
+    allocator(device).release_captured_blocks(released_blocks);
+}
+
+void Graph::release() {
+    replay_step = nullptr;
+    n_instructions = 0;
+    plan = MemoryPlan{};
+    allocator(device).deallocate(arena);
+    arena = nullptr;
+    allocator(device).release_captured_blocks(blocks);
+    blocks.clear();
+}
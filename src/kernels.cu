@@ -1,16 +1,44 @@
+#include <cuda_fp16.h>
+#include <cuda_bf16.h>
 #include "kernels.h"
 
 __device__
-void get_indices(size_t index, size_t rank, size_t* strides1, size_t* strides2, size_t* strides, size_t* indices)
+int quantize(float value)
+{
+    return __float2int_rn(fminf(fmaxf(value, -127.f), 127.f));
+}
+
+__device__
+float load(const float* data, size_t index, DType dtype)
+{
+    if (dtype == DType::int8) return reinterpret_cast<const signed char*>(data)[index];
+    if (dtype == DType::float16) return __half2float(reinterpret_cast<const __half*>(data)[index]);
+    if (dtype == DType::bfloat16) return __bfloat162float(reinterpret_cast<const __nv_bfloat16*>(data)[index]);
+    return data[index];
+}
+
+__device__
+void store(float* data, size_t index, DType dtype, float value)
+{
+    if (dtype == DType::int8) reinterpret_cast<signed char*>(data)[index] = quantize(value);
+    else if (dtype == DType::float16) reinterpret_cast<__half*>(data)[index] = __float2half_rn(value);
+    else if (dtype == DType::bfloat16) reinterpret_cast<__nv_bfloat16*>(data)[index] = __float2bfloat16_rn(value);
+    else data[index] = value;
+}
+
+__device__
+void get_indices(size_t index, const Broadcast& broadcast, size_t* indices)
 {
     size_t index_remainder = index;
     indices[0] = 0;
     indices[1] = 0;
-    for (int i = 0; i < rank; ++i) {
-        const size_t dim = index_remainder / strides[i];
-        index_remainder -= dim * strides[i];
-        indices[0] += dim * strides1[i];
-        indices[1] += dim * strides2[i];
+    indices[2] = 0;
+    for (int i = 0; i < broadcast.rank; ++i) {
+        const size_t dim = index_remainder / broadcast.strides[i];
+        index_remainder -= dim * broadcast.strides[i];
+        indices[0] += dim * broadcast.tensor1_strides[i];
+        indices[1] += dim * broadcast.tensor2_strides[i];
+        indices[2] += dim * broadcast.output_strides[i];
     }
 }
 
@@ -22,72 +50,427 @@ void fill_scalar(size_t n, float scalar, float* output)
 }
 
 __global__
-void add(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* sum)
+void convert(size_t n, DType input_type, DType output_type, float* input, float* output)
 {
-  const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
-  if (index < n) {
-      size_t indices[2];
-      get_indices(index, rank, tensor1_strides, tensor2_strides, strides, indices);
-      sum[index] = tensor1[indices[0]] + tensor2[indices[1]];
-  }
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) store(output, index, output_type, load(input, index, input_type));
 }
 
 __global__
-void subtract(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* difference)
+void add(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* sum)
 {
-  const int index = blockIdx.x * blockDim.x + threadIdx.x;
+  const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index < n) {
-      size_t indices[2];
-      get_indices(index, rank, tensor1_strides, tensor2_strides, strides, indices);
-      difference[index] = tensor1[indices[0]] - tensor2[indices[1]];
+      size_t indices[3]{ index, index, index };
+      if (!broadcast.contiguous) get_indices(index, broadcast, indices);
+      sum[indices[2]] = tensor1[indices[0]] + tensor2[indices[1]];
   }
 }
 
 __global__
-void subtract(size_t n, float* tensor1, float* tensor2, float* difference)
+void subtract(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* difference)
 {
-  const int index = blockIdx.x * blockDim.x + threadIdx.x;
-  if (index < n) difference[index] = tensor1[index] - tensor2[index];
+  const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index < n) {
+      size_t indices[3]{ index, index, index };
+      if (!broadcast.contiguous) get_indices(index, broadcast, indices);
+      difference[indices[2]] = tensor1[indices[0]] - tensor2[indices[1]];
+  }
 }
 
 __global__
-void multiply(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* product)
+void multiply(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* product)
 {
   const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index < n) {
-      size_t indices[2];
-      get_indices(index, rank, tensor1_strides, tensor2_strides, strides, indices);
-      product[index] = tensor1[indices[0]] * tensor2[indices[1]];
+      size_t indices[3]{ index, index, index };
+      if (!broadcast.contiguous) get_indices(index, broadcast, indices);
+      product[indices[2]] = tensor1[indices[0]] * tensor2[indices[1]];
   }
 }
 
 __global__
-void divide(size_t n, size_t rank, size_t* tensor1_strides, size_t* tensor2_strides, size_t* strides, float* tensor1, float* tensor2, float* quotient)
+void divide(size_t n, Broadcast broadcast, float* tensor1, float* tensor2, float* quotient)
 {
   const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index < n) {
-      size_t indices[2];
-      get_indices(index, rank, tensor1_strides, tensor2_strides, strides, indices);
-      quotient[index] = tensor1[indices[0]] / tensor2[indices[1]];
+      size_t indices[3]{ index, index, index };
+      if (!broadcast.contiguous) get_indices(index, broadcast, indices);
+      quotient[indices[2]] = tensor1[indices[0]] / tensor2[indices[1]];
   }
 }
 
 __global__
-void matrix_multiply(size_t rank, size_t height, size_t width, size_t shared_dim, size_t* tensor1_strides, size_t* tensor2_strides, float* tensor1, float* tensor2, float* matrix_product)
+void matrix_multiply(size_t height, size_t width, size_t shared_dim, size_t tensor1_row_stride, size_t tensor1_column_stride, size_t tensor2_row_stride, size_t tensor2_column_stride, DType tensor1_type, DType tensor2_type, float* tensor1, float* tensor2, float* matrix_product)
 {
     const size_t row = blockIdx.x * blockDim.x + threadIdx.x;
     const size_t column = blockIdx.y * blockDim.y + threadIdx.y;
     if (row < height && column < width) {
-        const size_t tensor1_start = blockIdx.z * height * shared_dim + row * tensor1_strides[rank - 2];
-        const size_t tensor2_start = blockIdx.z * width * shared_dim + column * tensor2_strides[rank - 1];
+        const size_t tensor1_start = blockIdx.z * height * shared_dim + row * tensor1_row_stride;
+        const size_t tensor2_start = blockIdx.z * width * shared_dim + column * tensor2_column_stride;
         float product{ 0 };
         for (int i = 0; i < shared_dim; ++i) {
-            product += tensor1[tensor1_start + i * tensor1_strides[rank - 1]] * tensor2[tensor2_start + i * tensor2_strides[rank - 2]];
+            product += load(tensor1, tensor1_start + i * tensor1_column_stride, tensor1_type) * load(tensor2, tensor2_start + i * tensor2_row_stride, tensor2_type);
         }
         matrix_product[blockIdx.z * height * width + row * width + column] = product;
     }
 }
 
+__global__
+void linear(size_t height, size_t width, size_t shared_dim, size_t input_row_stride, size_t input_column_stride, size_t weights_row_stride, size_t weights_column_stride, DType input_type, DType weights_type, bool relu, float* input, float* weights, float* bias, float* output)
+{
+    __shared__ float input_tile[linear_tile][linear_tile];
+    __shared__ float weights_tile[linear_tile][linear_tile];
+    const size_t row = blockIdx.y * linear_tile + threadIdx.y;
+    const size_t column = blockIdx.x * linear_tile + threadIdx.x;
+    float product{ 0 };
+    for (size_t tile = 0; tile < shared_dim; tile += linear_tile) {
+        input_tile[threadIdx.y][threadIdx.x] = row < height && tile + threadIdx.x < shared_dim ? load(input, row * input_row_stride + (tile + threadIdx.x) * input_column_stride, input_type) : 0;
+        weights_tile[threadIdx.y][threadIdx.x] = column < width && tile + threadIdx.y < shared_dim ? load(weights, (tile + threadIdx.y) * weights_row_stride + column * weights_column_stride, weights_type) : 0;
+        __syncthreads();
+        for (int i = 0; i < linear_tile; ++i) product += input_tile[threadIdx.y][i] * weights_tile[i][threadIdx.x];
+        __syncthreads();
+    }
+    if (row < height && column < width) {
+        product += bias[column];
+        output[row * width + column] = relu && product < 0 ? 0 : product;
+    }
+}
+
+__global__
+void quantized_linear(size_t height, size_t width, size_t shared_dim, QuantizedLinear layer, float* input, float* weights, float* scales, float* bias, float* output)
+{
+    __shared__ int input_tile[linear_tile][linear_tile];
+    __shared__ int weights_tile[linear_tile][linear_tile];
+    const size_t row = blockIdx.y * linear_tile + threadIdx.y;
+    const size_t column = blockIdx.x * linear_tile + threadIdx.x;
+    const float inverse_scale = 1 / layer.input_scale;
+    int product{ 0 };
+    for (size_t tile = 0; tile < shared_dim; tile += linear_tile) {
+        int input_value{ 0 };
+        if (row < height && tile + threadIdx.x < shared_dim) {
+            const size_t index = row * layer.input_strides[0] + (tile + threadIdx.x) * layer.input_strides[1];
+            input_value = layer.input_type == DType::int8 ? reinterpret_cast<const signed char*>(input)[index] : quantize(input[index] * inverse_scale);
+        }
+        input_tile[threadIdx.y][threadIdx.x] = input_value;
+        weights_tile[threadIdx.y][threadIdx.x] = column < width && tile + threadIdx.y < shared_dim ? reinterpret_cast<const signed char*>(weights)[(tile + threadIdx.y) * layer.weights_strides[0] + column * layer.weights_strides[1]] : 0;
+        __syncthreads();
+        for (int i = 0; i < linear_tile; ++i) product += input_tile[threadIdx.y][i] * weights_tile[i][threadIdx.x];
+        __syncthreads();
+    }
+    if (row < height && column < width) {
+        float value = product * (layer.input_scale * scales[column]) + bias[column];
+        if (layer.relu && !(value > 0)) value = 0;
+        store(output, row * width + column, layer.output_type, layer.output_type == DType::int8 ? value * (1 / layer.output_scale) : value);
+    }
+}
+
+__global__
+void linear_backward(size_t height, size_t width, size_t chunk_size, bool relu, float* output, float* gradients, float* pre_activation_gradients, float* partial_sums)
+{
+    const size_t column = blockIdx.x * blockDim.x + threadIdx.x;
+    if (column < width) {
+        const size_t begin = blockIdx.y * chunk_size;
+        const size_t end = begin + chunk_size < height ? begin + chunk_size : height;
+        float sum{ 0 };
+        for (size_t row = begin; row < end; ++row) {
+            const size_t index = row * width + column;
+            const float gradient = relu && output[index] <= 0 ? 0 : gradients[index];
+            pre_activation_gradients[index] = gradient;
+            sum += gradient;
+        }
+        partial_sums[blockIdx.y * width + column] = sum;
+    }
+}
+
+__global__
+void perceptron(size_t n, Perceptron perceptron, float* input, float* output)
+{
+    __shared__ float tiles[2][perceptron_tile * max_perceptron_width];
+    __shared__ float staged_weights[perceptron_weight_rows * max_perceptron_width];
+    const size_t first = blockIdx.x * perceptron_tile;
+    const size_t rows = first + perceptron_tile < n ? perceptron_tile : n - first;
+    const size_t last = perceptron.n_layers - 1;
+    const float* hidden = input + first * perceptron.input_strides[0];
+    size_t in_dim = perceptron.input_dim;
+    size_t row_stride = perceptron.input_strides[0];
+    size_t column_stride = perceptron.input_strides[1];
+    for (size_t layer = 0; layer <= last; ++layer) {
+        const size_t out_dim = layer == last ? perceptron.output_dim : perceptron.width;
+        const float* weights = perceptron.weights[layer];
+        float* tile = tiles[layer % 2];
+        for (size_t column_begin = 0; column_begin < out_dim; column_begin += max_perceptron_width) {
+            const size_t columns = column_begin + max_perceptron_width < out_dim ? max_perceptron_width : out_dim - column_begin;
+            float sums[perceptron_items];
+            #pragma unroll
+            for (size_t item = 0; item < perceptron_items; ++item) {
+                const size_t i = threadIdx.x + item * perceptron_threads;
+                sums[item] = i < rows * columns ? perceptron.biases[layer][column_begin + i % columns] : 0;
+            }
+            for (size_t k_begin = 0; k_begin < in_dim; k_begin += perceptron_weight_rows) {
+                const size_t k_rows = k_begin + perceptron_weight_rows < in_dim ? perceptron_weight_rows : in_dim - k_begin;
+                __syncthreads();
+                for (size_t i = threadIdx.x; i < k_rows * columns; i += blockDim.x) staged_weights[i] = weights[(k_begin + i / columns) * out_dim + column_begin + i % columns];
+                __syncthreads();
+                #pragma unroll
+                for (size_t item = 0; item < perceptron_items; ++item) {
+                    const size_t i = threadIdx.x + item * perceptron_threads;
+                    if (i >= rows * columns) continue;
+                    const float* hidden_row = hidden + (i / columns) * row_stride + k_begin * column_stride;
+                    const float* staged_column = staged_weights + i % columns;
+                    float sum = 0;
+                    for (size_t k = 0; k < k_rows; ++k) sum += hidden_row[k * column_stride] * staged_column[k * columns];
+                    sums[item] += sum;
+                }
+            }
+            #pragma unroll
+            for (size_t item = 0; item < perceptron_items; ++item) {
+                const size_t i = threadIdx.x + item * perceptron_threads;
+                if (i >= rows * columns) continue;
+                const size_t row = i / columns;
+                const size_t column = column_begin + i % columns;
+                if (layer == last) output[(first + row) * out_dim + column] = sums[item];
+                else {
+                    const float activation = sums[item] > 0 ? sums[item] : 0;
+                    tile[row * out_dim + column] = activation;
+                    if (perceptron.activations[layer]) perceptron.activations[layer][(first + row) * out_dim + column] = activation;
+                }
+            }
+        }
+        __syncthreads();
+        hidden = tile;
+        in_dim = out_dim;
+        row_stride = out_dim;
+        column_stride = 1;
+    }
+}
+
+__global__
+void perceptron_backward(size_t n, Perceptron perceptron, float* gradients)
+{
+    __shared__ float tiles[2][perceptron_tile * max_perceptron_width];
+    __shared__ float staged_weights[perceptron_weight_rows * max_perceptron_width];
+    const size_t first = blockIdx.x * perceptron_tile;
+    const size_t rows = first + perceptron_tile < n ? perceptron_tile : n - first;
+    const size_t width = perceptron.width;
+    const float* upstream = gradients + first * perceptron.output_dim;
+    size_t upstream_dim = perceptron.output_dim;
+    for (size_t layer = perceptron.n_layers - 1; layer-- > 0;) {
+        const float* weights = perceptron.weights[layer + 1];
+        float* tile = tiles[layer % 2];
+        float sums[perceptron_items];
+        #pragma unroll
+        for (size_t item = 0; item < perceptron_items; ++item) sums[item] = 0;
+        for (size_t j_begin = 0; j_begin < upstream_dim; j_begin += perceptron_weight_rows) {
+            const size_t j_rows = j_begin + perceptron_weight_rows < upstream_dim ? perceptron_weight_rows : upstream_dim - j_begin;
+            __syncthreads();
+            for (size_t i = threadIdx.x; i < j_rows * width; i += blockDim.x) staged_weights[i] = weights[(i % width) * upstream_dim + j_begin + i / width];
+            __syncthreads();
+            #pragma unroll
+            for (size_t item = 0; item < perceptron_items; ++item) {
+                const size_t i = threadIdx.x + item * perceptron_threads;
+                if (i >= rows * width) continue;
+                const float* upstream_row = upstream + (i / width) * upstream_dim + j_begin;
+                const float* staged_column = staged_weights + i % width;
+                float sum = 0;
+                for (size_t j = 0; j < j_rows; ++j) sum += upstream_row[j] * staged_column[j * width];
+                sums[item] += sum;
+            }
+        }
+        #pragma unroll
+        for (size_t item = 0; item < perceptron_items; ++item) {
+            const size_t i = threadIdx.x + item * perceptron_threads;
+            if (i >= rows * width) continue;
+            const size_t index = (first + i / width) * width + i % width;
+            const float gradient = perceptron.activations[layer][index] > 0 ? sums[item] : 0;
+            tile[i] = gradient;
+            perceptron.pre_activation_gradients[layer][index] = gradient;
+        }
+        __syncthreads();
+        upstream = tile;
+        upstream_dim = width;
+    }
+}
+
+__device__
+size_t grid_corners(const HashGrid& grid, size_t level, const float* position, size_t* indices, float* weights)
+{
+    const size_t resolution = grid.resolutions[level];
+    size_t cells[max_grid_dim];
+    float fractions[max_grid_dim];
+    size_t dense_size = 1;
+    for (size_t d = 0; d < grid.input_dim; ++d) {
+        const float clamped = position[d] < 0 ? 0 : position[d] > 1 ? 1 : position[d];
+        const float scaled = clamped * (resolution - 1);
+        const size_t cell = static_cast<size_t>(scaled);
+        cells[d] = cell < resolution - 2 ? cell : resolution - 2;
+        fractions[d] = scaled - cells[d];
+        dense_size *= resolution;
+    }
+    const size_t primes[max_grid_dim]{ 1, 2654435761u, 805459861u };
+    const size_t n_corners = static_cast<size_t>(1) << grid.input_dim;
+    for (size_t corner = 0; corner < n_corners; ++corner) {
+        size_t index = 0;
+        size_t stride = 1;
+        float weight = 1;
+        for (size_t d = 0; d < grid.input_dim; ++d) {
+            const size_t offset = corner >> d & 1;
+            weight *= offset ? fractions[d] : 1 - fractions[d];
+            if (dense_size <= grid.table_size) index += (cells[d] + offset) * stride;
+            else index ^= (cells[d] + offset) * primes[d];
+            stride *= resolution;
+        }
+        indices[corner] = level * grid.table_size + (dense_size <= grid.table_size ? index : index & (grid.table_size - 1));
+        weights[corner] = weight;
+    }
+    return n_corners;
+}
+
+__global__
+void hash_encode(size_t n, HashGrid grid, float* input, float* tables, float* output)
+{
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    const size_t level = blockIdx.y;
+    if (index < n) {
+        size_t indices[1 << max_grid_dim];
+        float weights[1 << max_grid_dim];
+        float position[max_grid_dim];
+        for (size_t d = 0; d < grid.input_dim; ++d) position[d] = input[index * grid.input_strides[0] + d * grid.input_strides[1]];
+        const size_t n_corners = grid_corners(grid, level, position, indices, weights);
+        float* features = output + (index * grid.n_levels + level) * grid.n_features;
+        for (size_t f = 0; f < grid.n_features; ++f) {
+            float feature = 0;
+            for (size_t corner = 0; corner < n_corners; ++corner) feature += weights[corner] * tables[indices[corner] * grid.n_features + f];
+            features[f] = feature;
+        }
+    }
+}
+
+__global__
+void hash_encode_backward(size_t n, HashGrid grid, float* input, float* gradients, float* table_gradients)
+{
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    const size_t level = blockIdx.y;
+    if (index < n) {
+        size_t indices[1 << max_grid_dim];
+        float weights[1 << max_grid_dim];
+        float position[max_grid_dim];
+        for (size_t d = 0; d < grid.input_dim; ++d) position[d] = input[index * grid.input_strides[0] + d * grid.input_strides[1]];
+        const size_t n_corners = grid_corners(grid, level, position, indices, weights);
+        const float* features = gradients + (index * grid.n_levels + level) * grid.n_features;
+        for (size_t corner = 0; corner < n_corners; ++corner) {
+            for (size_t f = 0; f < grid.n_features; ++f) atomicAdd(table_gradients + indices[corner] * grid.n_features + f, weights[corner] * features[f]);
+        }
+    }
+}
+
+__global__
+void positional_encode(size_t n, FourierFeatures features, float* input, float* output)
+{
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n * features.input_dim * features.n_frequencies) {
+        const size_t frequency = index % features.n_frequencies;
+        const size_t d = index / features.n_frequencies % features.input_dim;
+        const size_t i = index / (features.n_frequencies * features.input_dim);
+        const float x = input[i * features.input_strides[0] + d * features.input_strides[1]];
+        float sine;
+        float cosine;
+        sincospif(ldexpf(x, frequency), &sine, &cosine);
+        output[2 * index] = sine;
+        output[2 * index + 1] = cosine;
+    }
+}
+
+__global__
+void positional_encode_backward(size_t n, FourierFeatures features, float* output, float* gradients, float* input_gradients)
+{
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n * features.input_dim) {
+        const size_t offset = 2 * index * features.n_frequencies;
+        float gradient = 0;
+        for (size_t frequency = 0; frequency < features.n_frequencies; ++frequency) {
+            const size_t j = offset + 2 * frequency;
+            gradient += ldexpf(gradients[j] * output[j + 1] - gradients[j + 1] * output[j], frequency);
+        }
+        input_gradients[index] = 3.14159265358979f * gradient;
+    }
+}
+
+__global__
+void grid_coordinates(size_t n, PixelGrid grid, float* indices, float* output)
+{
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < n) {
+        const size_t pixel = indices ? static_cast<size_t>(indices[index]) : grid.first + index;
+        output[2 * index] = (pixel / grid.width) * grid.scales[0];
+        output[2 * index + 1] = (pixel % grid.width) * grid.scales[1];
+    }
+}
+
+__global__
+void adam(AdamUpdate update, float* step, float* finite)
+{
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < update.offsets[update.n_tensors] && (!finite || *finite)) {
+        size_t low = 0;
+        size_t high = update.n_tensors;
+        while (high - low > 1) {
+            const size_t middle = (low + high) / 2;
+            if (update.offsets[middle] <= index) low = middle;
+            else high = middle;
+        }
+        const size_t i = index - update.offsets[low];
+        const float t = *step;
+        const float step_size = update.learning_rate / (1 - powf(update.beta1, t));
+        const float correction = rsqrtf(1 - powf(update.beta2, t));
+        float* parameters = update.parameters[low];
+        float* first_moments = update.first_moments[low];
+        float* second_moments = update.second_moments[low];
+        const float parameter = parameters[i];
+        const float gradient = update.gradients[low][i] + (update.decoupled ? 0 : update.weight_decay * parameter);
+        const float first_moment = update.beta1 * first_moments[i] + (1 - update.beta1) * gradient;
+        const float second_moment = update.beta2 * second_moments[i] + (1 - update.beta2) * gradient * gradient;
+        first_moments[i] = first_moment;
+        second_moments[i] = second_moment;
+        const float decay = update.decoupled ? 1 - update.learning_rate * update.weight_decay : 1;
+        parameters[i] = decay * parameter - step_size * first_moment / (sqrtf(second_moment) * correction + update.epsilon);
+    }
+}
+
+__global__
+void unscale_gradients(GradientScaling scaling, float* scale, float* finite)
+{
+    const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < scaling.offsets[scaling.n_tensors]) {
+        size_t low = 0;
+        size_t high = scaling.n_tensors;
+        while (high - low > 1) {
+            const size_t middle = (low + high) / 2;
+            if (scaling.offsets[middle] <= index) low = middle;
+            else high = middle;
+        }
+        float* gradient = scaling.gradients[low] + index - scaling.offsets[low];
+        if (fabsf(*gradient) <= scaling.max_gradient) *gradient /= *scale;
+        else {
+            *gradient = 0;
+            *finite = 0;
+        }
+    }
+}
+
+__global__
+void update_scale(GradientScaling scaling, float* scale, float* finite, float* growth_tracker)
+{
+    if (!*finite) {
+        *scale *= scaling.backoff_factor;
+        *growth_tracker = 0;
+    }
+    else if (++*growth_tracker >= scaling.growth_interval) {
+        if (isfinite(*scale * scaling.growth_factor)) *scale *= scaling.growth_factor;
+        *growth_tracker = 0;
+    }
+}
+
 __global__
 void negate(size_t n, float* input, float* output)
 {
@@ -102,26 +485,68 @@ void square(size_t n, float* input, float* output)
   if (index < n) output[index] = input[index] * input[index];
 }
 
+__device__
+size_t reduction_offset(size_t index, size_t rank, const size_t* shape, const size_t* strides)
+{
+    size_t offset = 0;
+    for (int i = rank - 1; i >= 0; --i) {
+        offset += index % shape[i] * strides[i];
+        index /= shape[i];
+    }
+    return offset;
+}
+
+__device__
+float warp_sum(float value)
+{
+    for (int offset = warpSize / 2; offset > 0; offset /= 2) value += __shfl_down_sync(0xffffffff, value, offset);
+    return value;
+}
+
+__device__
+float block_sum(float value)
+{
+    __shared__ float warp_sums[32];
+    const int lane = threadIdx.x % warpSize;
+    const int warp = threadIdx.x / warpSize;
+    value = warp_sum(value);
+    __syncthreads();
+    if (lane == 0) warp_sums[warp] = value;
+    __syncthreads();
+    value = threadIdx.x < blockDim.x / warpSize ? warp_sums[lane] : 0;
+    if (warp == 0) value = warp_sum(value);
+    return value;
+}
+
 __global__
-void sum(size_t n, float* input, float* output)
+void reduce_rows(Reduction reduction, size_t chunk_size, float* input, float* output)
 {
-  float sum{ 0 };
-  for (int i = 0; i < n; ++i) {
-      sum += input[i];
+  const size_t begin = blockIdx.x * chunk_size;
+  const size_t end = begin + chunk_size < reduction.n_reduced ? begin + chunk_size : reduction.n_reduced;
+  for (size_t index = blockIdx.y; index < reduction.n_outputs; index += gridDim.y) {
+      const size_t row = reduction_offset(index, reduction.kept_rank, reduction.kept_shape, reduction.kept_strides);
+      float sum{ 0 };
+      for (size_t i = begin + threadIdx.x; i < end; i += blockDim.x) {
+          sum += load(input, row + reduction_offset(i, reduction.reduced_rank, reduction.reduced_shape, reduction.reduced_strides), reduction.input_type);
+      }
+      sum = block_sum(sum);
+      if (threadIdx.x == 0) output[index * gridDim.x + blockIdx.x] = sum;
   }
-  output[0] = sum;
 }
 
 __global__
-void batch_sum(size_t n, size_t batch_size, size_t stride, float* input, float* output)
+void reduce_columns(Reduction reduction, size_t chunk_size, float* input, float* output)
 {
   const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
-  if (index < n) {
+  if (index < reduction.n_outputs) {
+      const size_t column = reduction_offset(index, reduction.kept_rank, reduction.kept_shape, reduction.kept_strides);
+      const size_t begin = blockIdx.y * chunk_size;
+      const size_t end = begin + chunk_size < reduction.n_reduced ? begin + chunk_size : reduction.n_reduced;
       float sum{ 0 };
-      for (int i = 0; i < batch_size; ++i) {
-          sum += input[i * stride + index];
+      for (size_t i = begin; i < end; ++i) {
+          sum += load(input, column + reduction_offset(i, reduction.reduced_rank, reduction.reduced_shape, reduction.reduced_strides), reduction.input_type);
       }
-      output[index] = sum;
+      output[blockIdx.y * reduction.n_outputs + index] = sum;
   }
 }
 
@@ -138,3 +563,38 @@ void relu_d(size_t n, float* input, float* output)
   const int i = blockIdx.x * blockDim.x + threadIdx.x;
   if (i < n) output[i] = input[i] > 0 ? 1 : 0;
 }
+
+__global__
+void evaluate(size_t n, Program program, float* output)
+{
+  const size_t index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index < n) {
+      size_t offsets[max_inputs];
+      for (int j = 0; j < program.n_inputs; ++j) offsets[j] = program.contiguous[j] ? index : 0;
+      size_t index_remainder = index;
+      for (int i = 0; i < program.rank; ++i) {
+          const size_t dim = index_remainder / program.strides[i];
+          index_remainder -= dim * program.strides[i];
+          for (int j = 0; j < program.n_inputs; ++j) {
+              if (!program.contiguous[j]) offsets[j] += dim * program.input_strides[j][i];
+          }
+      }
+      float stack[max_stack_size];
+      int top = 0;
+      for (int i = 0; i < program.n_instructions; ++i) {
+          switch (program.operations[i]) {
+              case ExpressionOperation::load: stack[top++] = program.inputs[program.operands[i]][offsets[program.operands[i]]]; break;
+              case ExpressionOperation::constant: stack[top++] = program.constants[i]; break;
+              case ExpressionOperation::add: --top; stack[top - 1] += stack[top]; break;
+              case ExpressionOperation::subtract: --top; stack[top - 1] -= stack[top]; break;
+              case ExpressionOperation::multiply: --top; stack[top - 1] *= stack[top]; break;
+              case ExpressionOperation::divide: --top; stack[top - 1] /= stack[top]; break;
+              case ExpressionOperation::negate: stack[top - 1] = -stack[top - 1]; break;
+              case ExpressionOperation::square: stack[top - 1] *= stack[top - 1]; break;
+              case ExpressionOperation::relu: stack[top - 1] = stack[top - 1] > 0 ? stack[top - 1] : 0; break;
+              case ExpressionOperation::relu_d: stack[top - 1] = stack[top - 1] > 0 ? 1 : 0; break;
+          }
+      }
+      output[index] = stack[0];
+  }
+}
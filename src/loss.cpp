@@ -1,8 +1,9 @@
 #include <vector>
 #include "loss.h"
 #include "tensor.h"
+#include "expression.h"
 
 Tensor mean_squared_error(const Tensor& prediction, const Tensor& target) {
-    const Tensor scalar{ Tensor::from_scalar(1. / prediction.n_elements, std::vector<int>(prediction.rank, 1)) };
-    return scalar * sum(square(prediction - target));
+    const Tensor squared_error{ square(Expression{ prediction } - target).evaluate() };
+    return (1.f / prediction.n_elements * Expression{ sum(squared_error) }).evaluate();
 }
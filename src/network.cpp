@@ -1,7 +1,10 @@
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <stdexcept>
 #include "network.h"
 #include "tensor.h"
+#include "autodiff.h"
 
 std::vector<Tensor*> Module::parameters() {
     return {};
@@ -13,6 +16,41 @@ void Module::detach() {
     }
 }
 
+void Module::flatten_parameters() {
+    const std::vector<Tensor*> tensors{ parameters() };
+    if (!tensors.size()) return;
+    const Device device{ tensors[0]->device };
+    std::vector<size_t> offsets{};
+    size_t n_elements{ 0 };
+    bool requires_gradients{ false };
+    for (Tensor* parameter : tensors) {
+        if (parameter->device != device) throw std::invalid_argument("parameters are on different devices");
+        if (parameter->backward_pointer && !dynamic_cast<AccumulateGradients*>(parameter->backward_pointer.get())) throw std::invalid_argument("parameters must be leaf tensors");
+        offsets.push_back(n_elements);
+        n_elements += (parameter->n_elements + flat_alignment - 1) / flat_alignment * flat_alignment;
+        requires_gradients = requires_gradients || parameter->backward_pointer;
+    }
+    flat_parameters = Tensor::from_scalar(0, {static_cast<int>(n_elements)}, device);
+    flat_gradients = requires_gradients ? Tensor::from_scalar(0, {static_cast<int>(n_elements)}, device) : Tensor{};
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        Tensor& parameter{ *tensors[i] };
+        Tensor view{ flat_parameters.view(offsets[i], parameter.shape) };
+        view += parameter;
+        view.backward_pointer = parameter.backward_pointer;
+        if (parameter.backward_pointer) {
+            Tensor gradients{ flat_gradients.view(offsets[i], parameter.shape) };
+            std::vector<Tensor>& accumulated_gradients{ parameter.backward_pointer->tensors };
+            if (accumulated_gradients.size()) gradients += accumulated_gradients[0];
+            accumulated_gradients = { gradients };
+        }
+        parameter = view;
+    }
+    if (requires_gradients) {
+        flat_parameters.backward_pointer = std::shared_ptr<Backward>{ new AccumulateGradients{} };
+        flat_parameters.backward_pointer->tensors.push_back(flat_gradients);
+    }
+}
+
 Linear::Linear(size_t input_dim, size_t output_dim, bool requires_gradients) :
     weights{ Tensor::random_normal(0, std::sqrt(2. / input_dim), {static_cast<int>(input_dim), static_cast<int>(output_dim)}) },
     bias{ Tensor::from_scalar(0, {1, static_cast<int>(output_dim)}) } 
@@ -24,18 +62,87 @@ Linear::Linear(size_t input_dim, size_t output_dim, bool requires_gradients) :
 }
 
 Tensor Linear::operator() (const Tensor& input) const {
-    return mm(input, weights) + bias;
+    if (quantized) return quantized_linear(input, quantized_weights, weight_scales, bias, input_scale, false);
+    return linear(input, weights, bias, false);
 }
 
 std::vector<Tensor*> Linear::parameters() {
     return {&weights, &bias};
 }
 
+void Linear::quantize(const Tensor& calibration_input) {
+    if (calibration_input.rank != 2 || calibration_input.shape[1] != weights.shape[0]) throw std::invalid_argument("calibration input does not match the weights");
+    const Tensor float_weights{ weights.detach().to(DType::float32) };
+    const std::vector<float> values{ float_weights.to_host() };
+    const size_t output_dim = weights.shape[1];
+    std::vector<float> scales(output_dim, 0);
+    for (size_t i = 0; i < values.size(); ++i) scales[i % output_dim] = std::max(scales[i % output_dim], std::abs(values[i]));
+    for (float& scale : scales) scale = scale > 0 ? scale / 127 : 1;
+    weight_scales = Tensor::from_vector(scales, {1, static_cast<int>(output_dim)}, weights.device);
+    quantized_weights = (float_weights / weight_scales).to(DType::int8);
+    float max_input{ 0 };
+    for (float value : calibration_input.to_host()) max_input = std::max(max_input, std::abs(value));
+    input_scale = max_input > 0 ? max_input / 127 : 1;
+    quantized = true;
+}
+
 Tensor ReLU::operator() (const Tensor& input) const {
     return relu(input);
 }
 
-MultiLayerPerceptron::MultiLayerPerceptron(size_t input_layer_dim, std::initializer_list<size_t> layer_dims, bool requires_gradients) {
+static HashGrid create_grid(size_t input_dim, size_t n_levels, size_t n_features, size_t log2_table_size, size_t base_resolution, size_t max_resolution) {
+    if (input_dim < 1 || input_dim > max_grid_dim) throw std::invalid_argument("hash encoding supports 1 to 3 input dims");
+    if (n_levels < 1 || n_levels > max_levels) throw std::invalid_argument("number of levels exceeds max_levels");
+    if (base_resolution < 2 || max_resolution < base_resolution) throw std::invalid_argument("invalid grid resolutions");
+    HashGrid grid{};
+    grid.input_dim = input_dim;
+    grid.n_levels = n_levels;
+    grid.n_features = n_features;
+    grid.table_size = static_cast<size_t>(1) << log2_table_size;
+    const double growth{ n_levels > 1 ? std::exp((std::log(max_resolution) - std::log(base_resolution)) / (n_levels - 1)) : 1. };
+    for (size_t level = 0; level < n_levels; ++level) grid.resolutions[level] = static_cast<size_t>(base_resolution * std::pow(growth, level) + 1e-6);
+    return grid;
+}
+
+HashEncoding::HashEncoding(size_t input_dim, size_t n_levels, size_t n_features, size_t log2_table_size, size_t base_resolution, size_t max_resolution, bool requires_gradients) :
+    tables{ Tensor::random_uniform(-1e-4, 1e-4, {static_cast<int>(n_levels << log2_table_size), static_cast<int>(n_features)}) },
+    grid{ create_grid(input_dim, n_levels, n_features, log2_table_size, base_resolution, max_resolution) }
+{
+    if (requires_gradients) tables.requires_gradients();
+}
+
+size_t HashEncoding::output_dim() const {
+    return grid.n_levels * grid.n_features;
+}
+
+Tensor HashEncoding::operator() (const Tensor& input) const {
+    return hash_encode(input, tables, grid);
+}
+
+std::vector<Tensor*> HashEncoding::parameters() {
+    return {&tables};
+}
+
+PositionalEncoding::PositionalEncoding(size_t input_dim, size_t n_frequencies, bool cache) : input_dim{ input_dim }, n_frequencies{ n_frequencies }, cache{ cache } {}
+
+size_t PositionalEncoding::output_dim() const {
+    return 2 * input_dim * n_frequencies;
+}
+
+Tensor PositionalEncoding::operator() (const Tensor& input) const {
+    if (input.rank != 2 || static_cast<size_t>(input.shape[1]) != input_dim) throw std::invalid_argument("input does not match the encoding dimension");
+    const bool constant{ cache && !input.backward_pointer };
+    if (constant && cached_input.data == input.data && cached_input.shape == input.shape && cached_input.strides == input.strides && input.version && *input.version == cached_version) return cached_output;
+    const Tensor output{ positional_encode(input, n_frequencies) };
+    if (constant) {
+        cached_input = input;
+        cached_output = output;
+        cached_version = input.version ? *input.version : 0;
+    }
+    return output;
+}
+
+MultiLayerPerceptron::MultiLayerPerceptron(size_t input_layer_dim, std::initializer_list<size_t> layer_dims, bool requires_gradients, bool fused) : fused{ fused } {
     size_t input_dim{ input_layer_dim };
     for (size_t output_dim : layer_dims) {
         const Linear linear_layer{ input_dim, output_dim, requires_gradients };
@@ -45,12 +152,23 @@ MultiLayerPerceptron::MultiLayerPerceptron(size_t input_layer_dim, std::initiali
 }
 
 Tensor MultiLayerPerceptron::operator() (const Tensor& input) const {
+    const bool quantized{ std::any_of(linear_layers.begin(), linear_layers.end(), [](const Linear& linear_layer) { return linear_layer.quantized; }) };
+    if (fused && !quantized) {
+        std::vector<Tensor> weights{};
+        std::vector<Tensor> biases{};
+        for (const Linear& linear_layer : linear_layers) {
+            weights.push_back(linear_layer.weights);
+            biases.push_back(linear_layer.bias);
+        }
+        return perceptron(input, weights, biases);
+    }
     Tensor output{ input };
-    for (int i = 0; i < linear_layers.size() - 1; ++i) {
-        output = linear_layers[i](output);
-        output = relu_layer(output);
+    for (size_t i = 0; i < linear_layers.size(); ++i) {
+        const Linear& linear_layer{ linear_layers[i] };
+        const bool hidden{ i + 1 < linear_layers.size() };
+        if (!linear_layer.quantized) output = linear(output, linear_layer.weights, linear_layer.bias, hidden);
+        else output = quantized_linear(output, linear_layer.quantized_weights, linear_layer.weight_scales, linear_layer.bias, linear_layer.input_scale, hidden, hidden && linear_layers[i + 1].quantized ? linear_layers[i + 1].input_scale : 0);
     }
-    output = linear_layers.back()(output);
     return output;
 }
 
@@ -62,3 +180,11 @@ std::vector<Tensor*> MultiLayerPerceptron::parameters() {
     }
     return parameters;
 }
+
+void MultiLayerPerceptron::quantize(const Tensor& calibration_input) {
+    Tensor activations{ calibration_input.detach() };
+    for (size_t i = 0; i < linear_layers.size(); ++i) {
+        linear_layers[i].quantize(activations);
+        if (i + 1 < linear_layers.size()) activations = linear(activations, linear_layers[i].weights.detach(), linear_layers[i].bias.detach(), true);
+    }
+}
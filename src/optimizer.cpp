@@ -1,10 +1,17 @@
+#include <cmath>
 #include <vector>
+#include <stdexcept>
 #include "optimizer.h"
 #include "tensor.h"
 
 Optimizer::Optimizer(const std::vector<Tensor*>& parameters, float learning_rate) : 
     parameters{ parameters },
-    learning_rate{ Tensor::from_scalar(learning_rate, std::vector<int>(parameters[0]->rank, 1)) } {}
+    learning_rate{ Tensor::from_scalar(learning_rate, std::vector<int>(parameters[0]->rank, 1), parameters[0]->device) }
+{
+    for (Tensor* parameter : parameters) {
+        if (parameter->dtype != DType::float32) throw std::invalid_argument("parameters must be float32 tensors");
+    }
+}
 
 void Optimizer::zero_gradients() const {
     for (Tensor* parameter : parameters) {
@@ -12,10 +19,116 @@ void Optimizer::zero_gradients() const {
     }
 }
 
+void Optimizer::mixed_precision(DType dtype, float initial_scale, float growth_factor, float backoff_factor, size_t growth_interval) {
+    if (dtype != DType::float16 && dtype != DType::bfloat16) throw std::invalid_argument("mixed precision requires a 16-bit dtype");
+    if (master_parameters.size()) throw std::logic_error("mixed precision is already enabled");
+    if (!std::isfinite(initial_scale) || initial_scale <= 0 || growth_factor < 1 || backoff_factor <= 0 || backoff_factor >= 1) throw std::invalid_argument("invalid loss scaling factors");
+    for (Tensor* parameter : parameters) {
+        if (!parameter->backward_pointer) throw std::invalid_argument("parameters must require gradients");
+    }
+    for (Tensor* parameter : parameters) {
+        master_parameters.push_back(parameter->detach().to(DType::float32));
+        Tensor converted{ parameter->detach().to(dtype) };
+        converted.backward_pointer = parameter->backward_pointer;
+        *parameter = converted;
+    }
+    const Device device{ parameters[0]->device };
+    scaling.max_gradient = dtype == DType::float16 ? 65504.f : 3.38953139e38f;
+    scaling.growth_factor = growth_factor;
+    scaling.backoff_factor = backoff_factor;
+    scaling.growth_interval = growth_interval;
+    scale = Tensor::from_scalar(initial_scale, {1}, device);
+    finite_gradients = Tensor::from_scalar(1, {1}, device);
+    growth_tracker = Tensor::from_scalar(0, {1}, device);
+}
+
+Tensor Optimizer::scale_loss(const Tensor& loss) const {
+    if (!master_parameters.size()) return loss;
+    return loss * scale.view(0, std::vector<int>(loss.rank, 1));
+}
+
+const Tensor& Optimizer::loss_scale() const {
+    return scale;
+}
+
+Tensor& Optimizer::master(size_t index) {
+    return master_parameters.size() ? master_parameters[index] : *parameters[index];
+}
+
+void Optimizer::unscale_gradients() {
+    if (!master_parameters.size()) return;
+    finite_gradients.fill(1);
+    GradientScaling chunk{ scaling };
+    chunk.n_tensors = 0;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+        const Tensor& gradients{ parameters[i]->gradients() };
+        const size_t tensor{ chunk.n_tensors++ };
+        chunk.gradients[tensor] = gradients.data.get();
+        chunk.offsets[tensor + 1] = chunk.offsets[tensor] + gradients.n_elements;
+        if (chunk.n_tensors == max_tensors || i + 1 == parameters.size()) {
+            backend(scale.device).unscale_gradients(chunk, scale.data.get(), finite_gradients.data.get());
+            chunk.n_tensors = 0;
+        }
+    }
+}
+
+void Optimizer::update_parameters() {
+    if (!master_parameters.size()) return;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+        backend(scale.device).convert(master_parameters[i].n_elements, DType::float32, parameters[i]->dtype, master_parameters[i].data.get(), parameters[i]->data.get());
+    }
+    backend(scale.device).update_scale(scaling, scale.data.get(), finite_gradients.data.get(), growth_tracker.data.get());
+}
+
 StochasticGradientDescent::StochasticGradientDescent(const std::vector<Tensor*>& parameters, float learning_rate) : Optimizer{ parameters, learning_rate } {}
 
 void StochasticGradientDescent::step() {
+    unscale_gradients();
+    const Tensor step_size{ master_parameters.size() ? learning_rate * finite_gradients.view(0, learning_rate.shape) : learning_rate };
+    for (size_t i = 0; i < parameters.size(); ++i) {
+        master(i) -= step_size * parameters[i]->gradients();
+    }
+    update_parameters();
+}
+
+Adam::Adam(const std::vector<Tensor*>& parameters, float learning_rate, float beta1, float beta2, float epsilon, float weight_decay) : Adam{ parameters, learning_rate, beta1, beta2, epsilon, weight_decay, false } {}
+
+Adam::Adam(const std::vector<Tensor*>& parameters, float learning_rate, float beta1, float beta2, float epsilon, float weight_decay, bool decoupled) :
+    Optimizer{ parameters, learning_rate },
+    step_count{ Tensor::from_scalar(0, {1}, parameters[0]->device) },
+    one{ Tensor::from_scalar(1, {1}, parameters[0]->device) }
+{
     for (Tensor* parameter : parameters) {
-        *parameter -= learning_rate * (*parameter).gradients();
+        if (parameter->device != parameters[0]->device) throw std::invalid_argument("parameters are on different devices");
+        first_moments.push_back(Tensor::from_scalar(0, parameter->shape, parameter->device));
+        second_moments.push_back(Tensor::from_scalar(0, parameter->shape, parameter->device));
     }
+    update.learning_rate = learning_rate;
+    update.beta1 = beta1;
+    update.beta2 = beta2;
+    update.epsilon = epsilon;
+    update.weight_decay = weight_decay;
+    update.decoupled = decoupled;
 }
+
+void Adam::step() {
+    unscale_gradients();
+    step_count += master_parameters.size() ? finite_gradients : one;
+    AdamUpdate chunk{ update };
+    chunk.n_tensors = 0;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+        const size_t tensor{ chunk.n_tensors++ };
+        chunk.parameters[tensor] = master(i).data.get();
+        chunk.gradients[tensor] = parameters[i]->gradients().data.get();
+        chunk.first_moments[tensor] = first_moments[i].data.get();
+        chunk.second_moments[tensor] = second_moments[i].data.get();
+        chunk.offsets[tensor + 1] = chunk.offsets[tensor] + parameters[i]->n_elements;
+        if (chunk.n_tensors == max_tensors || i + 1 == parameters.size()) {
+            backend(step_count.device).adam(chunk, step_count.data.get(), master_parameters.size() ? finite_gradients.data.get() : nullptr);
+            chunk.n_tensors = 0;
+        }
+    }
+    update_parameters();
+}
+
+AdamW::AdamW(const std::vector<Tensor*>& parameters, float learning_rate, float beta1, float beta2, float epsilon, float weight_decay) : Adam{ parameters, learning_rate, beta1, beta2, epsilon, weight_decay, true } {}
@@ -0,0 +1,103 @@
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include "parallel.h"
+
+thread_local bool inside_thread_pool{ false };
+
+class ThreadPool {
+public:
+    const size_t n_workers{};
+
+    ThreadPool() : n_workers{ std::max(std::thread::hardware_concurrency(), 1u) - 1 } {
+        for (size_t i = 0; i < n_workers; ++i) {
+            workers.emplace_back([this]{ work(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+            stop = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    void run(size_t n_chunks, const std::function<void(size_t)>& chunk) {
+        std::lock_guard<std::mutex> run_lock{ run_mutex };
+        std::unique_lock<std::mutex> lock{ mutex };
+        finished.wait(lock, [this]{ return active == 0; });
+        job = &chunk;
+        total_chunks = n_chunks;
+        next_chunk = 0;
+        ++generation;
+        ++active;
+        lock.unlock();
+        wake.notify_all();
+        execute();
+        lock.lock();
+        --active;
+        finished.wait(lock, [this]{ return active == 0; });
+        job = nullptr;
+    }
+
+private:
+    std::vector<std::thread> workers{};
+    std::mutex run_mutex{};
+    std::mutex mutex{};
+    std::condition_variable wake{};
+    std::condition_variable finished{};
+    const std::function<void(size_t)>* job{};
+    size_t total_chunks{};
+    std::atomic<size_t> next_chunk{};
+    size_t generation{};
+    size_t active{};
+    bool stop{};
+
+    void execute() {
+        inside_thread_pool = true;
+        for (size_t i = next_chunk++; i < total_chunks; i = next_chunk++) (*job)(i);
+        inside_thread_pool = false;
+    }
+
+    void work() {
+        size_t generation_seen{ 0 };
+        std::unique_lock<std::mutex> lock{ mutex };
+        while (true) {
+            wake.wait(lock, [&]{ return stop || generation != generation_seen; });
+            if (stop) return;
+            generation_seen = generation;
+            if (!job) continue;
+            ++active;
+            lock.unlock();
+            execute();
+            lock.lock();
+            if (--active == 0) finished.notify_all();
+        }
+    }
+};
+
+ThreadPool& thread_pool() {
+    static ThreadPool pool{};
+    return pool;
+}
+
+size_t n_threads() {
+    return thread_pool().n_workers + 1;
+}
+
+void parallel_for(size_t n, size_t grain_size, const std::function<void(size_t begin, size_t end)>& body) {
+    if (n == 0) return;
+    const size_t grain{ std::max(grain_size, static_cast<size_t>(1)) };
+    const size_t n_chunks{ std::min((n + grain - 1) / grain, 4 * n_threads()) };
+    if (n_chunks <= 1 || inside_thread_pool || n_threads() == 1) {
+        body(0, n);
+        return;
+    }
+    const std::function<void(size_t)> chunk{ [&](size_t i){ body(i * n / n_chunks, (i + 1) * n / n_chunks); } };
+    thread_pool().run(n_chunks, chunk);
+}
@@ -0,0 +1,255 @@
+#include <vector>
+#include <algorithm>
+#include "perceptron.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PERCEPTRON_X86
+#endif
+
+#ifdef __GNUC__
+#define PERCEPTRON_INLINE __attribute__((always_inline)) inline
+#else
+#define PERCEPTRON_INLINE inline
+#endif
+
+const size_t tile_rows{ 32 };
+const size_t grain_rows{ 256 };
+
+template <size_t Lanes>
+struct Vector {
+    typedef float type __attribute__((vector_size(Lanes * sizeof(float)), aligned(sizeof(float)), may_alias));
+};
+
+constexpr size_t block_rows(size_t n_registers) {
+    return n_registers >= 8 ? 8 : n_registers >= 4 ? 4 : n_registers >= 2 ? 2 : 1;
+}
+
+template <size_t Lanes, size_t Width, size_t Columns, size_t Rows>
+PERCEPTRON_INLINE void dense_rows(size_t in_dim, const float* input, size_t row_stride, size_t column_stride, const float* weights, const float* bias, const float* mask, float* output) {
+    typedef typename Vector<Lanes>::type Lane;
+    const size_t n_vectors{ Columns / Lanes };
+    Lane accumulators[Rows][n_vectors];
+    for (size_t i = 0; i < Rows; ++i) {
+        for (size_t v = 0; v < n_vectors; ++v) accumulators[i][v] = bias ? *reinterpret_cast<const Lane*>(bias + v * Lanes) : Lane{};
+    }
+    for (size_t k = 0; k < in_dim; ++k) {
+        const Lane* w{ reinterpret_cast<const Lane*>(weights + k * Width) };
+        for (size_t i = 0; i < Rows; ++i) {
+            const float x{ input[i * row_stride + k * column_stride] };
+            for (size_t v = 0; v < n_vectors; ++v) accumulators[i][v] += x * w[v];
+        }
+    }
+    for (size_t i = 0; i < Rows; ++i) {
+        Lane* o{ reinterpret_cast<Lane*>(output + i * Width) };
+        if (mask) {
+            const Lane* m{ reinterpret_cast<const Lane*>(mask + i * Width) };
+            for (size_t v = 0; v < n_vectors; ++v) o[v] = m[v] > 0 ? accumulators[i][v] : Lane{};
+        }
+        else {
+            for (size_t v = 0; v < n_vectors; ++v) o[v] = accumulators[i][v] > 0 ? accumulators[i][v] : Lane{};
+        }
+    }
+}
+
+template <size_t Lanes, size_t Width>
+PERCEPTRON_INLINE void dense(size_t rows, size_t in_dim, const float* input, size_t row_stride, size_t column_stride, const float* weights, const float* bias, const float* mask, float* output) {
+    const size_t n_columns{ Width < 64 ? Width : 64 };
+    const size_t n_rows{ block_rows((Lanes >= 16 ? 24 : 12) / (n_columns / Lanes)) };
+    for (size_t column = 0; column < Width; column += n_columns) {
+        const float* panel_bias{ bias ? bias + column : nullptr };
+        size_t row{ 0 };
+        for (; row + n_rows <= rows; row += n_rows) {
+            dense_rows<Lanes, Width, n_columns, n_rows>(in_dim, input + row * row_stride, row_stride, column_stride, weights + column, panel_bias, mask ? mask + row * Width + column : nullptr, output + row * Width + column);
+        }
+        for (; row < rows; ++row) {
+            dense_rows<Lanes, Width, n_columns, 1>(in_dim, input + row * row_stride, row_stride, column_stride, weights + column, panel_bias, mask ? mask + row * Width + column : nullptr, output + row * Width + column);
+        }
+    }
+}
+
+template <size_t Lanes, size_t Width>
+PERCEPTRON_INLINE void output_rows(size_t rows, size_t output_dim, const float* hidden, const float* transposed_weights, const float* bias, float* output) {
+    typedef typename Vector<Lanes>::type Lane;
+    for (size_t row = 0; row < rows; ++row) {
+        const Lane* h{ reinterpret_cast<const Lane*>(hidden + row * Width) };
+        for (size_t j = 0; j < output_dim; ++j) {
+            const Lane* w{ reinterpret_cast<const Lane*>(transposed_weights + j * Width) };
+            Lane sums{};
+            for (size_t v = 0; v < Width / Lanes; ++v) sums += h[v] * w[v];
+            float sum{ bias[j] };
+            for (size_t l = 0; l < Lanes; ++l) sum += sums[l];
+            output[row * output_dim + j] = sum;
+        }
+    }
+}
+
+template <size_t Lanes, size_t Width>
+PERCEPTRON_INLINE void width_sums(size_t rows, const float* input, float* sums) {
+    typedef typename Vector<Lanes>::type Lane;
+    Lane* s{ reinterpret_cast<Lane*>(sums) };
+    for (size_t row = 0; row < rows; ++row) {
+        const Lane* x{ reinterpret_cast<const Lane*>(input + row * Width) };
+        for (size_t v = 0; v < Width / Lanes; ++v) s[v] += x[v];
+    }
+}
+
+PERCEPTRON_INLINE void column_sums(size_t rows, size_t columns, const float* input, float* sums) {
+    for (size_t row = 0; row < rows; ++row) {
+        for (size_t column = 0; column < columns; ++column) sums[column] += input[row * columns + column];
+    }
+}
+
+template <size_t Lanes, size_t Width>
+PERCEPTRON_INLINE void forward_tiles(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* input, const float* output_weights, float* output) {
+    float buffers[2][tile_rows * Width];
+    const size_t last{ perceptron.n_layers - 1 };
+    for (size_t tile = begin; tile < end; ++tile) {
+        const size_t first{ tile * tile_rows };
+        const size_t rows{ std::min(tile_rows, n - first) };
+        float* hidden{ nullptr };
+        for (size_t layer = 0; layer < last; ++layer) {
+            float* activations{ perceptron.activations[layer] ? perceptron.activations[layer] + first * Width : buffers[layer % 2] };
+            if (layer == 0) dense<Lanes, Width>(rows, perceptron.input_dim, input + first * perceptron.input_strides[0], perceptron.input_strides[0], perceptron.input_strides[1], perceptron.weights[0], perceptron.biases[0], nullptr, activations);
+            else dense<Lanes, Width>(rows, Width, hidden, Width, 1, perceptron.weights[layer], perceptron.biases[layer], nullptr, activations);
+            hidden = activations;
+        }
+        output_rows<Lanes, Width>(rows, perceptron.output_dim, hidden, output_weights, perceptron.biases[last], output + first * perceptron.output_dim);
+    }
+}
+
+template <size_t Lanes, size_t Width>
+PERCEPTRON_INLINE void backward_tiles(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* gradients, const float* const* transposed_weights, float* bias_sums) {
+    const size_t last{ perceptron.n_layers - 1 };
+    for (size_t tile = begin; tile < end; ++tile) {
+        const size_t first{ tile * tile_rows };
+        const size_t rows{ std::min(tile_rows, n - first) };
+        const float* upstream{ gradients + first * perceptron.output_dim };
+        size_t upstream_dim{ perceptron.output_dim };
+        column_sums(rows, upstream_dim, upstream, bias_sums + last * Width);
+        for (size_t layer = last; layer-- > 0;) {
+            float* layer_gradients{ perceptron.pre_activation_gradients[layer] + first * Width };
+            dense<Lanes, Width>(rows, upstream_dim, upstream, upstream_dim, 1, transposed_weights[layer + 1], nullptr, perceptron.activations[layer] + first * Width, layer_gradients);
+            width_sums<Lanes, Width>(rows, layer_gradients, bias_sums + layer * Width);
+            upstream = layer_gradients;
+            upstream_dim = Width;
+        }
+    }
+}
+
+typedef void (*ForwardFunction)(size_t, size_t, size_t, const Perceptron&, const float*, const float*, float*);
+typedef void (*BackwardFunction)(size_t, size_t, size_t, const Perceptron&, const float*, const float* const*, float*);
+
+struct PerceptronKernels {
+    ForwardFunction forward;
+    BackwardFunction backward;
+};
+
+template <size_t Width>
+void forward_portable(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* input, const float* output_weights, float* output) {
+    forward_tiles<4, Width>(n, begin, end, perceptron, input, output_weights, output);
+}
+
+template <size_t Width>
+void backward_portable(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* gradients, const float* const* transposed_weights, float* bias_sums) {
+    backward_tiles<4, Width>(n, begin, end, perceptron, gradients, transposed_weights, bias_sums);
+}
+
+#ifdef PERCEPTRON_X86
+template <size_t Width>
+__attribute__((target("avx2,fma")))
+void forward_avx2(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* input, const float* output_weights, float* output) {
+    forward_tiles<8, Width>(n, begin, end, perceptron, input, output_weights, output);
+}
+
+template <size_t Width>
+__attribute__((target("avx2,fma")))
+void backward_avx2(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* gradients, const float* const* transposed_weights, float* bias_sums) {
+    backward_tiles<8, Width>(n, begin, end, perceptron, gradients, transposed_weights, bias_sums);
+}
+
+template <size_t Width>
+__attribute__((target("avx512f")))
+void forward_avx512(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* input, const float* output_weights, float* output) {
+    forward_tiles<16, Width>(n, begin, end, perceptron, input, output_weights, output);
+}
+
+template <size_t Width>
+__attribute__((target("avx512f")))
+void backward_avx512(size_t n, size_t begin, size_t end, const Perceptron& perceptron, const float* gradients, const float* const* transposed_weights, float* bias_sums) {
+    backward_tiles<16, Width>(n, begin, end, perceptron, gradients, transposed_weights, bias_sums);
+}
+#endif
+
+template <size_t Width>
+PerceptronKernels select_kernels() {
+#ifdef PERCEPTRON_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return PerceptronKernels{ forward_avx512<Width>, backward_avx512<Width> };
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return PerceptronKernels{ forward_avx2<Width>, backward_avx2<Width> };
+#endif
+    return PerceptronKernels{ forward_portable<Width>, backward_portable<Width> };
+}
+
+static PerceptronKernels kernels_for(size_t width) {
+    static const PerceptronKernels kernels16{ select_kernels<16>() };
+    static const PerceptronKernels kernels32{ select_kernels<32>() };
+    static const PerceptronKernels kernels64{ select_kernels<64>() };
+    static const PerceptronKernels kernels128{ select_kernels<128>() };
+    switch (width) {
+        case 16: return kernels16;
+        case 32: return kernels32;
+        case 64: return kernels64;
+        default: return kernels128;
+    }
+}
+
+static std::vector<float> transpose(size_t height, size_t width, const float* input) {
+    std::vector<float> output(height * width);
+    for (size_t i = 0; i < height; ++i) {
+        for (size_t j = 0; j < width; ++j) output[j * height + i] = input[i * width + j];
+    }
+    return output;
+}
+
+bool perceptron_width_supported(size_t width) {
+    return width == 16 || width == 32 || width == 64 || width == 128;
+}
+
+void perceptron_forward(size_t n, const Perceptron& perceptron, const float* input, float* output) {
+    const PerceptronKernels perceptron_kernels{ kernels_for(perceptron.width) };
+    const std::vector<float> output_weights{ transpose(perceptron.width, perceptron.output_dim, perceptron.weights[perceptron.n_layers - 1]) };
+    parallel_for((n + tile_rows - 1) / tile_rows, grain_rows / tile_rows, [&](size_t begin, size_t end) {
+        perceptron_kernels.forward(n, begin, end, perceptron, input, output_weights.data(), output);
+    });
+}
+
+void perceptron_backward(size_t n, const Perceptron& perceptron, const float* gradients) {
+    const PerceptronKernels perceptron_kernels{ kernels_for(perceptron.width) };
+    const size_t width{ perceptron.width };
+    const size_t last{ perceptron.n_layers - 1 };
+    std::vector<std::vector<float>> transposed(perceptron.n_layers);
+    std::vector<const float*> transposed_weights(perceptron.n_layers);
+    for (size_t layer = 1; layer < perceptron.n_layers; ++layer) {
+        transposed[layer] = transpose(width, layer == last ? perceptron.output_dim : width, perceptron.weights[layer]);
+        transposed_weights[layer] = transposed[layer].data();
+    }
+    const size_t n_tiles{ (n + tile_rows - 1) / tile_rows };
+    const size_t n_sums{ last * width + perceptron.output_dim };
+    const size_t n_chunks{ std::max(std::min(n_tiles * tile_rows / grain_rows, 4 * n_threads()), static_cast<size_t>(1)) };
+    std::vector<float> partial_sums(n_chunks * n_sums, 0);
+    parallel_for(n_chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; ++chunk) {
+            perceptron_kernels.backward(n, chunk * n_tiles / n_chunks, (chunk + 1) * n_tiles / n_chunks, perceptron, gradients, transposed_weights.data(), &partial_sums[chunk * n_sums]);
+        }
+    });
+    for (size_t layer = 0; layer < perceptron.n_layers; ++layer) {
+        if (!perceptron.bias_gradients[layer]) continue;
+        const size_t columns{ layer == last ? perceptron.output_dim : width };
+        for (size_t column = 0; column < columns; ++column) {
+            double sum{ 0 };
+            for (size_t chunk = 0; chunk < n_chunks; ++chunk) sum += partial_sums[chunk * n_sums + layer * width + column];
+            perceptron.bias_gradients[layer][column] = static_cast<float>(sum);
+        }
+    }
+}
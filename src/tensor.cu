@@ -2,23 +2,48 @@
 #include <memory>
 #include <random>
 #include <numeric>
+#include <algorithm>
 #include <functional>
+#include <stdexcept>
 #include "tensor.h"
-#include "kernels.h"
+#include "backend.h"
+#include "allocator.h"
 #include "autodiff.h"
+#include "expression.h"
 #include "utils.h"
 
 std::random_device device;
 std::mt19937 random_number_generator{ device() };
 
+Readback::Readback() = default;
+Readback::Readback(std::shared_ptr<float> data, const std::function<bool(bool)>& wait) : data{ data }, wait{ wait } {}
+
+bool Readback::valid() const {
+    return data != nullptr;
+}
+
+bool Readback::ready() const {
+    if (!valid()) throw std::logic_error("readback is empty");
+    return wait(false);
+}
+
+float Readback::get() const {
+    if (!valid()) throw std::logic_error("readback is empty");
+    wait(true);
+    return *data;
+}
+
 Tensor::Tensor() = default;
-Tensor::Tensor(const std::vector<int>& shape) :
+Tensor::Tensor(const std::vector<int>& shape, Device device, DType dtype) :
     shape{ shape },
     rank{ shape.size() },
     strides( rank ),
     n_elements{ std::accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<size_t>()) },
-    size{ n_elements * sizeof(float) },
-    data{ dataMalloc(size), [](float* data){cudaFree(data);} }
+    size{ n_elements * element_size(dtype) },
+    device{ device },
+    dtype{ dtype },
+    data{ allocator(device).allocate(size), [device](float* data){ allocator(device).deallocate(data); } },
+    version{ new size_t{ 0 } }
 {
     size_t stride = 1;
     for (int i = rank - 1; i >= 0; --i) {
@@ -27,64 +52,239 @@ Tensor::Tensor(const std::vector<int>& shape) :
     }
 }
 
-Tensor Tensor::from_scalar(float scalar, const std::vector<int>& shape) {
-    Tensor tensor{ shape };
-    float* array = (float*)malloc(tensor.size);
-    std::fill_n(array, tensor.n_elements, scalar);
-    cudaMemcpy(tensor.data.get(), array, tensor.size, cudaMemcpyHostToDevice);
-    free(array);
-    return tensor;    
+Tensor Tensor::from_scalar(float scalar, const std::vector<int>& shape, Device device) {
+    Tensor tensor{ shape, device };
+    tensor.fill(scalar);
+    return tensor;
 }
 
-Tensor Tensor::from_vector(const std::vector<float>& vector, const std::vector<int>& shape) {
-    Tensor tensor{ shape };
-    float* array = (float*)malloc(tensor.size);
-    std::copy(vector.begin(), vector.end(), array);
-    cudaMemcpy(tensor.data.get(), array, tensor.size, cudaMemcpyHostToDevice);
-    free(array);
+Tensor Tensor::from_vector(const std::vector<float>& vector, const std::vector<int>& shape, Device device) {
+    Tensor tensor{ shape, device };
+    backend(device).copy_from_host(tensor.size, vector.data(), tensor.data.get());
     return tensor;
 }
 
-Tensor Tensor::random_uniform(float min, float max, const std::vector<int>& shape) {
-    Tensor tensor{ shape };
-    float* array = (float*)malloc(tensor.size);
+Tensor Tensor::random_uniform(float min, float max, const std::vector<int>& shape, Device device) {
+    std::vector<float> vector(std::accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<size_t>()));
     std::uniform_real_distribution<float> distribution{ min, max };
-    for (int i = 0; i < tensor.n_elements; ++i) {
-        array[i] = distribution(random_number_generator);
+    for (float& element : vector) {
+        element = distribution(random_number_generator);
     }
-    cudaMemcpy(tensor.data.get(), array, tensor.size, cudaMemcpyHostToDevice);
-    free(array);
-    return tensor;    
+    return from_vector(vector, shape, device);
 }
 
-Tensor Tensor::random_normal(float mean, float standard_deviation, const std::vector<int>& shape) {
-    Tensor tensor{ shape };
-    float* array = (float*)malloc(tensor.size);
+Tensor Tensor::random_normal(float mean, float standard_deviation, const std::vector<int>& shape, Device device) {
+    std::vector<float> vector(std::accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<size_t>()));
     std::normal_distribution<float> distribution{ mean, standard_deviation };
-    for (int i = 0; i < tensor.n_elements; ++i) {
-        array[i] = distribution(random_number_generator);
+    for (float& element : vector) {
+        element = distribution(random_number_generator);
     }
-    cudaMemcpy(tensor.data.get(), array, tensor.size, cudaMemcpyHostToDevice);
-    free(array);
-    return tensor;
+    return from_vector(vector, shape, device);
 }
 
 float Tensor::operator[] (const std::vector<int>& indices) const {
+    if (dtype != DType::float32) return to(DType::float32)[indices];
     float scalar;
     const size_t index{ std::inner_product(strides.begin(), strides.end(), indices.begin(), static_cast<size_t>(0)) };
-    cudaMemcpy(&scalar, data.get() + index, sizeof(float), cudaMemcpyDeviceToHost);
+    backend(device).copy_to_host(sizeof(float), data.get() + index, &scalar);
     return scalar;
 }
 
+Readback Tensor::read_async(const std::vector<int>& indices) const {
+    if (dtype != DType::float32) return to(DType::float32).read_async(indices);
+    const size_t index{ std::inner_product(strides.begin(), strides.end(), indices.begin(), static_cast<size_t>(0)) };
+    const Device device{ this->device };
+    const std::shared_ptr<float> scalar{ backend(device).allocate_host(sizeof(float)), [device](float* data){ backend(device).deallocate_host(data); } };
+    return Readback{ scalar, backend(device).copy_to_host_async(sizeof(float), data.get() + index, scalar.get()) };
+}
+
+std::vector<float> Tensor::to_host() const {
+    if (!n_elements) return {};
+    if (dtype != DType::float32) return to(DType::float32).to_host();
+    size_t extent{ 1 };
+    bool contiguous{ true };
+    size_t stride{ 1 };
+    for (int i = rank - 1; i >= 0; --i) {
+        extent += (shape[i] - 1) * strides[i];
+        contiguous = contiguous && (shape[i] == 1 || strides[i] == stride);
+        stride *= shape[i];
+    }
+    std::vector<float> storage(extent);
+    backend(device).copy_to_host(extent * sizeof(float), data.get(), storage.data());
+    if (contiguous) return storage;
+    std::vector<float> vector(n_elements);
+    std::vector<int> indices(rank, 0);
+    for (size_t i = 0; i < n_elements; ++i) {
+        vector[i] = storage[std::inner_product(strides.begin(), strides.end(), indices.begin(), static_cast<size_t>(0))];
+        for (int j = rank - 1; j >= 0 && ++indices[j] == shape[j]; --j) indices[j] = 0;
+    }
+    return vector;
+}
+
+static std::vector<size_t> contiguous_strides(const std::vector<int>& shape) {
+    std::vector<size_t> strides(shape.size());
+    size_t stride{ 1 };
+    for (size_t i = shape.size(); i-- > 0;) {
+        strides[i] = stride;
+        stride *= shape[i];
+    }
+    return strides;
+}
+
+static Tensor strided_view(const Tensor& tensor, size_t offset, const std::vector<int>& shape, const std::vector<size_t>& strides) {
+    Tensor view{};
+    view.shape = shape;
+    view.rank = shape.size();
+    view.strides = strides;
+    view.n_elements = std::accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<size_t>());
+    view.size = view.n_elements * element_size(tensor.dtype);
+    view.device = tensor.device;
+    view.dtype = tensor.dtype;
+    view.version = tensor.version;
+    view.data = std::shared_ptr<float>{ tensor.data, reinterpret_cast<float*>(reinterpret_cast<char*>(tensor.data.get()) + offset * element_size(tensor.dtype)) };
+    return view;
+}
+
+static bool reshape_strides(const Tensor& tensor, const std::vector<int>& shape, std::vector<size_t>& strides) {
+    strides = contiguous_strides(shape);
+    if (!tensor.n_elements) return true;
+    size_t dim{ shape.size() };
+    for (size_t i = tensor.rank; i > 0;) {
+        if (tensor.shape[i - 1] == 1) {
+            --i;
+            continue;
+        }
+        const size_t base{ tensor.strides[i - 1] };
+        size_t chunk{ 1 };
+        while (i > 0 && (tensor.shape[i - 1] == 1 || tensor.strides[i - 1] == base * chunk)) chunk *= tensor.shape[--i];
+        size_t size{ 1 };
+        while (size < chunk && dim > 0) {
+            strides[dim - 1] = base * size;
+            size *= shape[--dim];
+        }
+        if (size != chunk) return false;
+    }
+    return true;
+}
+
 Tensor Tensor::transpose(size_t dim1, size_t dim2) const {
     Tensor transpose{ *this };
     transpose.shape[dim1] = shape[dim2];
     transpose.shape[dim2] = shape[dim1];
     transpose.strides[dim1] = strides[dim2];
     transpose.strides[dim2] = strides[dim1];
+    if (backward_pointer) transpose.backward_pointer = std::shared_ptr<Backward>{ new TransposeBackward{ dim1, dim2, backward_pointer } };
     return transpose;
 }
 
+Tensor Tensor::view(size_t offset, const std::vector<int>& shape) const {
+    if (!is_contiguous()) throw std::invalid_argument("view requires a contiguous tensor");
+    const size_t n{ std::accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<size_t>()) };
+    if (offset + n > n_elements) throw std::invalid_argument("view exceeds the tensor");
+    return strided_view(*this, offset, shape, contiguous_strides(shape));
+}
+
+Tensor Tensor::slice(size_t dim, size_t start, size_t end, size_t step) const {
+    if (dim >= rank) throw std::out_of_range("dim is out of range");
+    if (!step || start > end || end > shape[dim]) throw std::out_of_range("slice exceeds the tensor");
+    std::vector<int> slice_shape{ shape };
+    std::vector<size_t> slice_strides{ strides };
+    slice_shape[dim] = (end - start + step - 1) / step;
+    slice_strides[dim] *= step;
+    Tensor slice{ strided_view(*this, start * strides[dim], slice_shape, slice_strides) };
+    if (backward_pointer) slice.backward_pointer = std::shared_ptr<Backward>{ new SliceBackward{ shape, dim, start, end, step, backward_pointer } };
+    return slice;
+}
+
+Tensor Tensor::narrow(size_t dim, size_t start, size_t length) const {
+    return slice(dim, start, start + length);
+}
+
+Tensor Tensor::select(size_t dim, size_t index) const {
+    if (dim >= rank) throw std::out_of_range("dim is out of range");
+    if (index >= shape[dim]) throw std::out_of_range("index exceeds the tensor");
+    std::vector<int> select_shape{ shape };
+    std::vector<size_t> select_strides{ strides };
+    select_shape.erase(select_shape.begin() + dim);
+    select_strides.erase(select_strides.begin() + dim);
+    Tensor select{ strided_view(*this, index * strides[dim], select_shape, select_strides) };
+    if (backward_pointer) select.backward_pointer = std::shared_ptr<Backward>{ new SliceBackward{ shape, dim, index, index + 1, 1, backward_pointer } };
+    return select;
+}
+
+Tensor Tensor::reshape(const std::vector<int>& shape) const {
+    std::vector<int> reshaped{ shape };
+    const auto inferred = std::find(reshaped.begin(), reshaped.end(), -1);
+    if (inferred != reshaped.end()) {
+        *inferred = 1;
+        const size_t known{ std::accumulate(reshaped.begin(), reshaped.end(), static_cast<size_t>(1), std::multiplies<size_t>()) };
+        if (known) *inferred = static_cast<int>(n_elements / known);
+    }
+    if (std::any_of(reshaped.begin(), reshaped.end(), [](int dim){ return dim < 0; }) || std::accumulate(reshaped.begin(), reshaped.end(), static_cast<size_t>(1), std::multiplies<size_t>()) != n_elements) throw std::invalid_argument("shape does not match the number of elements");
+    std::vector<size_t> reshaped_strides{};
+    if (!reshape_strides(*this, reshaped, reshaped_strides)) return contiguous().reshape(reshaped);
+    Tensor reshape{ strided_view(*this, 0, reshaped, reshaped_strides) };
+    if (backward_pointer) reshape.backward_pointer = std::shared_ptr<Backward>{ new ReshapeBackward{ this->shape, backward_pointer } };
+    return reshape;
+}
+
+Tensor Tensor::expand(const std::vector<int>& shape) const {
+    if (shape.size() < rank) throw std::invalid_argument("shapes cannot be broadcast");
+    const size_t leading{ shape.size() - rank };
+    std::vector<int> expanded{ shape };
+    std::vector<size_t> expanded_strides(shape.size(), 0);
+    for (size_t i = 0; i < rank; ++i) {
+        int& dim{ expanded[leading + i] };
+        if (dim == -1) dim = this->shape[i];
+        if (dim == this->shape[i]) expanded_strides[leading + i] = strides[i];
+        else if (this->shape[i] != 1) throw std::invalid_argument("shapes cannot be broadcast");
+    }
+    if (std::any_of(expanded.begin(), expanded.end(), [](int dim){ return dim < 0; })) throw std::invalid_argument("shapes cannot be broadcast");
+    Tensor expand{ strided_view(*this, 0, expanded, expanded_strides) };
+    if (backward_pointer) expand.backward_pointer = std::shared_ptr<Backward>{ new ExpandBackward{ this->shape, backward_pointer } };
+    return expand;
+}
+
+bool Tensor::is_contiguous() const {
+    size_t stride{ 1 };
+    for (size_t i = rank; i-- > 0;) {
+        if (shape[i] != 1 && strides[i] != stride) return false;
+        stride *= shape[i];
+    }
+    return true;
+}
+
+Tensor Tensor::contiguous() const {
+    if (is_contiguous()) return *this;
+    if (dtype != DType::float32) return to(DType::float32).contiguous().to(dtype);
+    return Expression{ *this }.evaluate();
+}
+
+Tensor Tensor::to(Device device) const {
+    if (device == this->device) return detach();
+    if (!is_contiguous()) return contiguous().to(device);
+    if (dtype != DType::float32) return to(DType::float32).to(device).to(dtype);
+    std::vector<float> vector(n_elements);
+    backend(this->device).copy_to_host(size, data.get(), vector.data());
+    return Tensor::from_vector(vector, shape, device);
+}
+
+Tensor Tensor::to(DType dtype) const {
+    size_t extent{ 0 };
+    for (size_t i = 0; n_elements && i < rank; ++i) extent += (shape[i] - 1) * strides[i];
+    if (n_elements) ++extent;
+    Tensor tensor{ {static_cast<int>(extent)}, device, dtype };
+    if (dtype == this->dtype) backend(device).copy(tensor.size, data.get(), tensor.data.get());
+    else backend(device).convert(extent, this->dtype, dtype, data.get(), tensor.data.get());
+    tensor.shape = shape;
+    tensor.rank = rank;
+    tensor.strides = strides;
+    tensor.n_elements = n_elements;
+    tensor.size = n_elements * element_size(dtype);
+    if (backward_pointer) tensor.backward_pointer = std::shared_ptr<Backward>{ new AddBackward{ {backward_pointer} } };
+    return tensor;
+}
+
 void Tensor::requires_gradients(bool sum) {
     backward_pointer = std::shared_ptr<Backward>{ new AccumulateGradients{ sum } };
 }
@@ -107,132 +307,418 @@ Tensor& Tensor::gradients() const {
     return backward_pointer->tensors[0];
 }
 
+static void modified(const Tensor& tensor) {
+    if (tensor.version) ++*tensor.version;
+}
+
+static void copy_into(const Tensor& input, const Tensor& output) {
+    const Tensor one{ Tensor::from_scalar(1, {1}, output.device) };
+    Broadcast broadcast{};
+    prepare_broadcast(input.detach().expand(output.shape), one.expand(output.shape), output, broadcast);
+    backend(output.device).multiply(output.n_elements, broadcast, input.data.get(), one.data.get(), output.data.get());
+}
+
+static Tensor& assign(Tensor& output, const Tensor& result) {
+    copy_into(result, output);
+    output.backward_pointer = result.backward_pointer;
+    modified(output);
+    return output;
+}
+
+static Tensor& in_place(Tensor& tensor, bool saves_input, const std::function<void(const Tensor& input, Tensor& output)>& operation) {
+    if (!tensor.backward_pointer || dynamic_cast<AccumulateGradients*>(tensor.backward_pointer.get())) {
+        const std::shared_ptr<Backward> backward_pointer{ tensor.backward_pointer };
+        operation(tensor.detach(), tensor);
+        tensor.backward_pointer = backward_pointer;
+        return tensor;
+    }
+    Tensor input{ saves_input ? Expression{ tensor.detach() }.evaluate() : tensor };
+    input.backward_pointer = tensor.backward_pointer;
+    operation(input, tensor);
+    return tensor;
+}
+
+static bool prepare_unary(const Tensor& input, const Tensor& output) {
+    if (input.device != output.device) throw std::invalid_argument("tensors are on different devices");
+    require_float32(input);
+    require_float32(output);
+    if (input.shape != output.shape) throw std::invalid_argument("output shape does not match the input shape");
+    return input.is_contiguous() && output.is_contiguous();
+}
+
+static void require_output(const Tensor& output, const std::vector<int>& shape, Device device, const std::vector<const Tensor*>& inputs) {
+    if (output.device != device) throw std::invalid_argument("tensors are on different devices");
+    require_float32(output);
+    if (output.shape != shape || !output.is_contiguous()) throw std::invalid_argument("output must be a contiguous tensor of the result shape");
+    for (const Tensor* input : inputs) {
+        if (output.version == input->version) throw std::invalid_argument("output shares storage with an input");
+    }
+}
+
 void Tensor::fill (float scalar) {
-    fill_scalar<<<(n_elements + 255) / 256, 256>>>(n_elements, scalar, data.get());
+    require_float32(*this);
+    if (is_contiguous()) backend(device).fill_scalar(n_elements, scalar, data.get());
+    else copy_into(Tensor::from_scalar(scalar, {1}, device), *this);
+    modified(*this);
+}
+
+Tensor& Tensor::add_(const Tensor& tensor) {
+    return in_place(*this, false, [&](const Tensor& input, Tensor& output) { add(input, tensor, output); });
+}
+
+Tensor& Tensor::subtract_(const Tensor& tensor) {
+    return in_place(*this, false, [&](const Tensor& input, Tensor& output) { subtract(input, tensor, output); });
+}
+
+Tensor& Tensor::multiply_(const Tensor& tensor) {
+    return in_place(*this, true, [&](const Tensor& input, Tensor& output) { multiply(input, tensor, output); });
+}
+
+Tensor& Tensor::divide_(const Tensor& tensor) {
+    return in_place(*this, true, [&](const Tensor& input, Tensor& output) { divide(input, tensor, output); });
+}
+
+Tensor& Tensor::negate_() {
+    return in_place(*this, false, [](const Tensor& input, Tensor& output) { negate(input, output); });
+}
+
+Tensor& Tensor::square_() {
+    return in_place(*this, true, [](const Tensor& input, Tensor& output) { square(input, output); });
+}
+
+Tensor& Tensor::relu_() {
+    return in_place(*this, false, [](const Tensor& input, Tensor& output) { relu(input, output); });
+}
+
+Tensor& Tensor::operator+= (const Tensor& tensor) {
+    return add_(tensor);
 }
 
 Tensor& Tensor::operator-= (const Tensor& tensor) {
-    subtract<<<(n_elements + 255) / 256, 256>>>(n_elements, data.get(), tensor.data.get(), data.get());
-    return *this;
+    return subtract_(tensor);
+}
+
+Tensor& Tensor::operator*= (const Tensor& tensor) {
+    return multiply_(tensor);
+}
+
+Tensor& Tensor::operator/= (const Tensor& tensor) {
+    return divide_(tensor);
 }
 
 Tensor operator- (const Tensor& input) {
-    Tensor output{ input.shape };
-    negate<<<(output.n_elements + 255) / 256, 256>>>(output.n_elements, input.data.get(), output.data.get());
-    if (input.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new NegateBackward{ input.backward_pointer } };
+    require_float32(input);
+    if (!input.is_contiguous()) return (-Expression{ input }).evaluate();
+    Tensor output{ input.shape, input.device };
+    return negate(input, output);
+}
+
+Tensor& negate(const Tensor& input, Tensor& output) {
+    if (!prepare_unary(input, output)) return assign(output, -input);
+    std::shared_ptr<Backward> backward_pointer{};
+    if (input.backward_pointer) backward_pointer = std::shared_ptr<Backward>{ new NegateBackward{ input.backward_pointer } };
+    backend(output.device).negate(output.n_elements, input.data.get(), output.data.get());
+    output.backward_pointer = backward_pointer;
+    modified(output);
     return output;
 }
 
 Tensor operator+ (const Tensor& tensor1, const Tensor& tensor2) {
-    size_t* tensor1_strides{};
-    size_t* tensor2_strides{};
-    size_t* strides{};
-    Tensor sum{};
-    prepare_broadcast(tensor1, tensor2, &tensor1_strides, &tensor2_strides, &strides, sum);
-    add<<<(sum.n_elements + 255) / 256, 256>>>(sum.n_elements, sum.rank, tensor1_strides, tensor2_strides, strides, tensor1.data.get(), tensor2.data.get(), sum.data.get());
-    if (tensor1.backward_pointer || tensor2.backward_pointer) sum.backward_pointer = std::shared_ptr<Backward>{ new AddBackward{ {tensor1.backward_pointer, tensor2.backward_pointer} } };
-    return sum;
+    Tensor sum{ broadcast_shape(tensor1, tensor2), tensor1.device };
+    return add(tensor1, tensor2, sum);
+}
+
+Tensor& add(const Tensor& tensor1, const Tensor& tensor2, Tensor& output) {
+    Broadcast broadcast{};
+    prepare_broadcast(tensor1, tensor2, output, broadcast);
+    std::shared_ptr<Backward> backward_pointer{};
+    if (tensor1.backward_pointer || tensor2.backward_pointer) backward_pointer = std::shared_ptr<Backward>{ new AddBackward{ {tensor1.backward_pointer, tensor2.backward_pointer} } };
+    backend(output.device).add(output.n_elements, broadcast, tensor1.data.get(), tensor2.data.get(), output.data.get());
+    output.backward_pointer = backward_pointer;
+    modified(output);
+    return output;
 }
 
 Tensor operator- (const Tensor& tensor1, const Tensor& tensor2) {
-    size_t* tensor1_strides{};
-    size_t* tensor2_strides{};
-    size_t* strides{};
-    Tensor difference{};
-    prepare_broadcast(tensor1, tensor2, &tensor1_strides, &tensor2_strides, &strides, difference);
-    subtract<<<(difference.n_elements + 255) / 256, 256>>>(difference.n_elements, difference.rank, tensor1_strides, tensor2_strides, strides, tensor1.data.get(), tensor2.data.get(), difference.data.get());
-    if (tensor1.backward_pointer || tensor2.backward_pointer) difference.backward_pointer = std::shared_ptr<Backward>{ new SubtractBackward{ {tensor1.backward_pointer, tensor2.backward_pointer} } };
-    return difference;
+    Tensor difference{ broadcast_shape(tensor1, tensor2), tensor1.device };
+    return subtract(tensor1, tensor2, difference);
+}
+
+Tensor& subtract(const Tensor& tensor1, const Tensor& tensor2, Tensor& output) {
+    Broadcast broadcast{};
+    prepare_broadcast(tensor1, tensor2, output, broadcast);
+    std::shared_ptr<Backward> backward_pointer{};
+    if (tensor1.backward_pointer || tensor2.backward_pointer) backward_pointer = std::shared_ptr<Backward>{ new SubtractBackward{ {tensor1.backward_pointer, tensor2.backward_pointer} } };
+    backend(output.device).subtract(output.n_elements, broadcast, tensor1.data.get(), tensor2.data.get(), output.data.get());
+    output.backward_pointer = backward_pointer;
+    modified(output);
+    return output;
 }
 
 Tensor operator* (const Tensor& tensor1, const Tensor& tensor2) {
-    size_t* tensor1_strides{};
-    size_t* tensor2_strides{};
-    size_t* strides{};
-    Tensor product{};
-    prepare_broadcast(tensor1, tensor2, &tensor1_strides, &tensor2_strides, &strides, product);
-    multiply<<<(product.n_elements + 255) / 256, 256>>>(product.n_elements, product.rank, tensor1_strides, tensor2_strides, strides, tensor1.data.get(), tensor2.data.get(), product.data.get());
-    if (tensor1.backward_pointer || tensor2.backward_pointer) product.backward_pointer = std::shared_ptr<Backward>{ new MultiplyBackward{ {tensor1.detach(), tensor2.detach()}, {tensor1.backward_pointer, tensor2.backward_pointer} } };
-    return product;
+    Tensor product{ broadcast_shape(tensor1, tensor2), tensor1.device };
+    return multiply(tensor1, tensor2, product);
+}
+
+Tensor& multiply(const Tensor& tensor1, const Tensor& tensor2, Tensor& output) {
+    Broadcast broadcast{};
+    prepare_broadcast(tensor1, tensor2, output, broadcast);
+    std::shared_ptr<Backward> backward_pointer{};
+    if (tensor1.backward_pointer || tensor2.backward_pointer) backward_pointer = std::shared_ptr<Backward>{ new MultiplyBackward{ {tensor1.detach(), tensor2.detach()}, {tensor1.backward_pointer, tensor2.backward_pointer} } };
+    backend(output.device).multiply(output.n_elements, broadcast, tensor1.data.get(), tensor2.data.get(), output.data.get());
+    output.backward_pointer = backward_pointer;
+    modified(output);
+    return output;
 }
 
 Tensor operator/ (const Tensor& tensor1, const Tensor& tensor2) {
-    size_t* tensor1_strides{};
-    size_t* tensor2_strides{};
-    size_t* strides{};
-    Tensor quotient{};
-    prepare_broadcast(tensor1, tensor2, &tensor1_strides, &tensor2_strides, &strides, quotient);
-    divide<<<(quotient.n_elements + 255) / 256, 256>>>(quotient.n_elements, quotient.rank, tensor1_strides, tensor2_strides, strides, tensor1.data.get(), tensor2.data.get(), quotient.data.get());
-    if (tensor1.backward_pointer || tensor2.backward_pointer) {
-        const Tensor tensor1_reciprocal{ Tensor::from_scalar(1, std::vector<int>(tensor1.rank, 1)) / tensor1.detach() };
-        const Tensor tensor2_reciprocal{ Tensor::from_scalar(1, std::vector<int>(tensor2.rank, 1)) / tensor2.detach() };
-        quotient.backward_pointer = std::shared_ptr<Backward>{ new MultiplyBackward{ {tensor1_reciprocal, tensor2_reciprocal}, {tensor1.backward_pointer, tensor2.backward_pointer} } };
+    Tensor quotient{ broadcast_shape(tensor1, tensor2), tensor1.device };
+    return divide(tensor1, tensor2, quotient);
+}
+
+Tensor& divide(const Tensor& tensor1, const Tensor& tensor2, Tensor& output) {
+    Broadcast broadcast{};
+    prepare_broadcast(tensor1, tensor2, output, broadcast);
+    std::shared_ptr<Backward> backward_pointer{};
+    if (tensor1.backward_pointer || tensor2.backward_pointer) backward_pointer = std::shared_ptr<Backward>{ new DivideBackward{ {tensor1.detach(), tensor2.detach()}, {tensor1.backward_pointer, tensor2.backward_pointer} } };
+    backend(output.device).divide(output.n_elements, broadcast, tensor1.data.get(), tensor2.data.get(), output.data.get());
+    output.backward_pointer = backward_pointer;
+    modified(output);
+    return output;
+}
+
+static bool batch_contiguous(const Tensor& tensor) {
+    size_t stride{ static_cast<size_t>(tensor.shape.end()[-2]) * tensor.shape.end()[-1] };
+    for (size_t i = tensor.rank - 2; i-- > 0;) {
+        if (tensor.shape[i] != 1 && tensor.strides[i] != stride) return false;
+        stride *= tensor.shape[i];
     }
-    return quotient;
+    return true;
 }
 
 Tensor mm(const Tensor& tensor1, const Tensor& tensor2) {
     std::vector<int> shape{ tensor1.shape };
     shape.back() = tensor2.shape.back();
-    Tensor matrix_product{ shape };
-    const size_t height = matrix_product.shape.end()[-2];
-    const size_t width = matrix_product.shape.end()[-1];
+    Tensor matrix_product{ shape, tensor1.device };
+    return mm(tensor1, tensor2, matrix_product);
+}
+
+Tensor& mm(const Tensor& tensor1, const Tensor& tensor2, Tensor& output) {
+    if (tensor1.device != tensor2.device) throw std::invalid_argument("tensors are on different devices");
+    if (!batch_contiguous(tensor1) || !batch_contiguous(tensor2)) return mm(batch_contiguous(tensor1) ? tensor1 : tensor1.contiguous(), batch_contiguous(tensor2) ? tensor2 : tensor2.contiguous(), output);
+    std::vector<int> shape{ tensor1.shape };
+    shape.back() = tensor2.shape.back();
+    require_output(output, shape, tensor1.device, {&tensor1, &tensor2});
+    const size_t height = output.shape.end()[-2];
+    const size_t width = output.shape.end()[-1];
     const size_t shared_dim = tensor1.shape.end()[-1];
-    const size_t batch_size = matrix_product.n_elements / (height * width);
-    size_t* tensor1_strides{};
-    size_t* tensor2_strides{};
-    const size_t strides_size = matrix_product.rank * sizeof(size_t);
-    cudaMalloc(&tensor1_strides, strides_size);
-    cudaMalloc(&tensor2_strides, strides_size);
-    cudaMemcpy(tensor1_strides, &tensor1.strides[0], strides_size, cudaMemcpyHostToDevice);
-    cudaMemcpy(tensor2_strides, &tensor2.strides[0], strides_size, cudaMemcpyHostToDevice);
-    dim3 block_dim(16, 16);
-    dim3 grid_dim((height + block_dim.x - 1) / block_dim.x, (width + block_dim.y - 1) / block_dim.y, batch_size);
-    matrix_multiply<<<grid_dim, block_dim>>>(matrix_product.rank, height, width, shared_dim, tensor1_strides, tensor2_strides, tensor1.data.get(), tensor2.data.get(), matrix_product.data.get());
-    cudaFree(tensor1_strides);
-    cudaFree(tensor2_strides);
-    if (tensor1.backward_pointer || tensor2.backward_pointer) matrix_product.backward_pointer = std::shared_ptr<Backward>{ new MatrixMultiplyBackward{ {tensor1.detach(), tensor2.detach()}, {tensor1.backward_pointer, tensor2.backward_pointer} } };
-    return matrix_product;
+    const size_t batch_size = output.n_elements / (height * width);
+    backend(output.device).matrix_multiply(batch_size, output.rank, height, width, shared_dim, tensor1.strides.data(), tensor2.strides.data(), tensor1.dtype, tensor2.dtype, tensor1.data.get(), tensor2.data.get(), output.data.get());
+    output.backward_pointer = nullptr;
+    if (tensor1.backward_pointer || tensor2.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new MatrixMultiplyBackward{ {tensor1.detach(), tensor2.detach()}, {tensor1.backward_pointer, tensor2.backward_pointer} } };
+    modified(output);
+    return output;
+}
+
+static bool linear_fusable(const Tensor& input, const Tensor& weights, const Tensor& bias) {
+    return input.rank == 2 && weights.rank == 2 && input.shape[1] == weights.shape[0] && bias.n_elements == weights.shape[1] && bias.shape.back() == weights.shape[1] && bias.strides.back() == 1;
+}
+
+Tensor linear(const Tensor& input, const Tensor& weights, const Tensor& bias, bool apply_relu) {
+    if (input.device != weights.device || input.device != bias.device) throw std::invalid_argument("tensors are on different devices");
+    if (bias.dtype != DType::float32) return linear(input, weights, bias.to(DType::float32), apply_relu);
+    if (!linear_fusable(input, weights, bias)) {
+        const Tensor output{ mm(input, weights) + bias };
+        return apply_relu ? relu(output) : output;
+    }
+    Tensor output{ {input.shape[0], weights.shape[1]}, input.device };
+    return linear(input, weights, bias, apply_relu, output);
+}
+
+Tensor& linear(const Tensor& input, const Tensor& weights, const Tensor& bias, bool apply_relu, Tensor& output) {
+    if (input.device != weights.device || input.device != bias.device) throw std::invalid_argument("tensors are on different devices");
+    if (bias.dtype != DType::float32) return linear(input, weights, bias.to(DType::float32), apply_relu, output);
+    if (!linear_fusable(input, weights, bias)) return assign(output, linear(input, weights, bias, apply_relu));
+    require_output(output, {input.shape[0], weights.shape[1]}, input.device, {&input, &weights, &bias});
+    const size_t height = output.shape[0];
+    const size_t width = output.shape[1];
+    const size_t shared_dim = input.shape[1];
+    backend(output.device).linear(height, width, shared_dim, input.strides.data(), weights.strides.data(), input.dtype, weights.dtype, apply_relu, input.data.get(), weights.data.get(), bias.data.get(), output.data.get());
+    modified(output);
+    output.backward_pointer = nullptr;
+    if (input.backward_pointer || weights.backward_pointer || bias.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new LinearBackward{ {input.detach(), weights.detach(), output.detach()}, apply_relu, {input.backward_pointer, weights.backward_pointer, bias.backward_pointer} } };
+    return output;
+}
+
+Tensor quantized_linear(const Tensor& input, const Tensor& weights, const Tensor& scales, const Tensor& bias, float input_scale, bool apply_relu, float output_scale) {
+    if (input.device != weights.device || input.device != scales.device || input.device != bias.device) throw std::invalid_argument("tensors are on different devices");
+    if (input.dtype != DType::float32 && input.dtype != DType::int8) return quantized_linear(input.to(DType::float32), weights, scales, bias, input_scale, apply_relu, output_scale);
+    if (bias.dtype != DType::float32) return quantized_linear(input, weights, scales, bias.to(DType::float32), input_scale, apply_relu, output_scale);
+    if (weights.dtype != DType::int8) throw std::invalid_argument("quantized weights must be int8");
+    require_float32(scales);
+    if (input.rank != 2 || weights.rank != 2 || input.shape[1] != weights.shape[0]) throw std::invalid_argument("input does not match the weights");
+    if (scales.n_elements != weights.shape[1] || scales.strides.back() != 1 || bias.n_elements != weights.shape[1] || bias.strides.back() != 1) throw std::invalid_argument("scales and bias must have one element per output");
+    if (!(input_scale > 0) || !(output_scale >= 0)) throw std::invalid_argument("invalid quantization scales");
+    QuantizedLinear layer{};
+    layer.input_strides[0] = input.strides[0];
+    layer.input_strides[1] = input.strides[1];
+    layer.weights_strides[0] = weights.strides[0];
+    layer.weights_strides[1] = weights.strides[1];
+    layer.input_type = input.dtype;
+    layer.output_type = output_scale > 0 ? DType::int8 : DType::float32;
+    layer.input_scale = input_scale;
+    layer.output_scale = output_scale;
+    layer.relu = apply_relu;
+    Tensor output{ {input.shape[0], weights.shape[1]}, input.device, layer.output_type };
+    backend(output.device).quantized_linear(output.shape[0], output.shape[1], input.shape[1], layer, input.data.get(), weights.data.get(), scales.data.get(), bias.data.get(), output.data.get());
+    return output;
+}
+
+Tensor perceptron(const Tensor& input, const std::vector<Tensor>& weights, const std::vector<Tensor>& biases) {
+    Perceptron network{};
+    if (!prepare_perceptron(input, weights, biases, network)) {
+        Tensor output{ input };
+        for (size_t layer = 0; layer < weights.size(); ++layer) output = linear(output, weights[layer], biases[layer], layer + 1 < weights.size());
+        return output;
+    }
+    const size_t n = input.shape[0];
+    bool requires_gradients{ input.backward_pointer != nullptr };
+    for (size_t layer = 0; layer < weights.size(); ++layer) requires_gradients = requires_gradients || weights[layer].backward_pointer || biases[layer].backward_pointer;
+    std::vector<Tensor> activations{};
+    for (size_t layer = 0; requires_gradients && layer + 1 < network.n_layers; ++layer) {
+        activations.push_back(Tensor{ {static_cast<int>(n), static_cast<int>(network.width)}, input.device });
+        network.activations[layer] = activations.back().data.get();
+    }
+    Tensor output{ {static_cast<int>(n), static_cast<int>(network.output_dim)}, input.device };
+    backend(output.device).perceptron(n, network, input.data.get(), output.data.get());
+    if (requires_gradients) {
+        std::vector<Tensor> tensors{ input.detach() };
+        std::vector<std::shared_ptr<Backward>> backwards{ input.backward_pointer };
+        for (const Tensor& layer_weights : weights) {
+            tensors.push_back(layer_weights.detach());
+            backwards.push_back(layer_weights.backward_pointer);
+        }
+        for (const Tensor& bias : biases) backwards.push_back(bias.backward_pointer);
+        tensors.insert(tensors.end(), activations.begin(), activations.end());
+        output.backward_pointer = std::shared_ptr<Backward>{ new PerceptronBackward{ tensors, backwards } };
+    }
+    return output;
+}
+
+Tensor hash_encode(const Tensor& input, const Tensor& tables, const HashGrid& grid) {
+    if (input.device != tables.device) throw std::invalid_argument("tensors are on different devices");
+    require_float32(input);
+    require_float32(tables);
+    if (input.rank != 2 || input.shape[1] != grid.input_dim) throw std::invalid_argument("input does not match the grid dimension");
+    if (tables.n_elements != grid.n_levels * grid.table_size * grid.n_features || !tables.is_contiguous()) throw std::invalid_argument("tables do not match the grid");
+    HashGrid input_grid{ grid };
+    input_grid.input_strides[0] = input.strides[0];
+    input_grid.input_strides[1] = input.strides[1];
+    const size_t n = input.shape[0];
+    Tensor output{ {static_cast<int>(n), static_cast<int>(grid.n_levels * grid.n_features)}, input.device };
+    backend(output.device).hash_encode(n, input_grid, input.data.get(), tables.data.get(), output.data.get());
+    if (tables.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new HashEncodeBackward{ input.detach(), tables.shape, input_grid, tables.backward_pointer } };
+    return output;
+}
+
+Tensor positional_encode(const Tensor& input, size_t n_frequencies) {
+    require_float32(input);
+    if (input.rank != 2) throw std::invalid_argument("input must be a matrix");
+    FourierFeatures features{};
+    features.input_dim = input.shape[1];
+    features.n_frequencies = n_frequencies;
+    features.input_strides[0] = input.strides[0];
+    features.input_strides[1] = input.strides[1];
+    const size_t n = input.shape[0];
+    Tensor output{ {static_cast<int>(n), static_cast<int>(2 * features.input_dim * n_frequencies)}, input.device };
+    backend(output.device).positional_encode(n, features, input.data.get(), output.data.get());
+    if (input.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new PositionalEncodeBackward{ output.detach(), features, input.backward_pointer } };
+    return output;
 }
 
 Tensor relu(const Tensor& input) {
-    Tensor output{ input.shape };
-    relu<<<(output.n_elements + 255) / 256, 256>>>(output.n_elements, input.data.get(), output.data.get());
-    if (input.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new ReluBackward{ input.detach(), input.backward_pointer } };
+    require_float32(input);
+    if (!input.is_contiguous()) return relu(Expression{ input }).evaluate();
+    Tensor output{ input.shape, input.device };
+    return relu(input, output);
+}
+
+Tensor& relu(const Tensor& input, Tensor& output) {
+    if (!prepare_unary(input, output)) return assign(output, relu(input));
+    const std::shared_ptr<Backward> input_backward_pointer{ input.backward_pointer };
+    backend(output.device).relu(output.n_elements, input.data.get(), output.data.get());
+    modified(output);
+    output.backward_pointer = nullptr;
+    if (input_backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new ReluBackward{ output.detach(), input_backward_pointer } };
     return output;
 }
 
 Tensor relu_d(const Tensor& input) {
-    Tensor output{ input.shape };
-    relu_d<<<(output.n_elements + 255) / 256, 256>>>(output.n_elements, input.data.get(), output.data.get());
+    require_float32(input);
+    if (!input.is_contiguous()) return relu_d(Expression{ input }).evaluate();
+    Tensor output{ input.shape, input.device };
+    return relu_d(input, output);
+}
+
+Tensor& relu_d(const Tensor& input, Tensor& output) {
+    if (!prepare_unary(input, output)) return assign(output, relu_d(input).detach());
+    backend(output.device).relu_d(output.n_elements, input.data.get(), output.data.get());
+    output.backward_pointer = nullptr;
+    modified(output);
     return output;
 }
 
 Tensor square(const Tensor& input) {
-    Tensor output{ input.shape };
-    square<<<(output.n_elements + 255) / 256, 256>>>(output.n_elements, input.data.get(), output.data.get());
-    if (input.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new SquareBackward{ input.detach(), input.backward_pointer } };
+    require_float32(input);
+    if (!input.is_contiguous()) return square(Expression{ input }).evaluate();
+    Tensor output{ input.shape, input.device };
+    return square(input, output);
+}
+
+Tensor& square(const Tensor& input, Tensor& output) {
+    if (!prepare_unary(input, output)) return assign(output, square(input));
+    std::shared_ptr<Backward> backward_pointer{};
+    if (input.backward_pointer) backward_pointer = std::shared_ptr<Backward>{ new SquareBackward{ input.detach(), input.backward_pointer } };
+    backend(output.device).square(output.n_elements, input.data.get(), output.data.get());
+    output.backward_pointer = backward_pointer;
+    modified(output);
     return output;
 }
 
 Tensor sum(const Tensor& input) {
-    Tensor output{ std::vector<int>(input.rank, 1) };
-    sum<<<1, 1>>>(input.n_elements, input.data.get(), output.data.get());
-    if (input.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new SumBackward{ input.shape, input.backward_pointer } };
-    return output;
+    std::vector<int> dims(input.rank);
+    std::iota(dims.begin(), dims.end(), 0);
+    return sum(input, dims, true);
+}
+
+Tensor sum(const Tensor& input, const std::vector<int>& dims, bool keepdim) {
+    Reduction reduction{};
+    std::vector<int> reduced_shape{};
+    std::vector<int> shape{};
+    prepare_reduction(input, dims, keepdim, reduction, reduced_shape, shape);
+    Tensor output{ shape, input.device };
+    return sum(input, dims, keepdim, output);
 }
 
-Tensor batch_sum(const Tensor& input) {
-    Tensor output{ {1, input.shape.back()} };
-    batch_sum<<<(output.n_elements + 255) / 256, 256>>>(output.n_elements, input.shape[0], input.shape.back(), input.data.get(), output.data.get());
+Tensor& sum(const Tensor& input, const std::vector<int>& dims, bool keepdim, Tensor& output) {
+    Reduction reduction{};
+    std::vector<int> reduced_shape{};
+    std::vector<int> shape{};
+    prepare_reduction(input, dims, keepdim, reduction, reduced_shape, shape);
+    require_output(output, shape, input.device, {&input});
+    backend(output.device).sum(reduction, input.data.get(), output.data.get());
+    output.backward_pointer = nullptr;
+    if (input.backward_pointer) output.backward_pointer = std::shared_ptr<Backward>{ new SumBackward{ input.shape, reduced_shape, input.backward_pointer } };
+    modified(output);
     return output;
 }
 
 std::ostream& operator<< (std::ostream& out, const Tensor& tensor) {
+    const std::vector<float> elements{ tensor.to_host() };
     std::vector<int> indices(tensor.rank, 0);
     out << std::string(tensor.rank, '[');
     for (int i = 0; i < tensor.n_elements; ++i) {
-        out << tensor[indices] << ", ";
+        out << elements[i] << ", ";
         for (int j = tensor.rank - 1; j >= 0; --j) {
             if (indices[j] < (tensor.shape[j] - 1)) {
                 out << std::string(tensor.rank - 1 - j, '[');
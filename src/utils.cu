@@ -1,37 +1,111 @@
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
 #include "utils.h"
 #include "tensor.h"
+#include "perceptron.h"
 
-void prepare_broadcast(const Tensor& tensor1, const Tensor& tensor2, size_t** d_tensor1_strides, size_t** d_tensor2_strides, size_t** d_strides, Tensor& sum) {
-    std::vector<int> shape{ tensor1.shape };
-    size_t tensor1_strides[tensor1.rank]{ 0 };
-    size_t tensor2_strides[tensor2.rank]{ 0 };
-    for (int i = 0; i < tensor1.rank; ++i) {
-        if (tensor1.shape[i] == tensor2.shape[i]) {
-            tensor1_strides[i] = tensor1.strides[i];
-            tensor2_strides[i] = tensor2.strides[i];
+void require_float32(const Tensor& tensor) {
+    if (tensor.dtype != DType::float32) throw std::invalid_argument("operation requires float32 tensors");
+}
+
+std::vector<int> broadcast_shape(const Tensor& tensor1, const Tensor& tensor2) {
+    std::vector<int> shape(std::max(tensor1.rank, tensor2.rank), 1);
+    for (const Tensor* tensor : {&tensor1, &tensor2}) {
+        for (size_t i = 0; i < tensor->rank; ++i) {
+            int& dim{ shape[shape.size() - tensor->rank + i] };
+            if (tensor->shape[i] == 1) continue;
+            if (dim != 1 && dim != tensor->shape[i]) throw std::invalid_argument("shapes cannot be broadcast");
+            dim = tensor->shape[i];
         }
-        else if (tensor1.shape[i] > tensor2.shape[i]) {
-            tensor1_strides[i] = tensor1.strides[i];
+    }
+    return shape;
+}
+
+static size_t broadcast_stride(const Tensor& tensor, size_t dim, size_t rank) {
+    if (dim + tensor.rank < rank) return 0;
+    const size_t i{ dim + tensor.rank - rank };
+    return tensor.shape[i] == 1 ? 0 : tensor.strides[i];
+}
+
+void prepare_broadcast(const Tensor& tensor1, const Tensor& tensor2, const Tensor& output, Broadcast& broadcast) {
+    if (tensor1.device != output.device || tensor2.device != output.device) throw std::invalid_argument("tensors are on different devices");
+    require_float32(tensor1);
+    require_float32(tensor2);
+    require_float32(output);
+    if (output.rank > max_rank) throw std::invalid_argument("tensor rank exceeds max_rank");
+    if (broadcast_shape(tensor1, tensor2) != output.shape) throw std::invalid_argument("output shape does not match the broadcast shape");
+    broadcast.contiguous = tensor1.shape == output.shape && tensor2.shape == output.shape && tensor1.is_contiguous() && tensor2.is_contiguous() && output.is_contiguous();
+    broadcast.rank = output.rank;
+    size_t stride{ 1 };
+    for (size_t i = output.rank; i-- > 0;) {
+        if (output.shape[i] != 1 && !output.strides[i]) throw std::invalid_argument("cannot write to an expanded tensor");
+        broadcast.shape[i] = output.shape[i];
+        broadcast.strides[i] = stride;
+        broadcast.tensor1_strides[i] = broadcast_stride(tensor1, i, output.rank);
+        broadcast.tensor2_strides[i] = broadcast_stride(tensor2, i, output.rank);
+        broadcast.output_strides[i] = output.strides[i];
+        stride *= output.shape[i];
+    }
+}
+
+void prepare_reduction(const Tensor& input, const std::vector<int>& dims, bool keepdim, Reduction& reduction, std::vector<int>& reduced_shape, std::vector<int>& shape) {
+    if (input.rank > max_rank) throw std::invalid_argument("tensor rank exceeds max_rank");
+    std::vector<bool> reduced(input.rank, false);
+    for (int dim : dims) {
+        if (dim < 0) dim += input.rank;
+        if (dim < 0 || dim >= input.rank) throw std::out_of_range("reduction dim is out of range");
+        reduced[dim] = true;
+    }
+    shape.clear();
+    reduced_shape = input.shape;
+    reduction.n_outputs = 1;
+    reduction.n_reduced = 1;
+    reduction.kept_rank = 0;
+    reduction.reduced_rank = 0;
+    for (int i = 0; i < input.rank; ++i) {
+        if (reduced[i]) reduced_shape[i] = 1;
+        if (!reduced[i] || keepdim) shape.push_back(reduced_shape[i]);
+        if (input.shape[i] == 1) continue;
+        size_t& rank{ reduced[i] ? reduction.reduced_rank : reduction.kept_rank };
+        size_t* dim_shape{ reduced[i] ? reduction.reduced_shape : reduction.kept_shape };
+        size_t* dim_strides{ reduced[i] ? reduction.reduced_strides : reduction.kept_strides };
+        if (rank && dim_strides[rank - 1] == input.strides[i] * input.shape[i]) {
+            dim_shape[rank - 1] *= input.shape[i];
+            dim_strides[rank - 1] = input.strides[i];
         }
         else {
-            tensor2_strides[i] = tensor2.strides[i];
-            shape[i] = tensor2.shape[i];
+            dim_shape[rank] = input.shape[i];
+            dim_strides[rank] = input.strides[i];
+            ++rank;
         }
-
+        (reduced[i] ? reduction.n_reduced : reduction.n_outputs) *= input.shape[i];
     }
-    sum = Tensor{ shape };
-    const size_t strides_size = sum.rank * sizeof(size_t);
-    cudaMalloc(d_strides, strides_size);
-    cudaMalloc(d_tensor1_strides, strides_size);
-    cudaMalloc(d_tensor2_strides, strides_size);
-    cudaMemcpy(*d_strides, &sum.strides[0], strides_size, cudaMemcpyHostToDevice);
-    cudaMemcpy(*d_tensor1_strides, tensor1_strides, strides_size, cudaMemcpyHostToDevice);
-    cudaMemcpy(*d_tensor2_strides, tensor2_strides, strides_size, cudaMemcpyHostToDevice);
+    reduction.input_type = input.dtype;
 }
 
-float* dataMalloc(size_t size) {
-    float* data;
-    cudaMalloc(&data, size);
-    return data;
+bool prepare_perceptron(const Tensor& input, const std::vector<Tensor>& weights, const std::vector<Tensor>& biases, Perceptron& perceptron) {
+    const size_t n_layers{ weights.size() };
+    if (n_layers < 2 || n_layers > max_layers || biases.size() != n_layers || input.rank != 2 || input.dtype != DType::float32) return false;
+    const size_t width = weights[0].shape.back();
+    if (!perceptron_width_supported(width)) return false;
+    perceptron.n_layers = n_layers;
+    perceptron.input_dim = input.shape[1];
+    perceptron.width = width;
+    perceptron.output_dim = weights.back().shape.back();
+    perceptron.input_strides[0] = input.strides[0];
+    perceptron.input_strides[1] = input.strides[1];
+    for (size_t layer = 0; layer < n_layers; ++layer) {
+        const Tensor& layer_weights{ weights[layer] };
+        const Tensor& bias{ biases[layer] };
+        const size_t in_dim{ layer == 0 ? perceptron.input_dim : width };
+        const size_t out_dim{ layer == n_layers - 1 ? perceptron.output_dim : width };
+        if (layer_weights.device != input.device || bias.device != input.device) throw std::invalid_argument("tensors are on different devices");
+        if (layer_weights.dtype != DType::float32 || bias.dtype != DType::float32) return false;
+        if (layer_weights.rank != 2 || layer_weights.shape[0] != in_dim || layer_weights.shape[1] != out_dim || layer_weights.strides[0] != out_dim || layer_weights.strides[1] != 1) return false;
+        if (bias.n_elements != out_dim || bias.shape.back() != out_dim || bias.strides.back() != 1) return false;
+        perceptron.weights[layer] = layer_weights.data.get();
+        perceptron.biases[layer] = bias.data.get();
+    }
+    return true;
 }